@@ -0,0 +1,336 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "cacheio.h"
+#include "log.h"
+#include "log_sections.h"
+#include "stats.h"
+#include "util.h"
+
+/* Cache file I/O through io_uring.
+ *
+ * With io_uring=true, and fusedav built against liburing, the cache file
+ * writes and unlinks which a thread need not wait for go through a ring of
+ * its own instead of blocking it:
+ *
+ * - Downloads hand each full response buffer to the ring and go on taking
+ *   the body into a second one, so the network and the disk overlap.
+ * - Cache files which nothing references any more are unlinked behind the
+ *   caller's back; failures are logged when the completion comes in.
+ * - Cleanup submits its unlinks in batches of up to CACHEIO_ENTRIES.
+ *
+ * Reads and writes from FUSE stay plain pread and pwrite: the reply has to
+ * wait for the data either way, so a ring would only add a round trip.
+ * Where the kernel or the build lacks io_uring, or a ring can't be set up
+ * for a thread, everything falls back to the plain syscalls. Threads come
+ * and go (FUSE's, and a download's range workers), so when one exits, what
+ * it still has in flight is waited for and its ring torn down.
+ */
+
+#define CACHEIO_ENTRIES 64
+
+static bool uring_on = false;
+
+bool cacheio_enabled(void) {
+    return uring_on;
+}
+
+#ifdef HAVE_LIBURING
+
+// Each thread gets its own ring, so submission needs no lock
+struct thread_ring {
+    struct io_uring ring;
+    unsigned inflight; // submitted and not yet reaped
+};
+
+static __thread struct thread_ring *current_ring = NULL;
+static __thread bool thread_ring_failed = false;
+static pthread_key_t thread_ring_key;
+static pthread_once_t thread_ring_once = PTHREAD_ONCE_INIT;
+
+static void reap_ready(struct thread_ring *tring, bool exiting);
+
+// Wait for at least one completion. There is no giving up on an entry once
+// it may have reached the kernel, since it writes into its buffer and op
+// whenever it completes: entries still queued are submitted again until they
+// go, and once all of them have, we block until a completion comes in.
+static void ring_wait(struct thread_ring *tring, const char *caller) {
+    struct io_uring_cqe *cqe;
+    bool logged = false;
+    int ret;
+
+    for (;;) {
+        ret = io_uring_submit_and_wait(&tring->ring, 1);
+        if (ret >= 0 || ret == -EINTR || ret == -EAGAIN || ret == -EBUSY) return;
+        if (!logged) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_IO, "%s: io_uring_submit_and_wait failed: %s; %u in flight, retrying",
+                caller, strerror(-ret), tring->inflight);
+            logged = true;
+        }
+        if (io_uring_sq_ready(&tring->ring) == 0) {
+            ret = io_uring_wait_cqe(&tring->ring, &cqe);
+            if (ret == 0 || ret == -EINTR) return;
+        }
+        usleep(1000);
+    }
+}
+
+// Runs as the thread exits: wait out what it has in flight, so no path leaks,
+// no error goes unlogged and no write lands in a freed ring, then give the
+// ring back
+static void thread_ring_destroy(void *ptr) {
+    struct thread_ring *tring = ptr;
+
+    while (tring->inflight > 0) {
+        ring_wait(tring, "thread_ring_destroy");
+        reap_ready(tring, true);
+    }
+    io_uring_queue_exit(&tring->ring);
+    free(tring);
+    current_ring = NULL;
+}
+
+static void thread_ring_key_create(void) {
+    pthread_key_create(&thread_ring_key, thread_ring_destroy);
+}
+
+static struct thread_ring *ring_get(void) {
+    struct thread_ring *tring;
+    int ret;
+
+    if (!uring_on || thread_ring_failed) return NULL;
+    if (current_ring) return current_ring;
+
+    pthread_once(&thread_ring_once, thread_ring_key_create);
+    tring = calloc(1, sizeof(struct thread_ring));
+    if (tring == NULL) {
+        thread_ring_failed = true;
+        return NULL;
+    }
+    ret = io_uring_queue_init(CACHEIO_ENTRIES, &tring->ring, 0);
+    if (ret < 0) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_IO, "ring_get: io_uring_queue_init failed: %s; using syscalls on this thread",
+            strerror(-ret));
+        free(tring);
+        thread_ring_failed = true;
+        return NULL;
+    }
+    pthread_setspecific(thread_ring_key, tring);
+    current_ring = tring;
+    return tring;
+}
+
+// Detached unlinks carry their path, with the low bit set; everything else is
+// a struct cacheio_op somebody will wait on. A thread exiting has nobody
+// left to wait, and the op went with the stack it was on.
+static void complete(struct io_uring_cqe *cqe, bool exiting) {
+    uintptr_t data = (uintptr_t) io_uring_cqe_get_data(cqe);
+
+    if (data & 1) {
+        char *path = (char *) (data & ~(uintptr_t) 1);
+        if (cqe->res < 0) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_IO, "complete: error unlinking %s: %s", path, strerror(-cqe->res));
+        }
+        free(path);
+    }
+    else if (exiting) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_IO, "complete: write still in flight at thread exit: %d", cqe->res);
+    }
+    else {
+        struct cacheio_op *op = (struct cacheio_op *) data;
+        op->res = cqe->res;
+        op->pending = false;
+    }
+}
+
+static void reap_ready(struct thread_ring *tring, bool exiting) {
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe(&tring->ring, &cqe) == 0) {
+        complete(cqe, exiting);
+        io_uring_cqe_seen(&tring->ring, cqe);
+        --tring->inflight;
+    }
+}
+
+// A full submission queue is sent off to make room. Every entry handed out
+// counts as in flight from here on.
+static struct io_uring_sqe *sqe_get(struct thread_ring *tring) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&tring->ring);
+
+    if (sqe == NULL) {
+        io_uring_submit(&tring->ring);
+        reap_ready(tring, false);
+        sqe = io_uring_get_sqe(&tring->ring);
+    }
+    if (sqe) ++tring->inflight;
+    return sqe;
+}
+
+#endif
+
+// Use io_uring if enabled and the kernel has what we need
+void cacheio_init(bool enabled) {
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    struct io_uring_probe *probe;
+    int ret;
+
+    if (!enabled) return;
+
+    ret = io_uring_queue_init(CACHEIO_ENTRIES, &ring, 0);
+    if (ret < 0) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_IO, "cacheio_init: io_uring unavailable: %s; using syscalls", strerror(-ret));
+        return;
+    }
+    // Unlinks came to io_uring later than writes (5.11)
+    probe = io_uring_get_probe_ring(&ring);
+    if (probe && io_uring_opcode_supported(probe, IORING_OP_WRITE) &&
+            io_uring_opcode_supported(probe, IORING_OP_UNLINKAT)) {
+        uring_on = true;
+    }
+    else {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_IO, "cacheio_init: kernel's io_uring lacks write or unlinkat; using syscalls");
+    }
+    if (probe) io_uring_free_probe(probe);
+    io_uring_queue_exit(&ring);
+
+    if (uring_on) log_print(LOG_NOTICE, SECTION_FILECACHE_IO, "cacheio_init: cache file I/O through io_uring");
+#else
+    if (enabled) log_print(LOG_NOTICE, SECTION_FILECACHE_IO, "cacheio_init: built without liburing; using syscalls");
+#endif
+}
+
+// Start a pwrite on the calling thread's ring. Returns false if it could not
+// be submitted, and the caller should write by hand; otherwise buf must stay
+// put until cacheio_wait on the same thread. (The arguments go unused in
+// builds without liburing.)
+bool cacheio_pwrite_submit(__unused struct cacheio_op *op, __unused int fd, __unused const void *buf,
+        __unused size_t size, __unused off_t offset) {
+#ifdef HAVE_LIBURING
+    struct thread_ring *tring = ring_get();
+    struct io_uring_sqe *sqe;
+
+    if (tring == NULL) return false;
+    reap_ready(tring, false);
+    sqe = sqe_get(tring);
+    if (sqe == NULL) return false;
+
+    io_uring_prep_write(sqe, fd, buf, size, offset);
+    io_uring_sqe_set_data(sqe, op);
+    op->res = 0;
+    op->pending = true;
+    // A failed submit leaves the entry queued; cacheio_wait submits again
+    io_uring_submit(&tring->ring);
+    BUMP(filecache_uring_writes);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Wait for op to complete; returns what the write returned, or -errno
+int cacheio_wait(struct cacheio_op *op) {
+#ifdef HAVE_LIBURING
+    struct thread_ring *tring = ring_get();
+
+    while (op->pending && tring) {
+        ring_wait(tring, "cacheio_wait");
+        reap_ready(tring, false);
+    }
+#endif
+    return op->res;
+}
+
+// Unlink path without waiting for it
+void cacheio_unlink(const char *path) {
+#ifdef HAVE_LIBURING
+    struct thread_ring *tring = ring_get();
+
+    if (tring) {
+        char *copy = strdup(path);
+        struct io_uring_sqe *sqe = NULL;
+
+        if (copy) {
+            reap_ready(tring, false);
+            sqe = sqe_get(tring);
+        }
+        if (sqe) {
+            io_uring_prep_unlinkat(sqe, AT_FDCWD, copy, 0);
+            io_uring_sqe_set_data(sqe, (void *) ((uintptr_t) copy | 1));
+            io_uring_submit(&tring->ring);
+            BUMP(filecache_uring_unlinks);
+            return;
+        }
+        free(copy);
+        BUMP(filecache_uring_fallbacks);
+    }
+#endif
+    if (unlink(path)) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_IO, "cacheio_unlink: error unlinking %s: %s", path, strerror(errno));
+    }
+}
+
+// Unlink all of paths, and set errors[i] to 0 or the errno for paths[i]
+void cacheio_unlink_batch(char **paths, int count, int *errors) {
+    int done = 0;
+
+#ifdef HAVE_LIBURING
+    struct thread_ring *tring = ring_get();
+    struct cacheio_op *ops = tring ? calloc(count, sizeof(struct cacheio_op)) : NULL;
+
+    if (ops) {
+        int submitted;
+
+        // sqe_get sends the queue off whenever it fills
+        for (submitted = 0; submitted < count; submitted++) {
+            struct io_uring_sqe *sqe = sqe_get(tring);
+            if (sqe == NULL) break;
+            io_uring_prep_unlinkat(sqe, AT_FDCWD, paths[submitted], 0);
+            io_uring_sqe_set_data(sqe, &ops[submitted]);
+            ops[submitted].pending = true;
+        }
+        for (done = 0; done < submitted; done++) {
+            int res = cacheio_wait(&ops[done]);
+            errors[done] = (res < 0) ? -res : 0;
+        }
+        TIMING(filecache_uring_unlinks, done);
+        if (done < count) BUMP(filecache_uring_fallbacks);
+        free(ops);
+    }
+#endif
+    for (; done < count; done++) {
+        errors[done] = unlink(paths[done]) ? errno : 0;
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef foocacheiohfoo
+#define foocacheiohfoo
+
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A write in flight on the calling thread's ring
+struct cacheio_op {
+    int res; // bytes written, or -errno
+    bool pending;
+};
+
+void cacheio_init(bool enabled);
+bool cacheio_enabled(void);
+bool cacheio_pwrite_submit(struct cacheio_op *op, int fd, const void *buf, size_t size, off_t offset);
+int cacheio_wait(struct cacheio_op *op);
+void cacheio_unlink(const char *path);
+void cacheio_unlink_batch(char **paths, int count, int *errors);
+
+#endif
@@ -21,14 +21,18 @@
 #endif
 
 #include <unistd.h>
+#include <pthread.h>
 #include <dirent.h>
 #include <assert.h>
 #include <errno.h>
 #include <libgen.h>
 #include <stdbool.h>
-#include <sys/file.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 #include <curl/curl.h>
 
 #include "filecache.h"
@@ -40,10 +44,17 @@
 #include "session.h"
 #include "fusedav_config.h"
 #include "fusedav-statsd.h"
+#include "cacheio.h"
 
 #define REFRESH_INTERVAL 3
 #define CACHE_FILE_ENTROPY 20
 
+// Cache files live in <cache_path>/files/xx/yy/, two levels of hashed shards,
+// so no single directory grows to hundreds of thousands of entries
+#define FILES_SHARD_FANOUT 256
+// Threads walking the shards during cleanup
+#define CLEANUP_WORKERS 8
+
 // Remove filecache files older than 8 days
 #define AGE_OUT_THRESHOLD 691200
 
@@ -62,36 +73,309 @@ static const char * forensic_haven_dir = "forensic-haven";
 
 typedef int fd_t;
 
+// @TODO Where to find ETAG_MAX?
+#define ETAG_MAX 256
+
+// Persistent data stored in leveldb
+// If the file is small enough to be stored inline, filename is empty and the
+// file's content follows the struct in the same leveldb value.
+struct filecache_pdata {
+    char filename[PATH_MAX];
+    char etag[ETAG_MAX + 1];
+    time_t last_server_update;
+};
+
+#define PDATA_INLINE(pdata) ((pdata)->filename[0] == '\0')
+
+// Files up to this size are stored inline; 0 disables
+static off_t inline_file_size = 0;
+// Serializes moving files into and out of leveldb
+static pthread_mutex_t inline_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Large files go up in ranges of this many bytes, if the server takes
+// Content-Range PUTs; 0 to always send the whole file
+static off_t upload_chunk_size = 0;
+
+// Paths matching one of these (local_only_paths) are never sent to the
+// server: no PUT, MKCOL, MOVE or DELETE, and no PROPFIND or GET to look them
+// up. They live only in the stat and file caches. A pattern with a '/' is
+// matched against the whole path, any other against the name; a directory
+// which matches takes everything under it along.
+static GPtrArray *local_only_names = NULL;
+static GPtrArray *local_only_paths = NULL;
+
+// Pipelined PUT: a session which only appends to an empty file starts
+// uploading it once it has written PIPELINE_START_SIZE bytes, streaming the
+// body (chunked transfer-encoding) as the writes arrive, so release only has
+// to wait for the tail. Any other write or a truncation abandons the stream,
+// and release falls back to an ordinary PUT.
+static bool pipelined_put = false;
+
+// Append uploads: a writer whose writes all landed at or past the size the
+// server's copy had when the session opened (synced_size, as of base_etag)
+// only has to send what it appended. That goes as a Content-Range PUT of the
+// tail with If-Match, so it can only extend the version it was cut from;
+// whatever the server refuses is sent again whole.
+static bool append_put = false;
+
+// Split GET: a file the stat cache says is at least parallel_get_size bytes is
+// fetched as ranges side by side, parallel_get_streams at a time, each on its
+// own connection and, where there are several healthy nodes, its own node.
+// The first GET asks only for PARALLEL_GET_HEAD bytes, which pins the etag and
+// total size the other ranges are checked against; a server which ignores the
+// Range header just sends the whole file, as before. 0 to always GET whole.
+static off_t parallel_get_size = 0;
+static int parallel_get_streams = 0;
+#define PARALLEL_GET_HEAD (1024 * 1024)
+
+// Page-cache policy for cache fds (fadvise). A session whose reads follow on
+// from each other READ_SEQUENTIAL_RUN times is a sequential reader: its fd
+// gets POSIX_FADV_SEQUENTIAL, and WILLNEED for a window ahead of the cursor.
+// If the file is at least fadvise_stream_size bytes it is taken for a one-shot
+// stream, a media file or a backup going past, and what lies a window behind
+// the cursor gets DONTNEED so it doesn't push the hot small files out of the
+// page cache. Files under a window, writers, and files other sessions have
+// open are left alone. With direct_downloads, GET bodies of stream-sized
+// files go into the cache file with O_DIRECT and skip the page cache too.
+static bool fadvise_enabled = false;
+static off_t fadvise_stream_size = 0;
+static bool direct_downloads = false;
+#define READ_SEQUENTIAL_RUN 4
+#define READ_ADVISE_WINDOW (4 * 1024 * 1024)
+// The kernel has several reads of one file in flight at once, so they can
+// arrive a little out of order and still be sequential
+#define READ_SKEW (1024 * 1024)
+
+// Stale-while-revalidate: a read-only open of a file whose cached copy is
+// past REFRESH_INTERVAL, but no older than the bound stale_while_revalidate
+// gives its path, gets the cached copy at once. The conditional GET goes to a
+// revalidator thread instead, and whatever it brings back is there for the
+// next open. Patterns match as for local_only_paths: one with a '/' against
+// the whole path, any other against the name.
+struct stale_bound {
+    GPatternSpec *spec;
+    bool whole_path;
+    time_t max_age; // seconds since last_server_update
+};
+static GPtrArray *stale_bounds = NULL;
+#define STALE_REVALIDATORS 2
+
+// All but stale_bounds protected by stale_mutex; queued holds the paths in
+// the queue or being revalidated, so each is checked at most once at a time
+static filecache_t *stale_cache = NULL;
+static char *stale_cache_path = NULL;
+static GQueue *stale_queue = NULL;
+static GHashTable *stale_queued = NULL;
+static pthread_mutex_t stale_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stale_cond = PTHREAD_COND_INITIALIZER;
+
+#define PIPELINE_START_SIZE (1024 * 1024)
+// Abandon the stream if the writer goes quiet for this long, rather than
+// hold a request open on the server
+#define PIPELINE_IDLE_MAX 30 // seconds
+
+struct put_stream {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    char *path;
+    fd_t fd;
+    off_t sent; // read by the uploader so far
+    off_t written; // appended by the writer so far
+    bool finished; // the writer is done; end the body at written
+    bool abandoned; // end the body with an error, so the server discards it
+    CURLcode res;
+    long response_code;
+    char etag[ETAG_MAX + 1];
+};
+
+// Protects append_offset and stream in every session
+static pthread_mutex_t pipeline_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// A descriptor on a cache file which several sessions can share.
+// Only read-only sessions share one; writers each have their own
+// descriptor and coordinate with PUT through the file's cache_lock.
+struct cache_fd {
+    fd_t fd;
+    unsigned refcount; // sessions using it, plus the open_file caching it
+    char *filename;
+};
+
+// Shared state for a path which is open, or was recently opened.
+// It holds the in-memory copy of the path's pdata, so repeated opens and
+// syncs don't go back to leveldb; changes are still written through to
+// leveldb at the points where pdata actually changes (open, PUT, first
+// local modification, move). It also caches a read-only descriptor, so a
+// read-only open within the freshness window costs no syscalls at all.
+// Once the last session closes, the object is kept for REFRESH_INTERVAL
+// seconds so the next open can still reuse it.
+struct open_file {
+    char *path; // key in open_files while attached
+    struct filecache_pdata pdata;
+    struct cache_fd *cfd;
+    unsigned refcount; // sessions which have the path open
+    bool attached; // false once the path has been deleted or replaced
+    time_t last_used; // when refcount last dropped to 0
+    off_t written_size; // size + 1 as left by this mount's writes; 0 if none. Atomic, no mutex
+    unsigned reads; // read-only opens, which make a file hot enough for the RAM tier
+};
+
+// Keep at most this many unused open_file objects (and their descriptors) around
+#define OPEN_FILE_IDLE_MAX 1024
+
 // Session data
 struct filecache_sdata {
-    fd_t fd; // LOCK_SH for write/truncation; LOCK_EX during PUT
+    fd_t fd; // its cache_lock is shared for write/truncation; exclusive during PUT
     bool readable;
     bool writable;
     bool modified;
     int error_code;
+    struct open_file *ofile;
+    struct cache_lock *lock; // writable sessions only
+    struct cache_fd *cfd; // set if fd is shared; fd == cfd->fd
+    bool is_inline; // read-only session on an inline file; fd is -1
+    char *idata;
+    size_t isize;
+    unsigned long writes; // bumped by every write and truncation, so a PUT can tell it missed some
+    bool size_known; // size is tracked in memory once the session writes or truncates
+    off_t size;
+    time_t stat_flushed; // when the writer last pushed its size to the stat cache
+    off_t append_offset; // where the next write must land to keep the session pipelinable; -1 if it isn't
+    struct put_stream *stream; // pipelined PUT of this session's writes, if one was started
+    char base_etag[ETAG_MAX + 1]; // server version the session's content started as, if known to be current
+    off_t synced_size; // size of base_etag's content while nothing below it was written; 0 if unknown
+    bool created; // the session created the file
+    off_t read_next; // where a sequential reader's next read would start
+    int read_run; // reads in a row which started near read_next
+    off_t read_size; // size of the file when the page-cache policy first looked; 0 until then
+    off_t read_ahead; // WILLNEED has been given up to here
+    off_t read_dropped; // DONTNEED has been given up to here
+    bool ram_dropped; // the RAM tier has been told the session changes the file
 };
 
-// @TODO Where to find ETAG_MAX?
-#define ETAG_MAX 256
+// path -> struct open_file; protected by open_files_mutex, which also
+// protects the refcounts of the open_file and cache_fd objects
+static GHashTable *open_files = NULL;
+static unsigned open_files_idle = 0;
+static pthread_mutex_t open_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// In-process lock on a cache file, shared by every session and uploader
+// using it. Writes and truncations take it shared; a PUT takes it exclusive
+// so the file can't change under the upload. All users of cache files live
+// in this process, so this replaces flock and costs no syscalls unless the
+// lock is contended. It prefers writers, so a steady stream of writes can't
+// starve an upload.
+struct cache_lock {
+    pthread_rwlock_t rwlock;
+    char *filename; // key in cache_locks
+    unsigned refcount;
+};
 
-// Persistent data stored in leveldb
-struct filecache_pdata {
-    char filename[PATH_MAX];
-    char etag[ETAG_MAX + 1];
-    time_t last_server_update;
+// Neither side waits forever; a timeout fails the write or the PUT
+#define CACHE_LOCK_WAIT_MAX 60 // seconds
+
+// Older kernel headers lack the reflink ioctl; the kernel may still have it
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// filename -> struct cache_lock; protected by cache_locks_mutex
+static GHashTable *cache_locks = NULL;
+static pthread_mutex_t cache_locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// A GET in progress for a path. Concurrent opens which also need to go to
+// the server wait for it and share its outcome instead of issuing their own.
+struct inflight_fetch {
+    pthread_cond_t cond;
+    unsigned refcount; // the fetching thread plus its waiters
+    bool done;
+    long response_code;
+    bool have_pdata;
+    struct filecache_pdata pdata;
+    GError *gerr;
 };
 
+// path -> struct inflight_fetch; protected by inflight_mutex
+static GHashTable *inflight_fetches = NULL;
+static pthread_mutex_t inflight_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Write-back mode: closing a modified file records a journal entry (key
+// "wb:<path>") in leveldb and returns; uploader threads do the PUT later.
+// Until then the pdata keeps last_server_update = 0, so opens use the local copy.
+static const char * writeback_prefix = "wb:";
+
+struct writeback_record {
+    time_t queued_at; // when the newest version was closed
+    unsigned long generation; // bumped on every close, so an upload can tell it was overtaken
+    unsigned attempts;
+    bool created; // no version of the path has reached the server yet
+};
+
+// Retry failed uploads with backoff, then give up and use the forensic haven
+#define WRITEBACK_MAX_ATTEMPTS 10
+#define WRITEBACK_MAX_BACKOFF 64
+
+struct writeback_item {
+    char *path;
+    time_t not_before;
+};
+
+// The journal and its uploaders also run without write-back mode if new
+// files are deferred (new_file_delay > 0): a file created on this mount
+// waits that many seconds after close before it is uploaded, so a
+// temp-file-then-rename save uploads once, under the final name, and the
+// rename needs no MOVE on the server.
+static bool writeback_running = false;
+static int new_file_delay = 0;
+
+// All protected by writeback_mutex. queued holds the paths in the queue, so
+// each is in it at most once; held holds paths whose server copy is being
+// changed, by an upload or by a rename or unlink which must not overlap one;
+// held_prefixes holds the directories being renamed, which cover everything
+// under them.
+static bool writeback_enabled = false;
+static filecache_t *writeback_cache = NULL;
+static char *writeback_cache_path = NULL;
+static GQueue *writeback_queue = NULL;
+static GHashTable *writeback_queued = NULL;
+static GHashTable *writeback_held = NULL;
+static GHashTable *writeback_held_prefixes = NULL;
+static pthread_mutex_t writeback_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeback_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writeback_held_cond = PTHREAD_COND_INITIALIZER;
+
 // GError mechanisms
 static G_DEFINE_QUARK(FC, filecache)
 static G_DEFINE_QUARK(SYS, system)
 static G_DEFINE_QUARK(LDB, leveldb)
 static G_DEFINE_QUARK(CURL, curl)
 
-void filecache_init(char *cache_path, GError **gerr) {
+void filecache_init(char *cache_path, int inline_size, int upload_chunk_mb, bool pipeline_puts, bool append_puts,
+        GError **gerr) {
     char path[PATH_MAX];
 
     BUMP(filecache_init);
 
+    if (inline_size > 0) {
+        inline_file_size = inline_size;
+        log_print(LOG_NOTICE, SECTION_FILECACHE_CACHE, "filecache_init: storing files up to %d bytes inline", inline_size);
+    }
+
+    if (upload_chunk_mb > 0) {
+        upload_chunk_size = (off_t) upload_chunk_mb * 1024 * 1024;
+        log_print(LOG_NOTICE, SECTION_FILECACHE_CACHE, "filecache_init: uploading large files in %d MB ranges where the server allows", upload_chunk_mb);
+    }
+
+    if (pipeline_puts) {
+        pipelined_put = true;
+        log_print(LOG_NOTICE, SECTION_FILECACHE_CACHE, "filecache_init: uploading files while they are appended to");
+    }
+
+    if (append_puts) {
+        append_put = true;
+        log_print(LOG_NOTICE, SECTION_FILECACHE_CACHE, "filecache_init: uploading only what was appended where the server allows");
+    }
+
     if (mkdir(cache_path, 0770) == -1) {
         if (errno != EEXIST || inject_error(filecache_error_init1)) {
             g_set_error (gerr, system_quark(), errno, "filecache_init: Cache Path %s could not be created.", cache_path);
@@ -114,9 +398,644 @@ void filecache_init(char *cache_path, GError **gerr) {
             return;
         }
     }
+
+    pthread_mutex_lock(&open_files_mutex);
+    if (open_files == NULL) {
+        open_files = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    pthread_mutex_unlock(&open_files_mutex);
+
+    pthread_mutex_lock(&inflight_mutex);
+    if (inflight_fetches == NULL) {
+        inflight_fetches = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    }
+    pthread_mutex_unlock(&inflight_mutex);
+
+    pthread_mutex_lock(&cache_locks_mutex);
+    if (cache_locks == NULL) {
+        cache_locks = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    pthread_mutex_unlock(&cache_locks_mutex);
+
     return;
 }
 
+void filecache_parallel_get_init(int size_mb, int streams) {
+    if (size_mb <= 0 || streams < 2) return;
+    parallel_get_size = (off_t) size_mb * 1024 * 1024;
+    parallel_get_streams = streams;
+    log_print(LOG_NOTICE, SECTION_FILECACHE_CACHE, "filecache_parallel_get_init: fetching files of %d MB or more in %d ranges at once where the server allows",
+        size_mb, streams);
+}
+
+void filecache_fadvise_init(bool enable, int stream_mb, bool direct) {
+    fadvise_enabled = enable;
+    if (stream_mb > 0) fadvise_stream_size = (off_t) stream_mb * 1024 * 1024;
+    direct_downloads = direct && fadvise_stream_size > 0;
+    if (enable || direct_downloads) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_CACHE, "filecache_fadvise_init: fadvise %d, streams from %d MB, direct downloads %d",
+            enable, stream_mb, direct_downloads);
+    }
+}
+
+// patterns is ';'-separated, e.g. "*.swp;.~lock.*;/tmp"
+void filecache_local_only_init(const char *patterns) {
+    char **list;
+
+    if (patterns == NULL) return;
+    list = g_strsplit(patterns, ";", -1);
+    for (int idx = 0; list[idx]; idx++) {
+        char *pattern = g_strstrip(list[idx]);
+        GPtrArray **specs = strchr(pattern, '/') ? &local_only_paths : &local_only_names;
+        if (pattern[0] == '\0') continue;
+        if (*specs == NULL) *specs = g_ptr_array_new();
+        g_ptr_array_add(*specs, g_pattern_spec_new(pattern));
+        log_print(LOG_NOTICE, SECTION_FILECACHE_CACHE, "filecache_local_only_init: keeping %s local", pattern);
+    }
+    g_strfreev(list);
+}
+
+static bool local_only_match(GPtrArray *specs, const char *string) {
+    if (specs == NULL) return false;
+    for (unsigned idx = 0; idx < specs->len; idx++) {
+        if (g_pattern_match_string(g_ptr_array_index(specs, idx), string)) return true;
+    }
+    return false;
+}
+
+bool filecache_local_only(const char *path) {
+    char prefix[PATH_MAX];
+    size_t len;
+
+    if ((local_only_names == NULL && local_only_paths == NULL) || path == NULL) return false;
+    len = strlen(path);
+    if (len >= PATH_MAX) return false;
+
+    // Try path and each of its ancestors, as /a, /a/b, /a/b/c
+    for (size_t end = 1; end <= len; end++) {
+        const char *name;
+        if (end < len && path[end] != '/') continue;
+        // Directories may come with a trailing slash
+        if (end == len && end > 1 && path[end - 1] == '/') break;
+        memcpy(prefix, path, end);
+        prefix[end] = '\0';
+        name = strrchr(prefix, '/');
+        name = name ? name + 1 : prefix;
+        if (local_only_match(local_only_names, name) || local_only_match(local_only_paths, prefix)) return true;
+    }
+    return false;
+}
+
+// Take a reference on the lock for a cache file, creating it if need be
+static struct cache_lock *cache_lock_acquire(const char *filename) {
+    struct cache_lock *lock;
+
+    pthread_mutex_lock(&cache_locks_mutex);
+    lock = cache_locks ? g_hash_table_lookup(cache_locks, filename) : NULL;
+    if (lock == NULL && cache_locks) {
+        pthread_rwlockattr_t attr;
+
+        lock = calloc(1, sizeof(struct cache_lock));
+        if (lock) {
+            pthread_rwlockattr_init(&attr);
+            pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+            pthread_rwlock_init(&lock->rwlock, &attr);
+            pthread_rwlockattr_destroy(&attr);
+            lock->filename = strdup(filename);
+            g_hash_table_insert(cache_locks, lock->filename, lock);
+        }
+    }
+    if (lock) ++lock->refcount;
+    pthread_mutex_unlock(&cache_locks_mutex);
+
+    return lock;
+}
+
+static void cache_lock_unref(struct cache_lock *lock) {
+    if (lock == NULL) return;
+
+    pthread_mutex_lock(&cache_locks_mutex);
+    if (--lock->refcount == 0) {
+        g_hash_table_remove(cache_locks, lock->filename);
+        pthread_rwlock_destroy(&lock->rwlock);
+        free(lock->filename);
+        free(lock);
+    }
+    pthread_mutex_unlock(&cache_locks_mutex);
+}
+
+// Lock shared (writers) or exclusive (uploads), waiting at most CACHE_LOCK_WAIT_MAX.
+// A NULL lock means the caller has nothing to coordinate with.
+static void cache_lock_take(struct cache_lock *lock, bool exclusive, GError **gerr) {
+    struct timespec start;
+    struct timespec deadline;
+    struct timespec end;
+    long waited;
+    int ret;
+
+    if (lock == NULL) return;
+
+    ret = exclusive ? pthread_rwlock_trywrlock(&lock->rwlock) : pthread_rwlock_tryrdlock(&lock->rwlock);
+    if (ret != EBUSY) goto finish;
+
+    // Contended: a writer waits for an upload, or an upload for writes in progress
+    if (exclusive) BUMP(filecache_lock_upload_waits);
+    else BUMP(filecache_lock_write_waits);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CACHE_LOCK_WAIT_MAX;
+    ret = exclusive ? pthread_rwlock_timedwrlock(&lock->rwlock, &deadline) : pthread_rwlock_timedrdlock(&lock->rwlock, &deadline);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    waited = ((end.tv_sec - start.tv_sec) * 1000) + ((end.tv_nsec - start.tv_nsec) / (1000 * 1000));
+    if (exclusive) TIMING(filecache_lock_upload_wait_ms, waited);
+    else TIMING(filecache_lock_write_wait_ms, waited);
+    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "cache_lock_take: waited %ld ms for %s lock on %s",
+        waited, exclusive ? "exclusive" : "shared", lock->filename);
+
+finish:
+    if (ret) {
+        if (ret == ETIMEDOUT) BUMP(filecache_lock_timeouts);
+        g_set_error(gerr, system_quark(), ret, "cache_lock_take: %s lock on %s failed", exclusive ? "exclusive" : "shared", lock->filename);
+    }
+}
+
+static void cache_lock_drop(struct cache_lock *lock) {
+    if (lock) pthread_rwlock_unlock(&lock->rwlock);
+}
+
+// Caller holds open_files_mutex
+static void cache_fd_unref(struct cache_fd *cfd) {
+    if (cfd == NULL || --cfd->refcount > 0) return;
+    log_print(LOG_DEBUG, SECTION_FILECACHE_FILE, "cache_fd_unref: closing shared fd %d on %s", cfd->fd, cfd->filename);
+    close(cfd->fd);
+    free(cfd->filename);
+    free(cfd);
+}
+
+// Caller holds open_files_mutex
+static void open_file_free(struct open_file *entry) {
+    log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "open_file_free: freeing %s", entry->path);
+    cache_fd_unref(entry->cfd);
+    free(entry->path);
+    free(entry);
+}
+
+// Take the entry out of the table; frees it if no session still holds it.
+// Caller holds open_files_mutex
+static void open_file_detach(struct open_file *entry) {
+    if (entry->attached) {
+        g_hash_table_remove(open_files, entry->path);
+        entry->attached = false;
+        if (entry->refcount == 0) --open_files_idle;
+    }
+    if (entry->refcount == 0) open_file_free(entry);
+}
+
+// Caller holds open_files_mutex
+static struct open_file *open_file_lookup(const char *path) {
+    if (open_files == NULL || path == NULL) return NULL;
+    return g_hash_table_lookup(open_files, path);
+}
+
+// Copy of the path the entry is open under, or NULL once it has been detached
+static char *open_file_path(struct open_file *entry) {
+    char *path = NULL;
+
+    if (entry == NULL) return NULL;
+    pthread_mutex_lock(&open_files_mutex);
+    if (entry->attached) path = strdup(entry->path);
+    pthread_mutex_unlock(&open_files_mutex);
+    return path;
+}
+
+// Would get_fresh_fd serve this pdata without going to the server?
+static bool update_is_fresh(time_t last_server_update, bool use_local_copy) {
+    return use_local_copy || last_server_update == 0 ||
+        (time(NULL) - last_server_update) <= REFRESH_INTERVAL;
+}
+
+static bool pdata_is_fresh(const struct filecache_pdata *pdata, bool use_local_copy) {
+    return update_is_fresh(pdata->last_server_update, use_local_copy);
+}
+
+// Can a session opened with these flags use a shared descriptor?
+static bool shareable_flags(int flags) {
+    return (flags & O_ACCMODE) == O_RDONLY && !(flags & (O_CREAT | O_TRUNC | O_APPEND));
+}
+
+// Drop unused entries whose freshness window has passed. Caller holds open_files_mutex
+static void open_file_expire(time_t now) {
+    static time_t last_expire = 0;
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+
+    if (now - last_expire < REFRESH_INTERVAL && open_files_idle < OPEN_FILE_IDLE_MAX) return;
+    last_expire = now;
+
+    g_hash_table_iter_init(&iter, open_files);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        struct open_file *entry = value;
+        if (entry->refcount == 0 && now - entry->last_used > REFRESH_INTERVAL) {
+            g_hash_table_iter_remove(&iter);
+            entry->attached = false;
+            --open_files_idle;
+            open_file_free(entry);
+        }
+    }
+}
+
+// Try to satisfy an open entirely from the shared open_file for path.
+static bool open_file_reuse(const char *path, struct filecache_sdata *sdata, int flags, bool use_local_copy) {
+    struct open_file *entry;
+    bool reused = false;
+
+    if (!shareable_flags(flags)) return false;
+
+    pthread_mutex_lock(&open_files_mutex);
+    entry = open_file_lookup(path);
+    if (entry && entry->cfd && strcmp(entry->cfd->filename, entry->pdata.filename) == 0 &&
+            pdata_is_fresh(&entry->pdata, use_local_copy)) {
+        if (entry->refcount++ == 0) --open_files_idle;
+        ++entry->reads;
+        ++entry->cfd->refcount;
+        sdata->ofile = entry;
+        sdata->cfd = entry->cfd;
+        sdata->fd = entry->cfd->fd;
+        reused = true;
+    }
+    pthread_mutex_unlock(&open_files_mutex);
+
+    if (reused) {
+        BUMP(filecache_open_reuse);
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "open_file_reuse: %s shares fd %d", path, sdata->fd);
+    }
+    return reused;
+}
+
+// Take a session reference on the open_file for path, seeding it from pdata.
+// If the session's descriptor can be shared, it becomes the cached one.
+static struct open_file *open_file_acquire(const char *path, const struct filecache_pdata *pdata,
+        struct filecache_sdata *sdata, int flags) {
+    struct open_file *entry;
+
+    pthread_mutex_lock(&open_files_mutex);
+    entry = open_file_lookup(path);
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(struct open_file));
+        if (entry == NULL) {
+            pthread_mutex_unlock(&open_files_mutex);
+            return NULL;
+        }
+        entry->path = strdup(path);
+        entry->attached = true;
+        g_hash_table_insert(open_files, entry->path, entry);
+    }
+    else if (entry->refcount == 0) {
+        --open_files_idle;
+    }
+    // pdata has just been written to leveldb by the open, so it is the newest copy
+    entry->pdata = *pdata;
+    ++entry->refcount;
+    if (shareable_flags(flags)) ++entry->reads;
+
+    if (shareable_flags(flags) && sdata->fd >= 0) {
+        struct cache_fd *cfd = calloc(1, sizeof(struct cache_fd));
+        if (cfd) {
+            cfd->fd = sdata->fd;
+            cfd->filename = strdup(pdata->filename);
+            cfd->refcount = 2; // this session and the entry
+            cache_fd_unref(entry->cfd);
+            entry->cfd = cfd;
+            sdata->cfd = cfd;
+        }
+    }
+    pthread_mutex_unlock(&open_files_mutex);
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "open_file_acquire: %s refcount %u", path, entry->refcount);
+    return entry;
+}
+
+// Drop a session's references on its open_file and descriptor
+static void open_file_release(struct filecache_sdata *sdata) {
+    struct open_file *entry = sdata->ofile;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&open_files_mutex);
+    cache_fd_unref(sdata->cfd);
+    if (entry && --entry->refcount == 0) {
+        // The stat cache has the final size by now
+        entry->written_size = 0;
+        // Keep the entry for the next open unless it can no longer be reused
+        if (entry->attached && entry->cfd && open_files_idle < OPEN_FILE_IDLE_MAX) {
+            entry->last_used = now;
+            ++open_files_idle;
+        }
+        else {
+            open_file_detach(entry);
+        }
+    }
+    if (open_files) open_file_expire(now);
+    pthread_mutex_unlock(&open_files_mutex);
+
+    sdata->ofile = NULL;
+    sdata->cfd = NULL;
+}
+
+// Publish the size a session's write or truncate left the file at, so a
+// stat by path sees it before the stat cache does. Writes only grow it.
+static void open_file_set_size(struct open_file *entry, off_t size, bool grow_only) {
+    off_t current;
+
+    if (entry == NULL) return;
+    do {
+        current = entry->written_size;
+        if (grow_only && current > size) return;
+    } while (!__sync_bool_compare_and_swap(&entry->written_size, current, size + 1));
+}
+
+// Re-key the open_file for a path after a rename
+static void open_file_move(const char *old_path, const char *new_path) {
+    struct open_file *entry;
+    struct open_file *replaced;
+
+    pthread_mutex_lock(&open_files_mutex);
+    entry = open_file_lookup(old_path);
+    if (entry) {
+        replaced = open_file_lookup(new_path);
+        if (replaced) open_file_detach(replaced);
+        g_hash_table_remove(open_files, entry->path);
+        free(entry->path);
+        entry->path = strdup(new_path);
+        g_hash_table_insert(open_files, entry->path, entry);
+    }
+    pthread_mutex_unlock(&open_files_mutex);
+}
+
+// Does the session's pdata already say the local copy trumps the server one?
+static bool open_file_is_local(struct open_file *entry) {
+    bool is_local = false;
+
+    if (entry == NULL) return false;
+
+    pthread_mutex_lock(&open_files_mutex);
+    if (entry->attached) {
+        is_local = (entry->pdata.last_server_update == 0 && entry->pdata.etag[0] == '\0');
+    }
+    pthread_mutex_unlock(&open_files_mutex);
+
+    return is_local;
+}
+
+// Copy the in-memory pdata for path into a newly allocated pdata, if the path is open
+static struct filecache_pdata *open_file_copy(const char *path) {
+    struct filecache_pdata *pdata = NULL;
+    struct open_file *entry;
+
+    pthread_mutex_lock(&open_files_mutex);
+    entry = open_file_lookup(path);
+    if (entry) {
+        pdata = malloc(sizeof(struct filecache_pdata));
+        if (pdata) *pdata = entry->pdata;
+    }
+    pthread_mutex_unlock(&open_files_mutex);
+
+    return pdata;
+}
+
+// RAM tier: the contents of small files which are opened read-only over and
+// over, held in memory so such an open needs no leveldb read, cache file or
+// pread at all; the session gets its own copy, as on an inline file. A file
+// is taken in on its RAM_TIER_MIN_OPENS-th read-only open while its open_file
+// is around, if it is at most ram_file_max bytes, and the least recently used
+// entries go once ram_capacity bytes are held. An entry is the content of one
+// etag, served while that is fresh by the same rule as get_fresh_fd; a new
+// etag, or a write, truncation, sync, delete or move of the path, drops it.
+// Off while ram_capacity is 0.
+#define RAM_TIER_MIN_OPENS 2
+
+struct ram_file {
+    char *path; // key in ram_files
+    char etag[ETAG_MAX + 1];
+    time_t last_server_update;
+    char *data;
+    size_t size;
+    GList *link; // in ram_lru, most recently used at the head
+};
+
+static size_t ram_capacity = 0;
+static off_t ram_file_max = 0;
+
+// Protected by ram_mutex. ram_generation moves on with every change to a
+// path's pdata or content, so an admission which raced one can tell.
+static GHashTable *ram_files = NULL;
+static GQueue *ram_lru = NULL;
+static size_t ram_used = 0;
+static unsigned long ram_generation = 0;
+static pthread_mutex_t ram_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t ram_file_cost(const char *path, size_t size) {
+    return sizeof(struct ram_file) + strlen(path) + 1 + size;
+}
+
+// Caller holds ram_mutex
+static void ram_file_remove(struct ram_file *ram) {
+    g_hash_table_remove(ram_files, ram->path);
+    g_queue_delete_link(ram_lru, ram->link);
+    ram_used -= ram_file_cost(ram->path, ram->size);
+    free(ram->data);
+    free(ram->path);
+    free(ram);
+}
+
+// Hold up to capacity_mb MB of files up to file_kb KB in memory; 0 turns it off
+void filecache_ram_tier_init(int capacity_mb, int file_kb) {
+    if (capacity_mb <= 0 || file_kb <= 0) return;
+    ram_files = g_hash_table_new(g_str_hash, g_str_equal);
+    ram_lru = g_queue_new();
+    ram_file_max = (off_t) file_kb * 1024;
+    ram_capacity = (size_t) capacity_mb * 1024 * 1024;
+    log_print(LOG_NOTICE, SECTION_FILECACHE_CACHE, "filecache_ram_tier_init: %d MB for files up to %d KB", capacity_mb, file_kb);
+}
+
+// Bytes the RAM tier holds, and how many files
+size_t filecache_ram_tier_used(unsigned *files) {
+    size_t used;
+
+    pthread_mutex_lock(&ram_mutex);
+    used = ram_used;
+    if (files) *files = ram_files ? g_hash_table_size(ram_files) : 0;
+    pthread_mutex_unlock(&ram_mutex);
+    return used;
+}
+
+// The content of path is changing; drop what the tier has of it
+static void ram_tier_invalidate(const char *path) {
+    struct ram_file *ram;
+
+    if (ram_capacity == 0 || path == NULL) return;
+
+    pthread_mutex_lock(&ram_mutex);
+    ++ram_generation;
+    ram = g_hash_table_lookup(ram_files, path);
+    if (ram) {
+        ram_file_remove(ram);
+        BUMP(filecache_ram_invalidated);
+    }
+    pthread_mutex_unlock(&ram_mutex);
+}
+
+// The session has changed its file. Nothing is taken into the tier while the
+// open_file shows this mount's writes, so dropping it once is enough; the
+// path is copied under open_files_mutex, since a rename replaces it.
+static void ram_tier_session_dirty(struct filecache_sdata *sdata) {
+    char *path;
+
+    if (ram_capacity == 0 || sdata->ram_dropped) return;
+    path = open_file_path(sdata->ofile);
+    ram_tier_invalidate(path);
+    free(path);
+    sdata->ram_dropped = true;
+}
+
+// New pdata for path: a revalidation of the same etag keeps the entry fresh;
+// anything else means the content the tier has may be gone
+static void ram_tier_update(const char *path, const struct filecache_pdata *pdata) {
+    struct ram_file *ram;
+
+    if (ram_capacity == 0) return;
+
+    pthread_mutex_lock(&ram_mutex);
+    ++ram_generation;
+    ram = g_hash_table_lookup(ram_files, path);
+    if (ram) {
+        if (pdata->last_server_update != 0 && strcmp(ram->etag, pdata->etag) == 0) {
+            ram->last_server_update = pdata->last_server_update;
+        }
+        else {
+            ram_file_remove(ram);
+            BUMP(filecache_ram_invalidated);
+        }
+    }
+    pthread_mutex_unlock(&ram_mutex);
+}
+
+// Serve a read-only open of path from memory, if the tier has it fresh
+static bool ram_tier_open(const char *path, struct filecache_sdata *sdata, int flags, bool use_local_copy) {
+    struct ram_file *ram;
+    char *data = NULL;
+    size_t size = 0;
+
+    if (ram_capacity == 0 || !shareable_flags(flags)) return false;
+
+    pthread_mutex_lock(&ram_mutex);
+    ram = g_hash_table_lookup(ram_files, path);
+    if (ram && update_is_fresh(ram->last_server_update, use_local_copy)) {
+        data = malloc(ram->size + 1);
+        if (data) {
+            memcpy(data, ram->data, ram->size);
+            size = ram->size;
+            g_queue_unlink(ram_lru, ram->link);
+            g_queue_push_head_link(ram_lru, ram->link);
+        }
+    }
+    pthread_mutex_unlock(&ram_mutex);
+
+    if (data == NULL) {
+        BUMP(filecache_ram_misses);
+        return false;
+    }
+
+    BUMP(filecache_ram_hits);
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "ram_tier_open: %s (%lu bytes) from memory", path, size);
+    sdata->fd = -1;
+    sdata->is_inline = true;
+    sdata->idata = data;
+    sdata->isize = size;
+    return true;
+}
+
+// After a read-only open of path: take the file in if it has become hot
+static void ram_tier_consider(const char *path, struct filecache_sdata *sdata) {
+    char etag[ETAG_MAX + 1];
+    time_t last_server_update;
+    unsigned long generation;
+    struct ram_file *ram;
+    struct stat st;
+    off_t size;
+    char *data;
+    bool hot;
+
+    if (ram_capacity == 0 || sdata->ofile == NULL) return;
+
+    // Not while a writer has the file changed from what the etag names
+    pthread_mutex_lock(&open_files_mutex);
+    hot = sdata->ofile->attached && sdata->ofile->reads >= RAM_TIER_MIN_OPENS && sdata->ofile->written_size == 0;
+    strncpy(etag, sdata->ofile->pdata.etag, ETAG_MAX + 1);
+    last_server_update = sdata->ofile->pdata.last_server_update;
+    pthread_mutex_unlock(&open_files_mutex);
+    // Only server versions; a local copy is the writers' to change
+    if (!hot || etag[0] == '\0' || last_server_update == 0) return;
+
+    pthread_mutex_lock(&ram_mutex);
+    generation = ram_generation;
+    hot = (g_hash_table_lookup(ram_files, path) == NULL);
+    pthread_mutex_unlock(&ram_mutex);
+    if (!hot) return;
+
+    if (sdata->is_inline) size = sdata->isize;
+    else if (fstat(sdata->fd, &st) == 0) size = st.st_size;
+    else return;
+    if (size > ram_file_max || ram_file_cost(path, size) > ram_capacity) return;
+
+    data = malloc(size + 1);
+    if (data == NULL) return;
+    if (sdata->is_inline) {
+        memcpy(data, sdata->idata, size);
+    }
+    else if (pread(sdata->fd, data, size, 0) != size) {
+        free(data);
+        return;
+    }
+
+    ram = calloc(1, sizeof(struct ram_file));
+    if (ram == NULL) {
+        free(data);
+        return;
+    }
+    ram->path = strdup(path);
+    strncpy(ram->etag, etag, ETAG_MAX + 1);
+    ram->last_server_update = last_server_update;
+    ram->data = data;
+    ram->size = size;
+
+    // A write publishes its size before it drops the tier's entry, so one
+    // which began after the check above is seen here or removes ours later
+    pthread_mutex_lock(&ram_mutex);
+    if (ram->path == NULL || generation != ram_generation || g_hash_table_lookup(ram_files, path) ||
+            __sync_fetch_and_or(&sdata->ofile->written_size, 0) != 0) {
+        pthread_mutex_unlock(&ram_mutex);
+        free(ram->path);
+        free(ram->data);
+        free(ram);
+        return;
+    }
+    while (ram_used + ram_file_cost(path, size) > ram_capacity && !g_queue_is_empty(ram_lru)) {
+        ram_file_remove(g_queue_peek_tail_link(ram_lru)->data);
+        BUMP(filecache_ram_evicted);
+    }
+    g_queue_push_head(ram_lru, ram);
+    ram->link = ram_lru->head;
+    g_hash_table_insert(ram_files, ram->path, ram);
+    ram_used += ram_file_cost(path, size);
+    pthread_mutex_unlock(&ram_mutex);
+
+    BUMP(filecache_ram_admitted);
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "ram_tier_consider: %s (%lld bytes) now in memory", path, (long long) size);
+}
+
 // Allocates a new string.
 static char *path2key(const char *path) {
     char *key = NULL;
@@ -165,9 +1084,27 @@ struct curl_slist* enhanced_logging(struct curl_slist *slist, int log_level, int
     return slist;
 }
 
+// Fills shard with the "xx/yy" subdirectory a cache file named name belongs in
+static void cache_file_shard(const char *name, char *shard, size_t len) {
+    guint hash = g_str_hash(name);
+    snprintf(shard, len, "%02x/%02x", hash % FILES_SHARD_FANOUT, (hash / FILES_SHARD_FANOUT) % FILES_SHARD_FANOUT);
+}
+
+// Shard directories are created on demand; returns -1 with errno set on failure
+static int make_shard_dir(const char *cache_path, const char *shard) {
+    char path[PATH_MAX];
+
+    snprintf(path, PATH_MAX, "%s/files/%.2s", cache_path, shard);
+    if (mkdir(path, 0770) == -1 && errno != EEXIST) return -1;
+    snprintf(path, PATH_MAX, "%s/files/%s", cache_path, shard);
+    if (mkdir(path, 0770) == -1 && errno != EEXIST) return -1;
+    return 0;
+}
+
 // creates a new cache file
 static void new_cache_file(const char *cache_path, char *cache_file_path, fd_t *fd, GError **gerr) {
     char entropy[CACHE_FILE_ENTROPY + 1];
+    char shard[8];
 
     BUMP(filecache_cache_file);
 
@@ -176,9 +1113,16 @@ static void new_cache_file(const char *cache_path, char *cache_file_path, fd_t *
     }
     entropy[CACHE_FILE_ENTROPY] = '\0';
 
-    snprintf(cache_file_path, PATH_MAX, "%s/files/fusedav-cache-%s-XXXXXX", cache_path, entropy);
+    cache_file_shard(entropy, shard, sizeof(shard));
+    snprintf(cache_file_path, PATH_MAX, "%s/files/%s/fusedav-cache-%s-XXXXXX", cache_path, shard, entropy);
     log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "new_cache_file: Using pattern %s", cache_file_path);
-    if ((*fd = mkstemp(cache_file_path)) < 0 || inject_error(filecache_error_newcachefile)) {
+    *fd = mkstemp(cache_file_path);
+    if (*fd < 0 && errno == ENOENT && make_shard_dir(cache_path, shard) == 0) {
+        // mkstemp mangles the template on failure, so set it up again
+        snprintf(cache_file_path, PATH_MAX, "%s/files/%s/fusedav-cache-%s-XXXXXX", cache_path, shard, entropy);
+        *fd = mkstemp(cache_file_path);
+    }
+    if (*fd < 0 || inject_error(filecache_error_newcachefile)) {
         g_set_error (gerr, system_quark(), errno, "new_cache_file: Failed mkstemp");
         return;
     }
@@ -187,11 +1131,13 @@ static void new_cache_file(const char *cache_path, char *cache_file_path, fd_t *
     return;
 }
 
-// adds an entry to the ldb cache
-static void filecache_pdata_set(filecache_t *cache, const char *path,
-        const struct filecache_pdata *pdata, GError **gerr) {
+// adds an entry to the ldb cache; data is the file's content for an inline pdata
+static void filecache_value_set(filecache_t *cache, const char *path,
+        const struct filecache_pdata *pdata, const char *data, size_t len, GError **gerr) {
     leveldb_writeoptions_t *options;
+    struct open_file *entry;
     char *ldberr = NULL;
+    char *value = NULL;
     char *key;
 
     BUMP(filecache_pdata_set);
@@ -204,11 +1150,27 @@ static void filecache_pdata_set(filecache_t *cache, const char *path,
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "filecache_pdata_set: path=%s ; cachefile=%s", path, pdata->filename);
 
+    if (data) {
+        value = malloc(sizeof(struct filecache_pdata) + len);
+        if (value == NULL) {
+            g_set_error(gerr, system_quark(), errno, "filecache_pdata_set: malloc failed for inline value");
+            return;
+        }
+        memcpy(value, pdata, sizeof(struct filecache_pdata));
+        memcpy(value + sizeof(struct filecache_pdata), data, len);
+    }
+
     key = path2key(path);
     options = leveldb_writeoptions_create();
-    leveldb_put(cache, options, key, strlen(key) + 1, (const char *) pdata, sizeof(struct filecache_pdata), &ldberr);
+    if (value) {
+        leveldb_put(cache, options, key, strlen(key) + 1, value, sizeof(struct filecache_pdata) + len, &ldberr);
+    }
+    else {
+        leveldb_put(cache, options, key, strlen(key) + 1, (const char *) pdata, sizeof(struct filecache_pdata), &ldberr);
+    }
     leveldb_writeoptions_destroy(options);
 
+    free(value);
     free(key);
 
     // ldb error will cause file to go to forensic haven.
@@ -218,12 +1180,27 @@ static void filecache_pdata_set(filecache_t *cache, const char *path,
         return;
     }
 
+    // Keep the copy held for open sessions on this path in step with leveldb;
+    // only once the put has gone in, since on failure the caller abandons the
+    // cache file pdata names
+    pthread_mutex_lock(&open_files_mutex);
+    entry = open_file_lookup(path);
+    if (entry) entry->pdata = *pdata;
+    pthread_mutex_unlock(&open_files_mutex);
+    ram_tier_update(path, pdata);
+
     return;
 }
 
+static void filecache_pdata_set(filecache_t *cache, const char *path,
+        const struct filecache_pdata *pdata, GError **gerr) {
+    filecache_value_set(cache, path, pdata, NULL, 0, gerr);
+}
+
 // Create a new file to write into and set values
+// On success, *pdatap is replaced by the pdata for the new file
 static void create_file(struct filecache_sdata *sdata, const char *cache_path,
-        filecache_t *cache, const char *path, GError **gerr) {
+        filecache_t *cache, const char *path, struct filecache_pdata **pdatap, GError **gerr) {
 
     struct filecache_pdata *pdata;
     GError *tmpgerr = NULL;
@@ -257,6 +1234,10 @@ static void create_file(struct filecache_sdata *sdata, const char *cache_path,
         goto finish;
     }
 
+    free(*pdatap);
+    *pdatap = pdata;
+    pdata = NULL;
+
 finish:
 
     free(pdata);
@@ -276,6 +1257,14 @@ static struct filecache_pdata *filecache_pdata_get(filecache_t *cache, const cha
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "Entered filecache_pdata_get: path=%s", path);
 
+    // If the path is open, its in-memory copy is authoritative; skip leveldb
+    pdata = open_file_copy(path);
+    if (pdata) {
+        BUMP(filecache_pdata_hit);
+        log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "filecache_pdata_get: in-memory hit: path=%s :: cachefile=%s", path, pdata->filename);
+        return pdata;
+    }
+
     key = path2key(path);
 
     options = leveldb_readoptions_create();
@@ -296,7 +1285,8 @@ static struct filecache_pdata *filecache_pdata_get(filecache_t *cache, const cha
         return NULL;
     }
 
-    if (vallen != sizeof(struct filecache_pdata) || inject_error(filecache_error_getvallen)) {
+    // Inline files have their content after the pdata
+    if (vallen < sizeof(struct filecache_pdata) || inject_error(filecache_error_getvallen)) {
         g_set_error(gerr, leveldb_quark(), E_FC_LDBERR, "Length %lu is not expected length %lu.", vallen, sizeof(struct filecache_pdata));
         free(pdata);
         return NULL;
@@ -307,28 +1297,197 @@ static struct filecache_pdata *filecache_pdata_get(filecache_t *cache, const cha
     return pdata;
 }
 
-// Stores the header value into into *userdata if it's "ETag."
-static size_t capture_etag(void *ptr, size_t size, size_t nmemb, void *userdata) {
-    size_t real_size = size * nmemb;
-    char *header = (char *) ptr;
-    char *etag = (char *) userdata; // Allocated to ETAG_MAX length.
+// Get the content of an inline file, and its current pdata. Returns NULL (with
+// *pdata filled in) if the file is no longer stored inline.
+static char *filecache_inline_get(filecache_t *cache, const char *path, struct filecache_pdata *pdata,
+        size_t *len, GError **gerr) {
+    leveldb_readoptions_t *options;
+    char *ldberr = NULL;
     char *value;
+    char *data = NULL;
+    size_t vallen;
+    char *key;
 
-    value = strstr(header, ":");
+    key = path2key(path);
+    options = leveldb_readoptions_create();
+    value = leveldb_get(cache, options, key, strlen(key) + 1, &vallen, &ldberr);
+    leveldb_readoptions_destroy(options);
+    free(key);
 
-    if (value == NULL)
+    if (ldberr != NULL) {
+        g_set_error(gerr, leveldb_quark(), E_FC_LDBERR, "filecache_inline_get: leveldb_get error %s", ldberr);
+        free(ldberr);
+        goto finish;
+    }
+    if (value == NULL || vallen < sizeof(struct filecache_pdata)) {
+        g_set_error(gerr, filecache_quark(), E_FC_PDATANULL, "filecache_inline_get: no pdata for %s", path);
         goto finish;
+    }
 
-    // Skip the colon and whitespace.
-    ++value;
-    while(isspace(value[0]))
-        ++value;
+    memcpy(pdata, value, sizeof(struct filecache_pdata));
+    if (!PDATA_INLINE(pdata)) goto finish;
 
-    // Is it an ETag? If so, store it.
-    if (strncasecmp(header, "ETag", 4) == 0) {
-        size_t value_len = strlen(value);
+    *len = vallen - sizeof(struct filecache_pdata);
+    // Never NULL, even for an empty file
+    data = malloc(*len + 1);
+    if (data == NULL) {
+        g_set_error(gerr, system_quark(), errno, "filecache_inline_get: malloc failed");
+        goto finish;
+    }
+    memcpy(data, value + sizeof(struct filecache_pdata), *len);
 
-        // If the ETag is too long, bail.
+finish:
+    free(value);
+    return data;
+}
+
+// Open a file whose content is stored inline. A read-only session gets its own
+// copy of the content and true is returned. Any other session needs a real
+// file to write to, so the content is spilled to a new cache file and false is
+// returned with pdata pointing at it; the caller then opens it as usual.
+static bool inline_open(filecache_t *cache, const char *cache_path, const char *path,
+        struct filecache_sdata *sdata, struct filecache_pdata *pdata, int flags, GError **gerr) {
+    struct filecache_pdata stored;
+    GError *tmpgerr = NULL;
+    char *data;
+    size_t len = 0;
+    fd_t fd = -1;
+    bool served = false;
+
+    pthread_mutex_lock(&inline_mutex);
+
+    data = filecache_inline_get(cache, path, &stored, &len, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "inline_open: ");
+        goto finish;
+    }
+    if (data == NULL) {
+        // Another session spilled it since our pdata was read
+        *pdata = stored;
+        goto finish;
+    }
+
+    if ((flags & O_ACCMODE) == O_RDONLY && !(flags & O_TRUNC)) {
+        // A revalidation against the server (304) moves last_server_update on
+        if (stored.last_server_update != pdata->last_server_update) {
+            filecache_value_set(cache, path, pdata, data, len, &tmpgerr);
+            if (tmpgerr) {
+                g_propagate_prefixed_error(gerr, tmpgerr, "inline_open: ");
+                goto finish;
+            }
+        }
+        BUMP(filecache_inline_open);
+        sdata->fd = -1;
+        sdata->is_inline = true;
+        sdata->idata = data;
+        sdata->isize = len;
+        data = NULL;
+        served = true;
+        goto finish;
+    }
+
+    BUMP(filecache_inline_spill);
+    new_cache_file(cache_path, pdata->filename, &fd, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "inline_open: ");
+        goto finish;
+    }
+    if (write(fd, data, len) != (ssize_t) len) {
+        g_set_error(gerr, system_quark(), errno, "inline_open: failed to spill %s", path);
+        unlink(pdata->filename);
+        goto finish;
+    }
+    filecache_pdata_set(cache, path, pdata, &tmpgerr);
+    if (tmpgerr) {
+        unlink(pdata->filename);
+        g_propagate_prefixed_error(gerr, tmpgerr, "inline_open: ");
+        goto finish;
+    }
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "inline_open: spilled %s to %s", path, pdata->filename);
+
+finish:
+    pthread_mutex_unlock(&inline_mutex);
+    if (fd >= 0) close(fd);
+    free(data);
+    return served;
+}
+
+// Move a freshly fetched small file into leveldb, for a read-only session
+// which has it open on sdata->fd. Only done while nobody else has the path
+// open, since they may hold descriptors on the cache file.
+static void inline_store(filecache_t *cache, const char *path, struct filecache_pdata *pdata,
+        struct filecache_sdata *sdata, off_t size) {
+    char cache_file[PATH_MAX];
+    GError *tmpgerr = NULL;
+    struct open_file *entry;
+    bool busy;
+    char *data;
+
+    data = malloc(size + 1);
+    if (data == NULL) return;
+    if (pread(sdata->fd, data, size, 0) != size) {
+        free(data);
+        return;
+    }
+
+    pthread_mutex_lock(&inline_mutex);
+
+    pthread_mutex_lock(&open_files_mutex);
+    entry = open_file_lookup(path);
+    busy = (entry != NULL && entry->refcount > 0);
+    pthread_mutex_unlock(&open_files_mutex);
+    if (busy) {
+        pthread_mutex_unlock(&inline_mutex);
+        free(data);
+        return;
+    }
+
+    strncpy(cache_file, pdata->filename, PATH_MAX);
+    pdata->filename[0] = '\0';
+    filecache_value_set(cache, path, pdata, data, size, &tmpgerr);
+    pthread_mutex_unlock(&inline_mutex);
+
+    if (tmpgerr) {
+        // leveldb still has the pdata for the cache file
+        log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "inline_store: %s", tmpgerr->message);
+        g_clear_error(&tmpgerr);
+        strncpy(pdata->filename, cache_file, PATH_MAX);
+        free(data);
+        return;
+    }
+
+    BUMP(filecache_inline_store);
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "inline_store: %s (%ld bytes) now inline", path, size);
+    unlink(cache_file);
+    close(sdata->fd);
+    sdata->fd = -1;
+    sdata->is_inline = true;
+    sdata->idata = data;
+    sdata->isize = size;
+}
+
+// Stores the header value into into *userdata if it's "ETag."
+static size_t capture_etag(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    size_t real_size = size * nmemb;
+    char *header = (char *) ptr;
+    char *etag = (char *) userdata; // Allocated to ETAG_MAX length.
+    char *value;
+
+    value = strstr(header, ":");
+
+    if (value == NULL)
+        goto finish;
+
+    // Skip the colon and whitespace.
+    ++value;
+    while(isspace(value[0]))
+        ++value;
+
+    // Is it an ETag? If so, store it.
+    if (strncasecmp(header, "ETag", 4) == 0) {
+        size_t value_len = strlen(value);
+
+        // If the ETag is too long, bail.
         if (value_len > ETAG_MAX)
             goto finish;
 
@@ -340,21 +1499,661 @@ finish:
     return real_size;
 }
 
+// Response bodies collect in a RESPONSE_BUFFER_SIZE aligned buffer and go to
+// the cache file in writes that size, rather than one write per curl callback;
+// a body the headers say is smaller gets a buffer just big enough for it.
+// A body the headers say is bigger than the buffer gets its whole extent
+// fallocated first, so large cache files don't end up in hundreds of pieces.
+// With io_uring, a full buffer is written from the ring while a second one fills.
+#define RESPONSE_BUFFER_SIZE (1024 * 1024)
+#define RESPONSE_BUFFER_ALIGN 4096
+// How much curl hands the write callback at once; curl caps it at its own maximum
+#define RESPONSE_CURL_BUFFER (512 * 1024)
+
+struct response_buffer {
+    fd_t fd;
+    off_t offset; // Where the buffered data goes in the file
+    char *data; // Allocated on the first write, so a 304 costs nothing
+    size_t capacity; // Of data and spare alike
+    size_t used;
+    off_t preallocate; // From the headers; 0 if not known
+    bool may_direct; // O_DIRECT is allowed for a stream-sized body
+    bool direct; // fd has O_DIRECT on
+    bool failed;
+    char *spare; // io_uring only: the other buffer, which op may be writing
+    size_t spare_used;
+    off_t spare_offset;
+    struct cacheio_op op;
+};
+
+static bool response_buffer_set_direct(struct response_buffer *buffer, bool on) {
+    int flags = fcntl(buffer->fd, F_GETFL);
+
+    if (flags < 0 || fcntl(buffer->fd, F_SETFL, on ? (flags | O_DIRECT) : (flags & ~O_DIRECT))) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "response_buffer_set_direct: %d on fd %d failed: %s",
+            on, buffer->fd, strerror(errno));
+        return false;
+    }
+    buffer->direct = on;
+    return true;
+}
+
+static void response_buffer_init(struct response_buffer *buffer, fd_t fd, off_t offset) {
+    memset(buffer, 0, sizeof(struct response_buffer));
+    buffer->fd = fd;
+    buffer->offset = offset;
+}
+
+static bool response_buffer_write(struct response_buffer *buffer, const char *data, size_t size, off_t offset) {
+    size_t done = 0;
+
+    while (!buffer->failed && done < size) {
+        ssize_t res = pwrite(buffer->fd, data + done, size - done, offset + done);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            // Not every filesystem takes O_DIRECT writes
+            if (errno == EINVAL && buffer->direct && response_buffer_set_direct(buffer, false)) continue;
+            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "response_buffer_write: pwrite failed on fd %d: %s",
+                buffer->fd, strerror(errno));
+            buffer->failed = true;
+        }
+        else {
+            done += res;
+            BUMP(filecache_get_body_writes);
+        }
+    }
+    return !buffer->failed;
+}
+
+// Wait for the spare buffer's write on the ring, and finish it by hand if it came up short
+static void response_buffer_reap(struct response_buffer *buffer) {
+    size_t done = 0;
+    int res;
+
+    if (!buffer->op.pending) return;
+    res = cacheio_wait(&buffer->op);
+    if (res < 0) {
+        // Not every filesystem takes O_DIRECT writes; the write below goes again without
+        if (!(res == -EINVAL && buffer->direct && response_buffer_set_direct(buffer, false))) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "response_buffer_reap: write failed on fd %d: %s",
+                buffer->fd, strerror(-res));
+            buffer->failed = true;
+            return;
+        }
+    }
+    else {
+        done = res;
+        BUMP(filecache_get_body_writes);
+    }
+    if (done < buffer->spare_used) {
+        response_buffer_write(buffer, buffer->spare + done, buffer->spare_used - done, buffer->spare_offset + done);
+    }
+}
+
+// Write out everything buffered, and wait for it
+static bool response_buffer_flush(struct response_buffer *buffer) {
+    response_buffer_reap(buffer);
+
+    // O_DIRECT takes whole blocks only; the tail goes through the page cache
+    if (buffer->direct && buffer->used % RESPONSE_BUFFER_ALIGN != 0) response_buffer_set_direct(buffer, false);
+
+    response_buffer_write(buffer, buffer->data, buffer->used, buffer->offset);
+    buffer->offset += buffer->used;
+    buffer->used = 0;
+    return !buffer->failed;
+}
+
+// Pass on a full buffer: to the ring if there is one, so the body can go on
+// into the spare meanwhile, else as a flush
+static bool response_buffer_pass(struct response_buffer *buffer) {
+    char *full;
+
+    if (!cacheio_enabled()) return response_buffer_flush(buffer);
+
+    response_buffer_reap(buffer);
+    if (buffer->failed) return false;
+    if (buffer->spare == NULL && posix_memalign((void **) &buffer->spare, RESPONSE_BUFFER_ALIGN, buffer->capacity)) {
+        buffer->spare = NULL;
+        return response_buffer_flush(buffer);
+    }
+
+    full = buffer->data;
+    buffer->data = buffer->spare;
+    buffer->spare = full;
+    buffer->spare_used = buffer->used;
+    buffer->spare_offset = buffer->offset;
+    if (!cacheio_pwrite_submit(&buffer->op, buffer->fd, buffer->spare, buffer->spare_used, buffer->spare_offset)) {
+        BUMP(filecache_uring_fallbacks);
+        response_buffer_write(buffer, buffer->spare, buffer->spare_used, buffer->spare_offset);
+    }
+    buffer->offset += buffer->used;
+    buffer->used = 0;
+    return !buffer->failed;
+}
+
+// The fd goes on to serve reads, which must not need to be aligned
+static void response_buffer_free(struct response_buffer *buffer) {
+    // The ring may still be writing from spare
+    response_buffer_reap(buffer);
+    if (buffer->direct) response_buffer_set_direct(buffer, false);
+    free(buffer->data);
+    buffer->data = NULL;
+    free(buffer->spare);
+    buffer->spare = NULL;
+}
+
+static size_t response_buffer_append(struct response_buffer *buffer, const char *ptr, size_t size) {
+    size_t copied = 0;
+
+    if (buffer->failed)
+        return 0;
+
+    if (buffer->data == NULL) {
+        // Most bodies are small files; the rounding keeps O_DIRECT's alignment
+        buffer->capacity = RESPONSE_BUFFER_SIZE;
+        if (buffer->preallocate > 0 && buffer->preallocate < RESPONSE_BUFFER_SIZE) {
+            buffer->capacity = (buffer->preallocate + RESPONSE_BUFFER_ALIGN - 1) / RESPONSE_BUFFER_ALIGN * RESPONSE_BUFFER_ALIGN;
+        }
+        if (posix_memalign((void **) &buffer->data, RESPONSE_BUFFER_ALIGN, buffer->capacity)) {
+            buffer->data = NULL;
+            buffer->failed = true;
+            return 0;
+        }
+        // Only worth it for bodies which would take more than one write; failure
+        // (say, a filesystem without fallocate) just costs the layout
+        if (buffer->preallocate > RESPONSE_BUFFER_SIZE) {
+            if (fallocate(buffer->fd, FALLOC_FL_KEEP_SIZE, 0, buffer->preallocate) == 0) {
+                BUMP(filecache_get_preallocated);
+            }
+            else {
+                log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "response_buffer_append: fallocate %lld on fd %d failed: %s",
+                    (long long) buffer->preallocate, buffer->fd, strerror(errno));
+            }
+        }
+        if (buffer->may_direct && buffer->preallocate >= fadvise_stream_size &&
+                buffer->offset % RESPONSE_BUFFER_ALIGN == 0 && response_buffer_set_direct(buffer, true)) {
+            BUMP(filecache_direct_downloads);
+        }
+    }
+
+    while (copied < size) {
+        size_t chunk = MIN(size - copied, buffer->capacity - buffer->used);
+        memcpy(buffer->data + buffer->used, ptr + copied, chunk);
+        buffer->used += chunk;
+        copied += chunk;
+        if (buffer->used == buffer->capacity && !response_buffer_pass(buffer))
+            return 0;
+    }
+    return size;
+}
+
 static size_t write_response_to_fd(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    return response_buffer_append((struct response_buffer *) userdata, ptr, size * nmemb);
+}
+
+// Header capture for get_fresh_fd: the ETag, as capture_etag, plus the total
+// size out of a 206's Content-Range, and the size to preallocate for the body.
+struct range_headers {
+    char *etag; // Allocated to ETAG_MAX length.
+    off_t total; // -1 if the response had no Content-Range
+    struct response_buffer *body;
+};
+
+static size_t capture_range_headers(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct range_headers *headers = (struct range_headers *) userdata;
+    const char *header = (const char *) ptr;
+    long long first, last, total, length;
+
+    if (strncasecmp(header, "Content-Range:", 14) == 0 &&
+            sscanf(header + 14, " bytes %lld-%lld/%lld", &first, &last, &total) == 3) {
+        headers->total = total;
+        // The head of a split download; the ranges fill in the rest of the file
+        if (total > headers->body->preallocate) headers->body->preallocate = total;
+    }
+    else if (strncasecmp(header, "Content-Length:", 15) == 0 && sscanf(header + 15, " %lld", &length) == 1) {
+        if (length > headers->body->preallocate) headers->body->preallocate = length;
+    }
+    return capture_etag(ptr, size, nmemb, headers->etag);
+}
+
+// One range of a split download, fetched on its own handle
+struct get_range {
+    CURL *handle;
+    struct curl_slist *headers;
+    struct curl_slist *resolve;
+    const char *path;
+    const char *if_match;
+    struct response_buffer body;
+    off_t offset;
+    off_t length;
+    off_t received;
+    char etag[ETAG_MAX + 1];
+    char errbuf[CURL_ERROR_SIZE];
+    bool done;
+};
+
+// Ranges land at their own offset in the response file, so they can arrive in any order
+static size_t write_range_to_fd(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct get_range *range = (struct get_range *) userdata;
     size_t real_size = size * nmemb;
-    fd_t *fdp = (fd_t *) userdata;
-    fd_t myfd = *fdp;
-    ssize_t res;
-    res = write(myfd, ptr, size * nmemb);
-    if ((size_t) res != real_size)
+
+    // More than we asked for means the server is not honoring the range
+    if (range->received + (off_t) real_size > range->length)
+        return 0;
+    if (response_buffer_append(&range->body, ptr, real_size) != real_size)
         return 0;
+    range->received += real_size;
     return real_size;
 }
 
+static void *get_range_worker(void *ptr) {
+    struct get_range *range = (struct get_range *) ptr;
+    CURLcode res = CURLE_OK;
+    long response_code = 500;
+    long elapsed_time = 0;
+
+    timed_curl_easy_perform(range->handle, &res, &response_code, &elapsed_time);
+    // Marks the node unhealthy on failure, as for any other GET; the handle is
+    // get_ranges' to clean up, so none is passed
+    process_status("get_range_worker", NULL, res, response_code, elapsed_time, 0, range->path, true);
+    if (res == CURLE_OK && !response_buffer_flush(&range->body)) res = CURLE_WRITE_ERROR;
+    response_buffer_free(&range->body);
+
+    // The etag check backs up If-Match, in case something in between drops it
+    if (res != CURLE_OK || response_code != 206 || strcmp(range->etag, range->if_match) != 0 ||
+            range->received != range->length) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN,
+            "get_range_worker: range %lld+%lld of %s failed: %s, %ld, etag %s, %lld bytes :: %s",
+            (long long) range->offset, (long long) range->length, range->path,
+            curl_easy_strerror(res), response_code, range->etag, (long long) range->received, range->errbuf);
+        return NULL;
+    }
+    range->done = true;
+    return NULL;
+}
+
+// Fetches bytes [offset, total) of path into fd as parallel_get_streams ranges
+// at once, on handles copied from session, each pinned to the next healthy
+// node. Every range has to come back 206 with the etag the first GET got; if
+// any fails the file may have changed underneath us, and the caller starts
+// over with a whole GET. The calling thread fetches a range too, so a failed
+// pthread_create only costs parallelism.
+static bool get_ranges(CURL *session, const char *path, fd_t fd, const char *etag, off_t offset, off_t total) {
+    static const char *funcname = "get_ranges";
+    int streams = parallel_get_streams;
+    off_t range_size = (total - offset + streams - 1) / streams;
+    struct get_range *ranges;
+    pthread_t *workers;
+    bool *started;
+    int count = 0;
+    bool success = true;
+
+    ranges = calloc(streams, sizeof(struct get_range));
+    workers = calloc(streams, sizeof(pthread_t));
+    started = calloc(streams, sizeof(bool));
+    if (ranges == NULL || workers == NULL || started == NULL) {
+        success = false;
+        goto finish;
+    }
+
+    for (; count < streams && offset < total; count++) {
+        struct get_range *range = &ranges[count];
+        char *header = NULL;
+
+        range->path = path;
+        range->if_match = etag;
+        response_buffer_init(&range->body, fd, offset);
+        range->offset = offset;
+        range->length = MIN(range_size, total - offset);
+        offset += range->length;
+
+        // The copy keeps the URL, certificates and timeouts; everything
+        // pointing into this request or this thread gets replaced
+        range->handle = curl_easy_duphandle(session);
+        if (range->handle == NULL) {
+            success = false;
+            goto finish;
+        }
+        asprintf(&header, "Range: bytes=%lld-%lld", (long long) range->offset,
+            (long long) (range->offset + range->length - 1));
+        range->headers = curl_slist_append(range->headers, header);
+        free(header);
+        asprintf(&header, "If-Match: %s", etag);
+        range->headers = curl_slist_append(range->headers, header);
+        free(header);
+        curl_easy_setopt(range->handle, CURLOPT_HTTPHEADER, range->headers);
+        curl_easy_setopt(range->handle, CURLOPT_HEADERFUNCTION, capture_etag);
+        curl_easy_setopt(range->handle, CURLOPT_WRITEHEADER, range->etag);
+        curl_easy_setopt(range->handle, CURLOPT_WRITEFUNCTION, write_range_to_fd);
+        curl_easy_setopt(range->handle, CURLOPT_WRITEDATA, range);
+        curl_easy_setopt(range->handle, CURLOPT_ERRORBUFFER, range->errbuf);
+        range->resolve = session_node_resolve(count);
+        if (range->resolve) curl_easy_setopt(range->handle, CURLOPT_RESOLVE, range->resolve);
+        BUMP(filecache_get_parallel_ranges);
+    }
+
+    log_print(LOG_INFO, SECTION_FILECACHE_OPEN, "%s: fetching %s as %d ranges of up to %lld bytes",
+        funcname, path, count, (long long) range_size);
+
+    for (int idx = 1; idx < count; idx++) {
+        if (pthread_create(&workers[idx], NULL, get_range_worker, &ranges[idx])) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "%s: failed to start worker %d", funcname, idx);
+            continue;
+        }
+        started[idx] = true;
+    }
+    for (int idx = 0; idx < count; idx++) {
+        if (!started[idx]) get_range_worker(&ranges[idx]);
+    }
+    for (int idx = 1; idx < count; idx++) {
+        if (started[idx]) pthread_join(workers[idx], NULL);
+    }
+    for (int idx = 0; idx < count; idx++) {
+        if (!ranges[idx].done) success = false;
+    }
+
+finish:
+    if (ranges) {
+        for (int idx = 0; idx < streams; idx++) {
+            if (ranges[idx].handle) curl_easy_cleanup(ranges[idx].handle);
+            if (ranges[idx].headers) curl_slist_free_all(ranges[idx].headers);
+            if (ranges[idx].resolve) curl_slist_free_all(ranges[idx].resolve);
+        }
+    }
+    free(ranges);
+    free(workers);
+    free(started);
+    return success;
+}
+
+// Content hash of the server's copy of a small file, kept in leveldb under
+// "ch:<path>" next to the path's pdata, so rewriting the file with the same
+// bytes costs no PUT. The etag ties it to one server version; once the file
+// changes on the server the etags no longer match and the hash is ignored.
+static const char * content_hash_prefix = "ch:";
+
+// Only files up to this size are hashed, as a writer opens them and before PUT
+#define CONTENT_HASH_MAX (1024 * 1024)
+#define CONTENT_HASH_LEN 32 // SHA-256
+
+struct content_hash {
+    char etag[ETAG_MAX + 1];
+    unsigned char digest[CONTENT_HASH_LEN];
+};
+
+static char *content_hash_key(const char *path) {
+    char *key = NULL;
+
+    asprintf(&key, "%s%s", content_hash_prefix, path);
+    return key;
+}
+
+// Hash the whole file behind fd. Returns false if it is too big or can't be read.
+static bool content_hash_compute(fd_t fd, unsigned char *digest) {
+    GChecksum *checksum;
+    char buf[64 * 1024];
+    struct stat st;
+    gsize len = CONTENT_HASH_LEN;
+    off_t offset = 0;
+    ssize_t bytes;
+
+    if (fstat(fd, &st) || st.st_size > CONTENT_HASH_MAX) return false;
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    while ((bytes = pread(fd, buf, sizeof(buf), offset)) > 0) {
+        g_checksum_update(checksum, (const guchar *) buf, bytes);
+        offset += bytes;
+    }
+    if (bytes == 0) g_checksum_get_digest(checksum, digest, &len);
+    g_checksum_free(checksum);
+    return (bytes == 0);
+}
+
+static void content_hash_set(filecache_t *cache, const char *path, const char *etag, const unsigned char *digest) {
+    leveldb_writeoptions_t *options;
+    struct content_hash hash;
+    char *ldberr = NULL;
+    char *key;
+
+    if (etag[0] == '\0') return;
+
+    memset(&hash, 0, sizeof(struct content_hash));
+    strncpy(hash.etag, etag, ETAG_MAX);
+    memcpy(hash.digest, digest, CONTENT_HASH_LEN);
+
+    key = content_hash_key(path);
+    options = leveldb_writeoptions_create();
+    leveldb_put(cache, options, key, strlen(key) + 1, (const char *) &hash, sizeof(struct content_hash), &ldberr);
+    leveldb_writeoptions_destroy(options);
+    free(key);
+
+    if (ldberr != NULL) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_CACHE, "content_hash_set: leveldb_put error %s on %s", ldberr, path);
+        free(ldberr);
+    }
+}
+
+// Does the server version with this etag have this content? With no digest,
+// is there a hash of that version at all?
+static bool content_hash_matches(filecache_t *cache, const char *path, const char *etag, const unsigned char *digest) {
+    leveldb_readoptions_t *options;
+    struct content_hash hash;
+    char *ldberr = NULL;
+    char *value;
+    size_t vallen;
+    char *key;
+    bool matches = false;
+
+    key = content_hash_key(path);
+    options = leveldb_readoptions_create();
+    value = leveldb_get(cache, options, key, strlen(key) + 1, &vallen, &ldberr);
+    leveldb_readoptions_destroy(options);
+    free(key);
+
+    if (ldberr != NULL) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_CACHE, "content_hash_matches: leveldb_get error %s on %s", ldberr, path);
+        free(ldberr);
+    }
+    else if (value && vallen == sizeof(struct content_hash)) {
+        memcpy(&hash, value, sizeof(struct content_hash));
+        matches = (strcmp(hash.etag, etag) == 0 && (digest == NULL || memcmp(hash.digest, digest, CONTENT_HASH_LEN) == 0));
+    }
+    free(value);
+    return matches;
+}
+
+static void content_hash_delete(filecache_t *cache, const char *path) {
+    leveldb_writeoptions_t *options;
+    char *ldberr = NULL;
+    char *key;
+
+    key = content_hash_key(path);
+    options = leveldb_writeoptions_create();
+    leveldb_delete(cache, options, key, strlen(key) + 1, &ldberr);
+    leveldb_writeoptions_destroy(options);
+    free(key);
+
+    if (ldberr != NULL) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_CACHE, "content_hash_delete: leveldb_delete error %s on %s", ldberr, path);
+        free(ldberr);
+    }
+}
+
+// Caller holds inflight_mutex
+static void inflight_fetch_unref(struct inflight_fetch *fetch) {
+    if (--fetch->refcount > 0) return;
+    pthread_cond_destroy(&fetch->cond);
+    if (fetch->gerr) g_error_free(fetch->gerr);
+    free(fetch);
+}
+
+// Register interest in a GET on path. Returns the fetch in progress, if any,
+// with a reference held for the caller; otherwise registers a new one which the
+// caller must perform and complete, and sets *leader.
+static struct inflight_fetch *inflight_fetch_join(const char *path, bool *leader) {
+    struct inflight_fetch *fetch;
+
+    pthread_mutex_lock(&inflight_mutex);
+    fetch = g_hash_table_lookup(inflight_fetches, path);
+    if (fetch) {
+        ++fetch->refcount;
+        *leader = false;
+    }
+    else {
+        fetch = calloc(1, sizeof(struct inflight_fetch));
+        if (fetch) {
+            pthread_cond_init(&fetch->cond, NULL);
+            fetch->refcount = 1;
+            g_hash_table_insert(inflight_fetches, strdup(path), fetch);
+        }
+        *leader = true;
+    }
+    pthread_mutex_unlock(&inflight_mutex);
+
+    return fetch;
+}
+
+// Publish the outcome of the GET on path to any waiters and drop the leader's reference
+static void inflight_fetch_complete(struct inflight_fetch *fetch, const char *path, long response_code,
+        const struct filecache_pdata *pdata, const GError *gerr) {
+
+    pthread_mutex_lock(&inflight_mutex);
+    g_hash_table_remove(inflight_fetches, path);
+    fetch->response_code = response_code;
+    if (pdata) {
+        fetch->pdata = *pdata;
+        fetch->have_pdata = true;
+    }
+    if (gerr) fetch->gerr = g_error_copy(gerr);
+    fetch->done = true;
+    pthread_cond_broadcast(&fetch->cond);
+    inflight_fetch_unref(fetch);
+    pthread_mutex_unlock(&inflight_mutex);
+}
+
+// Wait for another thread's GET on path, then open the cache file it left behind
+static void inflight_fetch_wait(filecache_t *cache, const char *cache_path, struct inflight_fetch *fetch,
+        const char *path, struct filecache_sdata *sdata, struct filecache_pdata **pdatap, int flags, GError **gerr) {
+    static const char *funcname = "inflight_fetch_wait";
+    GError *tmpgerr = NULL;
+
+    BUMP(filecache_get_coalesced);
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: waiting on GET in progress for %s", funcname, path);
+
+    pthread_mutex_lock(&inflight_mutex);
+    while (!fetch->done) {
+        pthread_cond_wait(&fetch->cond, &inflight_mutex);
+    }
+    pthread_mutex_unlock(&inflight_mutex);
+
+    // The result is read-only once done is set, so no need to hold the lock
+    if (fetch->gerr) {
+        g_propagate_prefixed_error(gerr, g_error_copy(fetch->gerr), "%s: ", funcname);
+        goto finish;
+    }
+
+    if (!fetch->have_pdata || !(fetch->response_code == 200 || fetch->response_code == 304)) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "%s: shared GET on %s returns %ld; expected 304 or 200",
+            funcname, path, fetch->response_code);
+        goto finish;
+    }
+
+    if (*pdatap == NULL) {
+        *pdatap = malloc(sizeof(struct filecache_pdata));
+        if (*pdatap == NULL) {
+            g_set_error(gerr, system_quark(), errno, "%s: malloc failed for pdata", funcname);
+            goto finish;
+        }
+    }
+    **pdatap = fetch->pdata;
+
+    if (PDATA_INLINE(*pdatap)) {
+        if (inline_open(cache, cache_path, path, sdata, *pdatap, flags, &tmpgerr)) goto finish;
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "%s: ", funcname);
+            goto finish;
+        }
+    }
+
+    sdata->fd = open((*pdatap)->filename, flags);
+    if (sdata->fd < 0) {
+        g_set_error(gerr, system_quark(), errno, "%s: open failed: %s", funcname, strerror(errno));
+        log_print(LOG_DYNAMIC, SECTION_FILECACHE_OPEN, "%s: open on %s for %s with flags %x returns < 0: errno: %d, %s",
+            funcname, (*pdatap)->filename, path, flags, errno, strerror(errno));
+        goto finish;
+    }
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: shared %ld on %s; fd %d", funcname, fetch->response_code, path, sdata->fd);
+
+finish:
+    pthread_mutex_lock(&inflight_mutex);
+    inflight_fetch_unref(fetch);
+    pthread_mutex_unlock(&inflight_mutex);
+}
+
+// Etags from response headers keep whatever trailed the value on the header
+// line, so compare them with those from PROPFIND up to trailing whitespace
+static bool etag_equal(const char *a, const char *b) {
+    size_t alen = strlen(a);
+    size_t blen = strlen(b);
+
+    while (alen > 0 && isspace(a[alen - 1])) --alen;
+    while (blen > 0 && isspace(b[blen - 1])) --blen;
+    return alen > 0 && alen == blen && strncmp(a, b, alen) == 0;
+}
+
+// Has a PROPFIND recent enough for the stat cache to stand on seen the
+// version in the cache file? Then a conditional GET could only get a 304.
+static bool propfind_confirms(filecache_t *cache, const char *path, const struct filecache_pdata *pdata) {
+    struct stat_cache_value *value;
+    bool confirmed = false;
+
+    value = stat_cache_value_get(cache, path, false, NULL);
+    if (value) {
+        confirmed = value->st.st_mode != 0 && etag_equal(value->etag, pdata->etag);
+        free(value);
+    }
+    if (confirmed) BUMP(filecache_get_etag_confirmed);
+    return confirmed;
+}
+
+// May a session opened with flags have the cached copy of path as it is, and
+// have it revalidated afterwards? Only readers; a writer would build on it.
+static bool stale_usable(const char *path, const struct filecache_pdata *pdata, int flags) {
+    const char *name;
+    time_t age;
+
+    if (stale_bounds == NULL || !shareable_flags(flags) || pdata->last_server_update == 0) return false;
+
+    age = time(NULL) - pdata->last_server_update;
+    name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    // The first pattern which matches decides
+    for (unsigned idx = 0; idx < stale_bounds->len; idx++) {
+        struct stale_bound *bound = g_ptr_array_index(stale_bounds, idx);
+        if (g_pattern_match_string(bound->spec, bound->whole_path ? path : name)) {
+            return age <= bound->max_age;
+        }
+    }
+    return false;
+}
+
+// Have a revalidator check path against the server, unless one is already on it
+static void stale_revalidate_queue(const char *path) {
+    pthread_mutex_lock(&stale_mutex);
+    if (!g_hash_table_lookup(stale_queued, path)) {
+        g_hash_table_insert(stale_queued, strdup(path), GINT_TO_POINTER(1));
+        g_queue_push_tail(stale_queue, strdup(path));
+        pthread_cond_signal(&stale_cond);
+    }
+    pthread_mutex_unlock(&stale_mutex);
+}
+
 // Get a file descriptor pointing to the latest full copy of the file.
 static void get_fresh_fd(filecache_t *cache,
         const char *cache_path, const char *path, struct filecache_sdata *sdata,
-        struct filecache_pdata **pdatap, int flags, bool use_local_copy, GError **gerr) {
+        struct filecache_pdata **pdatap, int flags, bool use_local_copy, bool may_serve_stale, GError **gerr) {
     static const char *funcname = "get_fresh_fd";
     GError *tmpgerr = NULL;
     struct filecache_pdata *pdata;
@@ -362,9 +2161,16 @@ static void get_fresh_fd(filecache_t *cache,
     char response_filename[PATH_MAX] = "\0";
     int response_fd = -1;
     bool close_response_fd = true;
+    struct inflight_fetch *fetch = NULL;
+    bool leader = true;
     struct timespec start_time;
-    long response_code = 500; // seed it as bad so we can enter the loop
+    long response_code = 500;
     CURLcode res = CURLE_OK;
+    struct range_headers headers;
+    bool split = false;
+    bool was_split = false;
+    bool stale = false;
+    int attempts = num_filesystem_server_nodes;
     // Not to exceed time for operation, else it's an error. Allow large files a longer time
     // Somewhat arbitrary
     static const unsigned small_time_allotment = 2000; // 2 seconds
@@ -388,12 +2194,31 @@ static void get_fresh_fd(filecache_t *cache,
     // If not O_TRUNC, but the cache file is fresh, just reuse it without going to the server.
     // If the file is in-use (last_server_update = 0) we use the local file and don't go to the server.
     // If we're in saint mode, don't go to the server
+    // If the last PROPFIND showed the server still has the version we hold, there's nothing to ask it.
+    // If a reader may have a stale copy, it gets it now and the server is asked afterwards.
     if (pdata != NULL &&
             ((flags & O_TRUNC) || use_local_copy ||
-            (pdata->last_server_update == 0) || (time(NULL) - pdata->last_server_update) <= REFRESH_INTERVAL)) {
-        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: file is fresh or being truncated: %s::%s", 
+            (pdata->last_server_update == 0) || (time(NULL) - pdata->last_server_update) <= REFRESH_INTERVAL ||
+            propfind_confirms(cache, path, pdata) ||
+            (may_serve_stale && (stale = stale_usable(path, pdata, flags))))) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: file is fresh or being truncated: %s::%s",
                 funcname, path, pdata->filename);
 
+        if (stale) {
+            log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: serving stale %s (%lds old) while it is revalidated",
+                funcname, path, time(NULL) - pdata->last_server_update);
+            BUMP(filecache_stale_served);
+            stale_revalidate_queue(path);
+        }
+
+        if (PDATA_INLINE(pdata)) {
+            if (inline_open(cache, cache_path, path, sdata, pdata, flags, &tmpgerr)) goto finish;
+            if (tmpgerr) {
+                g_propagate_prefixed_error(gerr, tmpgerr, "%s: ", funcname);
+                goto finish;
+            }
+        }
+
         // Open first with O_TRUNC off to avoid modifying the file without holding the right lock.
         sdata->fd = open(pdata->filename, flags & ~O_TRUNC);
         if (sdata->fd < 0 || inject_error(filecache_error_freshopen1)) {
@@ -405,13 +2230,24 @@ static void get_fresh_fd(filecache_t *cache,
         }
 
         if (flags & O_TRUNC) {
+            struct cache_lock *lock;
+            GError *lockgerr = NULL;
+
             log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: truncating fd %d:%s::%s",
                 funcname, sdata->fd, path, pdata->filename);
 
             log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: acquiring shared file lock on fd %d",
                 funcname, sdata->fd);
-            if (flock(sdata->fd, LOCK_SH) || inject_error(filecache_error_freshflock1)) {
-                g_set_error(gerr, system_quark(), errno, "%s: error acquiring shared file lock", funcname);
+            lock = cache_lock_acquire(pdata->filename);
+            cache_lock_take(lock, false, &lockgerr);
+            if (lockgerr || inject_error(filecache_error_freshflock1)) {
+                if (lockgerr) {
+                    g_propagate_prefixed_error(gerr, lockgerr, "%s: ", funcname);
+                } else {
+                    cache_lock_drop(lock);
+                    g_set_error(gerr, system_quark(), EIO, "%s: error acquiring shared file lock", funcname);
+                }
+                cache_lock_unref(lock);
                 goto finish;
             }
             log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: acquired shared file lock on fd %d", funcname, sdata->fd);
@@ -423,24 +2259,10 @@ static void get_fresh_fd(filecache_t *cache,
                 // Fall through to release the lock
             }
 
-            log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: releasing shared file lock on fd %d",
-                funcname, sdata->fd);
-            if (flock(sdata->fd, LOCK_UN) || inject_error(filecache_error_freshflock2)) {
-                // If we didn't get an error from ftruncate, then set gerr here from flock on error;
-                // If ftruncate did get an error, it will take precedence and we will ignore this error
-                if (!gerr) {
-                    g_set_error(gerr, system_quark(), errno, "%s: error releasing shared file lock", funcname);
-                }
-                else {
-                    // If we got an error from ftruncate so don't set one for flock, still report
-                    // that releasing the lock failed.
-                    log_print(LOG_CRIT, SECTION_FILECACHE_OPEN, "%s: error releasing shared file lock :: %s",
-                        funcname, strerror(errno));
-                }
-                goto finish;
-            }
+            cache_lock_drop(lock);
+            cache_lock_unref(lock);
 
-            // We've fallen through to flock from ftruncate; if ftruncate returns an error, return here
+            // We've fallen through from ftruncate; if ftruncate returns an error, return here
             if (gerr) goto finish;
 
             log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: released shared file lock on fd %d", funcname, sdata->fd);
@@ -456,10 +2278,29 @@ static void get_fresh_fd(filecache_t *cache,
         goto finish;
     }
 
-    for (int idx = 0; idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500); idx++) {
+    // If another thread is already fetching this path, share its result
+    fetch = inflight_fetch_join(path, &leader);
+    if (!leader) {
+        inflight_fetch_wait(cache, cache_path, fetch, path, sdata, pdatap, flags, gerr);
+        fetch = NULL;
+        return;
+    }
+
+    // Big enough to be worth splitting? The stat cache knows the size the server last reported
+    if (parallel_get_size > 0) {
+        struct stat_cache_value *value = stat_cache_value_get(cache, path, true, NULL);
+        if (value) {
+            split = value->st.st_size >= parallel_get_size;
+            free(value);
+        }
+    }
+
+    // A 206 here means the rest of a split download failed; go again for the whole file
+    for (int idx = 0; idx < attempts && (res != CURLE_OK || response_code >= 500 || response_code == 206); idx++) {
         long elapsed_time = 0;
         CURL *session;
         struct curl_slist *slist = NULL;
+        struct response_buffer body;
 
         // These will be -1 and [0] = '\0' on idx 0; but subsequent iterations we need to clean up from previous time
         if (response_fd >= 0) close(response_fd);
@@ -481,13 +2322,22 @@ static void get_fresh_fd(filecache_t *cache,
             slist = curl_slist_append(slist, header);
             free(header);
         }
+        if (split) {
+            char *header = NULL;
+
+            asprintf(&header, "Range: bytes=0-%d", PARALLEL_GET_HEAD - 1);
+            slist = curl_slist_append(slist, header);
+            free(header);
+        }
         slist = enhanced_logging(slist, LOG_INFO, SECTION_FILECACHE_OPEN, "get_fresh_id: %s", path);
         if (slist) curl_easy_setopt(session, CURLOPT_HTTPHEADER, slist);
 
         // Set an ETag header capture path.
         etag[0] = '\0';
-        curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, capture_etag);
-        curl_easy_setopt(session, CURLOPT_WRITEHEADER, etag);
+        headers.etag = etag;
+        headers.total = -1;
+        curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, capture_range_headers);
+        curl_easy_setopt(session, CURLOPT_WRITEHEADER, &headers);
 
         // Create a new temp file in case cURL needs to write to one.
         new_cache_file(cache_path, response_filename, &response_fd, &tmpgerr);
@@ -500,10 +2350,17 @@ static void get_fresh_fd(filecache_t *cache,
         }
 
         // Give cURL the fd and callback for handling the response body.
-        curl_easy_setopt(session, CURLOPT_WRITEDATA, &response_fd);
+        response_buffer_init(&body, response_fd, 0);
+        body.may_direct = direct_downloads;
+        headers.body = &body;
+        curl_easy_setopt(session, CURLOPT_WRITEDATA, &body);
         curl_easy_setopt(session, CURLOPT_WRITEFUNCTION, write_response_to_fd);
+        curl_easy_setopt(session, CURLOPT_BUFFERSIZE, RESPONSE_CURL_BUFFER);
 
         timed_curl_easy_perform(session, &res, &response_code, &elapsed_time);
+        // Write out whatever is still buffered
+        if (res == CURLE_OK && !response_buffer_flush(&body)) res = CURLE_WRITE_ERROR;
+        response_buffer_free(&body);
 
         if (slist) curl_slist_free_all(slist);
 
@@ -511,6 +2368,25 @@ static void get_fresh_fd(filecache_t *cache,
         // Some errors should not be retried. (Non-errors will fail the
         // for loop test and fall through naturally)
         if (non_retriable_error) break;
+
+        // The server took the range; the head is in, fetch the rest alongside each other
+        if (res == CURLE_OK && response_code == 206) {
+            // The file shrank; the head was all of it
+            if (headers.total > 0 && headers.total <= PARALLEL_GET_HEAD) {
+                response_code = 200;
+            }
+            else if (headers.total > 0 && etag[0] != '\0' &&
+                    get_ranges(session, path, response_fd, etag, PARALLEL_GET_HEAD, headers.total)) {
+                response_code = 200;
+                was_split = true;
+            }
+            else {
+                log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "%s: split GET of %s failed; getting it whole", funcname, path);
+                BUMP(filecache_get_parallel_fallback);
+                split = false;
+                ++attempts;
+            }
+        }
     }
 
     if ((res != CURLE_OK || response_code >= 500) || inject_error(filecache_error_freshcurl1)) {
@@ -551,7 +2427,16 @@ static void get_fresh_fd(filecache_t *cache,
         log_print(LOG_INFO, SECTION_FILECACHE_OPEN, 
                 "%s: Updating file cache on 304 for %s : %s : timestamp: %lu : etag %s.", 
                 funcname, path, pdata->filename, pdata->last_server_update, pdata->etag);
-        filecache_pdata_set(cache, path, pdata, &tmpgerr);
+        if (PDATA_INLINE(pdata)) {
+            // inline_open writes the new timestamp along with the content
+            if (inline_open(cache, cache_path, path, sdata, pdata, flags, &tmpgerr)) {
+                BUMP(filecache_get_304_count);
+                goto finish;
+            }
+        }
+        else {
+            filecache_pdata_set(cache, path, pdata, &tmpgerr);
+        }
         if (tmpgerr) {
             g_propagate_prefixed_error(gerr, tmpgerr, "%s on 304: ", funcname);
             goto finish;
@@ -598,7 +2483,7 @@ static void get_fresh_fd(filecache_t *cache,
                 goto finish;
             }
         }
-        else {
+        else if (!PDATA_INLINE(pdata)) {
             strncpy(old_filename, pdata->filename, PATH_MAX);
             unlink_old = true;
         }
@@ -629,7 +2514,7 @@ static void get_fresh_fd(filecache_t *cache,
         // no longer references. This will cause the file to be
         // deleted once no more file descriptors reference it.
         if (unlink_old) {
-            unlink(old_filename);
+            cacheio_unlink(old_filename);
             log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: 200: unlink old filename %s", funcname, old_filename);
         }
 
@@ -649,6 +2534,11 @@ static void get_fresh_fd(filecache_t *cache,
         clock_gettime(CLOCK_MONOTONIC, &now);
         elapsed_time = ((now.tv_sec - start_time.tv_sec) * 1000) + ((now.tv_nsec - start_time.tv_nsec) / (1000 * 1000));
 
+        if (was_split) {
+            TIMING(filecache_get_parallel_timing, elapsed_time);
+            BUMP(filecache_get_parallel_count);
+        }
+
         if (st.st_size > XLG) {
             TIMING(filecache_get_xlg_timing, elapsed_time);
             BUMP(filecache_get_xlg_count);
@@ -718,6 +2608,11 @@ static void get_fresh_fd(filecache_t *cache,
             stats_counter("exceeded-time-small-GET-count", 1, samplerate);
             stats_timer("exceeded-time-small-GET-latency", elapsed_time);
         }
+
+        // Small files opened for reading move into leveldb; writers spill them back out on open
+        if (inline_file_size > 0 && st.st_size <= inline_file_size && (flags & O_ACCMODE) == O_RDONLY) {
+            inline_store(cache, path, pdata, sdata, st.st_size);
+        }
     }
     else if (response_code == 404 || response_code == 410) {
 
@@ -772,10 +2667,165 @@ static void get_fresh_fd(filecache_t *cache,
 finish:
     if (close_response_fd) {
         if (response_fd >= 0) close(response_fd);
-        if (response_filename[0] != '\0') unlink(response_filename);
+        if (response_filename[0] != '\0') cacheio_unlink(response_filename);
+    }
+    if (fetch) {
+        inflight_fetch_complete(fetch, path, response_code, *pdatap, gerr ? *gerr : NULL);
     }
 }
 
+// Bring the cache up to date for path as a read-only open would, without
+// keeping it open. A 200 replaces the cache file and pdata for the opens
+// after it; sessions already reading keep the copy they have.
+static void fetch_unopened(filecache_t *cache, const char *cache_path, const char *path,
+        struct filecache_pdata **pdatap, GError **gerr) {
+    struct filecache_sdata sdata;
+
+    memset(&sdata, 0, sizeof(struct filecache_sdata));
+    sdata.fd = -1;
+    get_fresh_fd(cache, cache_path, path, &sdata, pdatap, O_RDONLY, false, false, gerr);
+    if (sdata.fd >= 0) close(sdata.fd);
+    free(sdata.idata);
+}
+
+// Fetch path ahead of an open. Returns true if that took a request; local-only
+// files, and ones whose cached copy is fresh, are left alone.
+bool filecache_prefetch(filecache_t *cache, const char *cache_path, const char *path, GError **gerr) {
+    struct filecache_pdata *pdata;
+    GError *tmpgerr = NULL;
+
+    if (filecache_local_only(path)) return false;
+
+    pdata = filecache_pdata_get(cache, path, NULL);
+    if (pdata && pdata_is_fresh(pdata, false)) {
+        free(pdata);
+        return false;
+    }
+
+    fetch_unopened(cache, cache_path, path, &pdata, &tmpgerr);
+    free(pdata);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "filecache_prefetch: ");
+        return false;
+    }
+    return true;
+}
+
+// Do the conditional GET a stale open put off
+static void stale_revalidate(filecache_t *cache, const char *cache_path, const char *path) {
+    struct filecache_pdata *pdata;
+    GError *tmpgerr = NULL;
+
+    pdata = filecache_pdata_get(cache, path, NULL);
+    // Deleted since, or another open already went to the server
+    if (pdata == NULL || pdata_is_fresh(pdata, false)) {
+        free(pdata);
+        return;
+    }
+
+    fetch_unopened(cache, cache_path, path, &pdata, &tmpgerr);
+    if (tmpgerr) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_OPEN, "stale_revalidate: %s: %s", path, tmpgerr->message);
+        BUMP(filecache_stale_failed);
+        g_clear_error(&tmpgerr);
+    }
+    else {
+        BUMP(filecache_stale_revalidated);
+    }
+
+    free(pdata);
+}
+
+static void *stale_worker(__unused void *ptr) {
+    log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "enter stale_worker");
+
+    while (true) {
+        char *path;
+
+        pthread_mutex_lock(&stale_mutex);
+        while (g_queue_is_empty(stale_queue)) {
+            pthread_cond_wait(&stale_cond, &stale_mutex);
+        }
+        path = g_queue_pop_head(stale_queue);
+        pthread_mutex_unlock(&stale_mutex);
+
+        stale_revalidate(stale_cache, stale_cache_path, path);
+
+        // Until now, further stale opens of path needn't queue it again
+        pthread_mutex_lock(&stale_mutex);
+        g_hash_table_remove(stale_queued, path);
+        pthread_mutex_unlock(&stale_mutex);
+        free(path);
+    }
+    return NULL;
+}
+
+// patterns is ';'-separated pattern:seconds, e.g. "*.css:60;/static/*:300"
+void filecache_stale_init(filecache_t *cache, const char *cache_path, const char *patterns) {
+    GPtrArray *bounds;
+    char **list;
+    int started = 0;
+
+    if (patterns == NULL) return;
+
+    bounds = g_ptr_array_new();
+    list = g_strsplit(patterns, ";", -1);
+    for (int idx = 0; list[idx]; idx++) {
+        char *pattern = g_strstrip(list[idx]);
+        char *colon = strrchr(pattern, ':');
+        struct stale_bound *bound;
+        char *end;
+        long max_age;
+
+        if (pattern[0] == '\0') continue;
+        if (colon == NULL || colon == pattern) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_CACHE, "filecache_stale_init: %s is not pattern:seconds; ignored", pattern);
+            continue;
+        }
+        max_age = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || max_age <= 0) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_CACHE, "filecache_stale_init: %s is not pattern:seconds; ignored", pattern);
+            continue;
+        }
+        *colon = '\0';
+        bound = malloc(sizeof(struct stale_bound));
+        if (bound == NULL) continue;
+        bound->spec = g_pattern_spec_new(pattern);
+        bound->whole_path = (strchr(pattern, '/') != NULL);
+        bound->max_age = max_age;
+        g_ptr_array_add(bounds, bound);
+        log_print(LOG_NOTICE, SECTION_FILECACHE_CACHE, "filecache_stale_init: %s may be served up to %lds stale", pattern, max_age);
+    }
+    g_strfreev(list);
+
+    if (bounds->len == 0) {
+        g_ptr_array_free(bounds, true);
+        return;
+    }
+
+    stale_cache = cache;
+    stale_cache_path = strdup(cache_path);
+    stale_queue = g_queue_new();
+    stale_queued = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+
+    for (int idx = 0; idx < STALE_REVALIDATORS; idx++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, stale_worker, NULL)) {
+            log_print(LOG_ERR, SECTION_FILECACHE_CACHE, "filecache_stale_init: failed to start revalidator %d", idx);
+            continue;
+        }
+        pthread_detach(thread);
+        ++started;
+    }
+    // Without a revalidator nothing stale would ever be refreshed; open as before
+    if (started == 0) {
+        log_print(LOG_ERR, SECTION_FILECACHE_CACHE, "filecache_stale_init: no revalidators; stale_while_revalidate is off");
+        return;
+    }
+
+    stale_bounds = bounds;
+}
+
 // top-level open call
 void filecache_open(char *cache_path, filecache_t *cache, const char *path, struct fuse_file_info *info, bool grace, GError **gerr) {
     struct filecache_pdata *pdata = NULL;
@@ -797,6 +2847,12 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
             "filecache_open: already in saint mode, using local copy: %s", path);
     }
 
+    // The server has nothing to say about a local-only file
+    if (filecache_local_only(path)) {
+        use_local_copy = true;
+        max_retries = 1;
+    }
+
     // Allocate and zero-out a session data structure.
     sdata = calloc(1, sizeof(struct filecache_sdata));
     if (sdata == NULL || inject_error(filecache_error_opencalloc)) {
@@ -804,6 +2860,23 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
         goto fail;
     }
 
+    sdata->append_offset = -1;
+
+    // A hot small file may not even need its cache file
+    if (ram_tier_open(path, sdata, flags, use_local_copy)) {
+        sdata->readable = 1;
+        info->fh = (uint64_t) sdata;
+        return;
+    }
+
+    // A repeated read-only open of a fresh file needs nothing beyond what's already in memory
+    if (open_file_reuse(path, sdata, flags, use_local_copy)) {
+        sdata->readable = 1;
+        info->fh = (uint64_t) sdata;
+        ram_tier_consider(path, sdata);
+        return;
+    }
+
     // NB. We call get_fresh_fd; it tries each of the servers. If they all fail
     // we try again but force it to use the local copy. This should make saint mode
     // work on first access in the face of network errors, but seems not to be.
@@ -831,17 +2904,23 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
                     "filecache_open: creating a file that already has a cache entry: %s", path);
             }
             log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "filecache_open: calling create_file on %s", path);
-            create_file(sdata, cache_path, cache, path, &tmpgerr);
+            create_file(sdata, cache_path, cache, path, &pdata, &tmpgerr);
             if (tmpgerr) {
                 g_propagate_prefixed_error(gerr, tmpgerr, "filecache_open: ");
                 goto fail;
             }
+            sdata->created = true;
             break;
         }
 
+        if (pdata == NULL && filecache_local_only(path)) {
+            g_set_error(gerr, filecache_quark(), E_FC_PDATANULL, "filecache_open: local-only %s is not in the cache", path);
+            goto fail;
+        }
+
         // Get a file descriptor pointing to a guaranteed-fresh file.
         log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "filecache_open: calling get_fresh_fd on %s", path);
-        get_fresh_fd(cache, cache_path, path, sdata, &pdata, flags, use_local_copy, &tmpgerr);
+        get_fresh_fd(cache, cache_path, path, sdata, &pdata, flags, use_local_copy, true, &tmpgerr);
         if (tmpgerr) {
             // If we got a network error (curl_quark is a marker) and we 
             // are using grace, try again but use the local copy
@@ -867,7 +2946,7 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
     if (flags & O_RDONLY || flags & O_RDWR) sdata->readable = 1;
     if (flags & O_WRONLY || flags & O_RDWR) sdata->writable = 1;
 
-    if (sdata->fd >= 0) {
+    if (sdata->fd >= 0 || sdata->is_inline) {
         if (pdata) {
             log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN,
             "filecache_open: Setting fd to session data structure with fd %d for %s :: %s:%lu.",
@@ -877,6 +2956,32 @@ void filecache_open(char *cache_path, filecache_t *cache, const char *path, stru
             log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN,
             "filecache_open: Setting fd to session data structure with fd %d for %s :: (no pdata).", sdata->fd, path);
         }
+        if (pdata) sdata->ofile = open_file_acquire(path, pdata, sdata, flags);
+        if (pdata && sdata->writable && sdata->fd >= 0) sdata->lock = cache_lock_acquire(pdata->filename);
+        // A writer on a just-validated file knows which server version it started from
+        if (pdata && sdata->writable && pdata->etag[0] != '\0' && pdata->last_server_update != 0 &&
+                time(NULL) - pdata->last_server_update <= REFRESH_INTERVAL) {
+            strncpy(sdata->base_etag, pdata->etag, ETAG_MAX + 1);
+            // Remember what that version holds before anything is written, so
+            // writing it back unchanged costs no PUT
+            if (!(flags & O_TRUNC) && sdata->fd >= 0 && !content_hash_matches(cache, path, sdata->base_etag, NULL)) {
+                unsigned char digest[CONTENT_HASH_LEN];
+                if (content_hash_compute(sdata->fd, digest)) content_hash_set(cache, path, sdata->base_etag, digest);
+            }
+            if (append_put) {
+                struct stat st;
+                if (fstat(sdata->fd, &st) == 0) sdata->synced_size = st.st_size;
+            }
+        }
+        // Only a writer starting from an empty file can be streamed; uploads
+        // in write-back mode, and deferred ones of new files, are the uploaders' business,
+        // and local-only files aren't uploaded at all
+        if (pipelined_put && !writeback_enabled && !(sdata->created && new_file_delay > 0) && sdata->lock &&
+                !filecache_local_only(path)) {
+            struct stat st;
+            if (fstat(sdata->fd, &st) == 0 && st.st_size == 0) sdata->append_offset = 0;
+        }
+        if (shareable_flags(flags)) ram_tier_consider(path, sdata);
         info->fh = (uint64_t) sdata;
         goto finish;
     }
@@ -891,6 +2996,57 @@ finish:
     free(pdata);
 }
 
+// Apply the page-cache policy (see fadvise_enabled) after a read. The fields
+// are only hints, so reads racing on one session at worst cost a hint.
+static void read_advise(struct filecache_sdata *sdata, off_t offset, ssize_t bytes_read) {
+    bool alone;
+
+    if (sdata->writable || bytes_read <= 0) return;
+
+    if (offset + READ_SKEW < sdata->read_next || offset > sdata->read_next + READ_SKEW) {
+        // A jump; what we said about this fd no longer holds
+        if (sdata->read_run >= READ_SEQUENTIAL_RUN && sdata->read_size >= READ_ADVISE_WINDOW) {
+            posix_fadvise(sdata->fd, 0, 0, POSIX_FADV_NORMAL);
+        }
+        sdata->read_run = 0;
+        sdata->read_ahead = 0;
+        sdata->read_next = offset + bytes_read;
+        return;
+    }
+    sdata->read_next = MAX(sdata->read_next, offset + bytes_read);
+    if (++sdata->read_run < READ_SEQUENTIAL_RUN) return;
+
+    if (sdata->read_size == 0) {
+        struct stat st;
+        if (fstat(sdata->fd, &st) == 0) sdata->read_size = st.st_size;
+    }
+    // Small files are what the page cache is for
+    if (sdata->read_size < READ_ADVISE_WINDOW) return;
+
+    // Readahead and eviction hints reach everyone reading the file
+    alone = sdata->ofile == NULL || __sync_fetch_and_or(&sdata->ofile->refcount, 0) == 1;
+
+    if (sdata->read_run == READ_SEQUENTIAL_RUN && alone) {
+        posix_fadvise(sdata->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        BUMP(filecache_fadvise_sequential);
+    }
+
+    // Top up the window ahead once half of it has been read
+    if (sdata->read_next + READ_ADVISE_WINDOW / 2 > sdata->read_ahead && sdata->read_ahead < sdata->read_size) {
+        off_t from = MAX(sdata->read_ahead, sdata->read_next);
+        posix_fadvise(sdata->fd, from, sdata->read_next + READ_ADVISE_WINDOW - from, POSIX_FADV_WILLNEED);
+        sdata->read_ahead = sdata->read_next + READ_ADVISE_WINDOW;
+    }
+
+    if (alone && fadvise_stream_size > 0 && sdata->read_size >= fadvise_stream_size &&
+            offset - READ_ADVISE_WINDOW >= sdata->read_dropped + READ_ADVISE_WINDOW) {
+        off_t to = offset - READ_ADVISE_WINDOW;
+        posix_fadvise(sdata->fd, sdata->read_dropped, to - sdata->read_dropped, POSIX_FADV_DONTNEED);
+        sdata->read_dropped = to;
+        BUMP(filecache_fadvise_dontneed);
+    }
+}
+
 // top-level read call
 ssize_t filecache_read(struct fuse_file_info *info, char *buf, size_t size, off_t offset, GError **gerr) {
     struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
@@ -905,6 +3061,13 @@ ssize_t filecache_read(struct fuse_file_info *info, char *buf, size_t size, off_
 
     log_print(LOG_INFO, SECTION_FILECACHE_IO, "filecache_read: fd=%d", sdata->fd);
 
+    if (sdata->is_inline) {
+        if (offset < 0 || (size_t) offset >= sdata->isize) return 0;
+        bytes_read = MIN(size, sdata->isize - offset);
+        memcpy(buf, sdata->idata + offset, bytes_read);
+        return bytes_read;
+    }
+
     bytes_read = pread(sdata->fd, buf, size, offset);
     if (bytes_read < 0 || inject_error(filecache_error_readread)) {
         g_set_error(gerr, system_quark(), errno, "filecache_read: pread failed: ");
@@ -914,6 +3077,8 @@ ssize_t filecache_read(struct fuse_file_info *info, char *buf, size_t size, off_
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_IO, "Done reading: %d from %d.", bytes_read, sdata->fd);
 
+    if (fadvise_enabled) read_advise(sdata, offset, bytes_read);
+
     return bytes_read;
 }
 
@@ -927,89 +3092,738 @@ static void set_error(struct filecache_sdata *sdata, int error_code) {
     }
 }
 
+// Hands curl what the writer has appended so far, waiting for more until
+// the writer finishes or abandons the stream
+static size_t stream_read_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
+    struct put_stream *stream = (struct put_stream *) userdata;
+    struct timespec deadline;
+    size_t available;
+    ssize_t bytes;
+
+    pthread_mutex_lock(&stream->mutex);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += PIPELINE_IDLE_MAX;
+    while (!stream->abandoned && !stream->finished && stream->sent >= stream->written) {
+        if (pthread_cond_timedwait(&stream->cond, &stream->mutex, &deadline) == ETIMEDOUT) {
+            log_print(LOG_INFO, SECTION_FILECACHE_COMM, "stream_read_callback: writer idle on %s; abandoning", stream->path);
+            stream->abandoned = true;
+        }
+    }
+    if (stream->abandoned) {
+        pthread_mutex_unlock(&stream->mutex);
+        return CURL_READFUNC_ABORT;
+    }
+    available = MIN(size * nitems, (size_t) (stream->written - stream->sent));
+    pthread_mutex_unlock(&stream->mutex);
+
+    // Only this thread moves sent, and the bytes below written no longer change
+    if (available == 0) return 0;
+    bytes = pread(stream->fd, buffer, available, stream->sent);
+    if (bytes <= 0) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "stream_read_callback: pread failed on %s: %s", stream->path, strerror(errno));
+        return CURL_READFUNC_ABORT;
+    }
+
+    pthread_mutex_lock(&stream->mutex);
+    stream->sent += bytes;
+    pthread_mutex_unlock(&stream->mutex);
+    return bytes;
+}
+
+// One attempt only; a stream that fails leaves the file to the PUT at release
+static void *pipeline_worker(void *ptr) {
+    struct put_stream *stream = (struct put_stream *) ptr;
+    struct curl_slist *slist = NULL;
+    long elapsed_time = 0;
+    bool abandoned;
+    CURL *session;
+
+    session = session_request_init(stream->path, NULL, false);
+    if (!session) {
+        try_release_request_outstanding();
+        stream->res = CURLE_FAILED_INIT;
+        return NULL;
+    }
+
+    curl_easy_setopt(session, CURLOPT_CUSTOMREQUEST, "PUT");
+    curl_easy_setopt(session, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(session, CURLOPT_READFUNCTION, stream_read_callback);
+    curl_easy_setopt(session, CURLOPT_READDATA, (void *) stream);
+    // The request lasts as long as the writer does; idleness is bounded by PIPELINE_IDLE_MAX instead
+    curl_easy_setopt(session, CURLOPT_TIMEOUT, 0L);
+
+    slist = curl_slist_append(slist, "Transfer-Encoding: chunked");
+    slist = curl_slist_append(slist, "Expect:");
+    slist = enhanced_logging(slist, LOG_DYNAMIC, SECTION_FILECACHE_COMM, "pipeline_worker: %s", stream->path);
+    if (slist) curl_easy_setopt(session, CURLOPT_HTTPHEADER, slist);
+
+    curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, capture_etag);
+    curl_easy_setopt(session, CURLOPT_WRITEHEADER, stream->etag);
+
+    timed_curl_easy_perform(session, &stream->res, &stream->response_code, &elapsed_time);
+
+    if (slist) curl_slist_free_all(slist);
+
+    // An abandoned stream fails on purpose; don't count it against the server
+    pthread_mutex_lock(&stream->mutex);
+    abandoned = stream->abandoned;
+    pthread_mutex_unlock(&stream->mutex);
+    if (!abandoned) {
+        process_status("pipeline_worker", session, stream->res, stream->response_code, elapsed_time, 0, stream->path, false);
+    }
+    return NULL;
+}
+
+// Caller holds pipeline_mutex
+static void pipeline_start(struct filecache_sdata *sdata) {
+    struct put_stream *stream;
+    char *path;
+
+    path = open_file_path(sdata->ofile);
+    if (path == NULL) {
+        sdata->append_offset = -1;
+        return;
+    }
+
+    stream = calloc(1, sizeof(struct put_stream));
+    if (stream == NULL) {
+        free(path);
+        sdata->append_offset = -1;
+        return;
+    }
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    stream->path = path;
+    stream->fd = sdata->fd;
+    stream->written = sdata->append_offset;
+    stream->response_code = 500;
+
+    if (pthread_create(&stream->thread, NULL, pipeline_worker, stream)) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "pipeline_start: failed to start uploader for %s", path);
+        pthread_cond_destroy(&stream->cond);
+        pthread_mutex_destroy(&stream->mutex);
+        free(stream->path);
+        free(stream);
+        sdata->append_offset = -1;
+        return;
+    }
+
+    BUMP(filecache_pipeline_started);
+    log_print(LOG_INFO, SECTION_FILECACHE_COMM, "pipeline_start: streaming %s from fd %d", path, sdata->fd);
+    sdata->stream = stream;
+}
+
+// Caller holds pipeline_mutex. Leaves the stream for pipeline_end to reap,
+// so the writer doesn't wait on the network.
+static void pipeline_abandon(struct filecache_sdata *sdata) {
+    sdata->append_offset = -1;
+    if (sdata->stream == NULL) return;
+
+    pthread_mutex_lock(&sdata->stream->mutex);
+    sdata->stream->abandoned = true;
+    pthread_cond_signal(&sdata->stream->cond);
+    pthread_mutex_unlock(&sdata->stream->mutex);
+}
+
+// Account for a write at offset which succeeded with size bytes
+static void pipeline_append(struct filecache_sdata *sdata, off_t offset, size_t size) {
+    if (!pipelined_put) return;
+
+    pthread_mutex_lock(&pipeline_mutex);
+    if (sdata->append_offset < 0) goto finish;
+    if (offset != sdata->append_offset) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_IO, "pipeline_append: write at %ld, expected %ld; no pipelining on fd %d",
+            offset, sdata->append_offset, sdata->fd);
+        pipeline_abandon(sdata);
+        goto finish;
+    }
+
+    sdata->append_offset += size;
+    if (sdata->stream) {
+        pthread_mutex_lock(&sdata->stream->mutex);
+        sdata->stream->written = sdata->append_offset;
+        pthread_cond_signal(&sdata->stream->cond);
+        pthread_mutex_unlock(&sdata->stream->mutex);
+    }
+    else if (sdata->append_offset >= PIPELINE_START_SIZE) {
+        pipeline_start(sdata);
+    }
+
+finish:
+    pthread_mutex_unlock(&pipeline_mutex);
+}
+
+// Finish the session's stream, if it has one, and wait for the server's answer.
+// If path is NULL, or not where the stream was going, the stream is abandoned.
+// Returns true, with etag filled in, if the stream uploaded the whole file.
+static bool pipeline_end(struct filecache_sdata *sdata, const char *path, char *etag) {
+    struct put_stream *stream;
+    struct stat st;
+    bool complete;
+    bool uploaded = false;
+
+    pthread_mutex_lock(&pipeline_mutex);
+    stream = sdata->stream;
+    sdata->stream = NULL;
+    sdata->append_offset = -1;
+    pthread_mutex_unlock(&pipeline_mutex);
+
+    if (stream == NULL) return false;
+
+    // Whatever else may have changed the file, a size other than what we streamed gives it away
+    complete = (path != NULL && strcmp(path, stream->path) == 0 &&
+        fstat(sdata->fd, &st) == 0 && st.st_size == stream->written);
+
+    pthread_mutex_lock(&stream->mutex);
+    if (complete) stream->finished = true;
+    else stream->abandoned = true;
+    pthread_cond_signal(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+
+    pthread_join(stream->thread, NULL);
+
+    if (!stream->abandoned && stream->res == CURLE_OK && stream->response_code >= 200 && stream->response_code < 300) {
+        BUMP(filecache_pipeline_completed);
+        log_print(LOG_INFO, SECTION_FILECACHE_COMM, "pipeline_end: streamed %ld bytes of %s", stream->written, stream->path);
+        strncpy(etag, stream->etag, ETAG_MAX + 1);
+        uploaded = true;
+    }
+    else {
+        log_print(LOG_INFO, SECTION_FILECACHE_COMM, "pipeline_end: stream of %s %s (%s, %ld); falling back to PUT",
+            stream->path, stream->abandoned ? "abandoned" : "failed", curl_easy_strerror(stream->res), stream->response_code);
+        if (stream->abandoned) BUMP(filecache_pipeline_abandoned);
+        else BUMP(filecache_pipeline_failed);
+    }
+
+    pthread_cond_destroy(&stream->cond);
+    pthread_mutex_destroy(&stream->mutex);
+    free(stream->path);
+    free(stream);
+    return uploaded;
+}
+
 // top-level write call
 ssize_t filecache_write(struct fuse_file_info *info, const char *buf, size_t size, off_t offset, GError **gerr) {
     struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+    GError *tmpgerr = NULL;
     ssize_t bytes_written;
 
-    BUMP(filecache_write);
+    BUMP(filecache_write);
+
+    if (sdata == NULL || inject_error(filecache_error_writesdata)) {
+        g_set_error(gerr, filecache_quark(), E_FC_SDATANULL, "filecache_write: sdata is NULL");
+        return -1;
+    }
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_IO, "filecache_write: fd=%d", sdata->fd);
+
+    if (!sdata->writable || inject_error(filecache_error_writewriteable)) {
+        g_set_error(gerr, system_quark(), EBADF, "filecache_write: not writable");
+        return -1;
+    }
+
+    // Don't write to a file while it is being PUT
+    cache_lock_take(sdata->lock, false, &tmpgerr);
+    if (tmpgerr || inject_error(filecache_error_writeflock1)) {
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "filecache_write: ");
+        } else {
+            cache_lock_drop(sdata->lock);
+            g_set_error(gerr, system_quark(), EIO, "filecache_write: error acquiring shared file lock");
+        }
+        return -1;
+    }
+
+    bytes_written = pwrite(sdata->fd, buf, size, offset);
+
+    // If pwrite fails, file goes to forensic haven
+    if (bytes_written < 0 || inject_error(filecache_error_writewrite)) {
+        set_error(sdata, errno);
+        g_set_error(gerr, system_quark(), errno, "filecache_write: pwrite failed");
+        log_print(LOG_INFO, SECTION_FILECACHE_IO, "filecache_write: %ld::%d %lu %ld :: %s", bytes_written, sdata->fd, size, offset, strerror(errno));
+    } else {
+        sdata->modified = true;
+        __sync_fetch_and_add(&sdata->writes, 1);
+        log_print(LOG_INFO, SECTION_FILECACHE_IO, "filecache_write: wrote %d bytes on fd %d", bytes_written, sdata->fd);
+        // Only the first write needs to ask the kernel for the size
+        if (!sdata->size_known) {
+            sdata->size = lseek(sdata->fd, 0, SEEK_END);
+            sdata->size_known = (sdata->size >= 0);
+        }
+        if (sdata->size_known) {
+            sdata->size = MAX(sdata->size, offset + bytes_written);
+            open_file_set_size(sdata->ofile, sdata->size, true);
+        }
+        ram_tier_session_dirty(sdata);
+        if (offset < sdata->synced_size) sdata->synced_size = 0;
+        pipeline_append(sdata, offset, bytes_written);
+    }
+
+    cache_lock_drop(sdata->lock);
+
+    return bytes_written;
+}
+
+// close the file
+void filecache_close(struct fuse_file_info *info, GError **gerr) {
+    struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+
+    BUMP(filecache_close);
+
+    if (sdata == NULL || inject_error(filecache_error_closesdata)) {
+        g_set_error(gerr, filecache_quark(), E_FC_SDATANULL, "filecache_close: sdata is NULL");
+        return;
+    }
+
+    log_print(LOG_INFO, SECTION_FILECACHE_FILE, "filecache_close: fd (%d).", sdata->fd);
+
+    if (sdata->is_inline) {
+        free(sdata->idata);
+    }
+    else if (sdata->fd <= 0 || inject_error(filecache_error_closefd))  {
+        g_set_error(gerr, system_quark(), EBADF, "filecache_close doesn't have legitimate file descriptor");
+    }
+    else if (sdata->cfd) {
+        // Shared descriptor; open_file_release closes it once nobody uses it
+        log_print(LOG_DEBUG, SECTION_FILECACHE_FILE, "filecache_close: released shared fd (%d).", sdata->fd);
+    }
+    else {
+        if (close(sdata->fd) < 0 || inject_error(filecache_error_closeclose)) {
+            g_set_error(gerr, system_quark(), errno, "filecache_close: close failed on fd (%d)", sdata->fd);
+        }
+        else {
+            log_print(LOG_DEBUG, SECTION_FILECACHE_FILE, "filecache_close: closed fd (%d).", sdata->fd);
+        }
+    }
+
+    // A session closed without a PUT (e.g. its file was unlinked) leaves its stream unfinished
+    pipeline_end(sdata, NULL, NULL);
+    open_file_release(sdata);
+    cache_lock_unref(sdata->lock);
+    free(sdata);
+
+    return;
+}
+
+// Make an unnamed private copy of a cache file for a PUT to read from, so
+// writers only wait for the copy instead of the whole upload. It's a reflink
+// where the cache filesystem shares extents (btrfs, xfs), a plain copy
+// elsewhere. Called with the file's cache_lock held exclusively.
+// Returns -1 if there is no snapshot; the PUT then reads the live file.
+static fd_t snapshot_cache_file(fd_t fd, const char *filename) {
+    char dir[PATH_MAX];
+    struct stat st;
+    off_t offset = 0;
+    fd_t snapfd;
+
+    strncpy(dir, filename, PATH_MAX - 1);
+    dir[PATH_MAX - 1] = '\0';
+    snapfd = open(dirname(dir), O_TMPFILE | O_RDWR, 0600);
+    if (snapfd < 0) {
+        log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "snapshot_cache_file: no O_TMPFILE for %s: %s", filename, strerror(errno));
+        goto fail;
+    }
+
+    if (ioctl(snapfd, FICLONE, fd) == 0) {
+        BUMP(filecache_snapshot_reflink);
+        return snapfd;
+    }
+
+    if (fstat(fd, &st)) goto fail;
+    while (offset < st.st_size) {
+        if (sendfile(snapfd, fd, &offset, st.st_size - offset) <= 0) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "snapshot_cache_file: copy of %s failed: %s", filename, strerror(errno));
+            goto fail;
+        }
+    }
+    BUMP(filecache_snapshot_copy);
+    return snapfd;
+
+fail:
+    if (snapfd >= 0) close(snapfd);
+    BUMP(filecache_snapshot_none);
+    return -1;
+}
+
+// PUT bodies are read straight from the cache file into curl's upload
+// buffer, at offsets which are multiples of the buffer size
+#define PUT_BUFFER_SIZE (512 * 1024)
+
+struct put_body {
+    fd_t fd;
+    off_t start;
+    off_t offset;
+    off_t end;
+};
+
+static size_t put_read_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
+    struct put_body *body = (struct put_body *) userdata;
+    size_t want = MIN(size * nitems, (size_t) (body->end - body->offset));
+    ssize_t bytes;
+
+    if (want == 0) return 0;
+    do {
+        bytes = pread(body->fd, buffer, want, body->offset);
+    } while (bytes < 0 && errno == EINTR);
+
+    if (bytes < 0) {
+        log_print(LOG_ERR, SECTION_FILECACHE_COMM, "put_read_callback: pread failed on fd %d at %ld: %s",
+            body->fd, (long) body->offset, strerror(errno));
+        return CURL_READFUNC_ABORT;
+    }
+    body->offset += bytes;
+    return bytes;
+}
+
+// curl rewinds the body if it has to resend it, e.g. after a redirect
+static int put_seek_callback(void *userdata, curl_off_t offset, int origin) {
+    struct put_body *body = (struct put_body *) userdata;
+
+    if (origin != SEEK_SET) return CURL_SEEKFUNC_CANTSEEK;
+    body->offset = body->start + offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+// Progress of a chunked upload, kept in leveldb under "up:<path>" next to the
+// path's pdata. It only applies to the same content, as told by the cache
+// file's size and mtime when the upload started.
+static const char * upload_prefix = "up:";
+
+struct upload_progress {
+    off_t size;
+    struct timespec mtime;
+    off_t offset; // bytes the server has acknowledged
+};
+
+static char *upload_key(const char *path) {
+    char *key = NULL;
+
+    asprintf(&key, "%s%s", upload_prefix, path);
+    return key;
+}
+
+// Returns true, with *progress filled in, if an earlier upload of the same content got partway
+static bool upload_progress_get(filecache_t *cache, const char *path, const struct upload_progress *identity,
+        struct upload_progress *progress) {
+    leveldb_readoptions_t *options;
+    struct upload_progress stored;
+    char *ldberr = NULL;
+    char *value;
+    size_t vallen;
+    char *key;
+    bool found = false;
+
+    key = upload_key(path);
+    options = leveldb_readoptions_create();
+    value = leveldb_get(cache, options, key, strlen(key) + 1, &vallen, &ldberr);
+    leveldb_readoptions_destroy(options);
+    free(key);
+
+    if (ldberr != NULL) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "upload_progress_get: leveldb_get error %s on %s", ldberr, path);
+        free(ldberr);
+    }
+    else if (value && vallen == sizeof(struct upload_progress)) {
+        memcpy(&stored, value, sizeof(struct upload_progress));
+        found = (stored.size == identity->size && stored.mtime.tv_sec == identity->mtime.tv_sec &&
+            stored.mtime.tv_nsec == identity->mtime.tv_nsec && stored.offset > 0 && stored.offset < stored.size);
+        if (found) *progress = stored;
+    }
+    free(value);
+    return found;
+}
+
+// Losing one of these only costs resending a chunk, so it isn't a synced write
+static void upload_progress_set(filecache_t *cache, const char *path, const struct upload_progress *progress) {
+    leveldb_writeoptions_t *options;
+    char *ldberr = NULL;
+    char *key;
+
+    key = upload_key(path);
+    options = leveldb_writeoptions_create();
+    leveldb_put(cache, options, key, strlen(key) + 1, (const char *) progress, sizeof(struct upload_progress), &ldberr);
+    leveldb_writeoptions_destroy(options);
+    free(key);
+
+    if (ldberr != NULL) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "upload_progress_set: leveldb_put error %s on %s", ldberr, path);
+        free(ldberr);
+    }
+}
+
+static void upload_progress_delete(filecache_t *cache, const char *path) {
+    leveldb_writeoptions_t *options;
+    char *ldberr = NULL;
+    char *key;
+
+    if (upload_chunk_size == 0) return;
+
+    key = upload_key(path);
+    options = leveldb_writeoptions_create();
+    leveldb_delete(cache, options, key, strlen(key) + 1, &ldberr);
+    leveldb_writeoptions_destroy(options);
+    free(key);
+
+    if (ldberr != NULL) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "upload_progress_delete: leveldb_delete error %s on %s", ldberr, path);
+        free(ldberr);
+    }
+}
+
+// Does the fileserver take Content-Range PUTs? Asked once, with OPTIONS;
+// a server which does answers "X-Put-Ranges: bytes". Accept-Ranges won't do:
+// it only speaks for GETs, and a server which ignores Content-Range on a PUT
+// would store each range as the whole file.
+static int range_put_support = -1; // -1 until the server has answered
+
+static size_t capture_put_ranges(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    size_t real_size = size * nmemb;
+    const char *header = (const char *) ptr;
+    bool *accepts = (bool *) userdata;
+
+    if (real_size > 13 && strncasecmp(header, "X-Put-Ranges:", 13) == 0) {
+        const char *value = header + 13;
+        while (isspace(value[0])) ++value;
+        if (strncasecmp(value, "bytes", 5) == 0) *accepts = true;
+    }
+    return real_size;
+}
+
+static bool server_accepts_range_put(void) {
+    CURL *session;
+    CURLcode res = CURLE_OK;
+    long response_code = 0;
+    long elapsed_time = 0;
+    bool accepts = false;
+    int known = range_put_support;
+
+    if (known >= 0) return known;
+
+    session = session_request_init("/", NULL, false);
+    if (!session) {
+        try_release_request_outstanding();
+        return false;
+    }
+    curl_easy_setopt(session, CURLOPT_CUSTOMREQUEST, "OPTIONS");
+    curl_easy_setopt(session, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, capture_put_ranges);
+    curl_easy_setopt(session, CURLOPT_WRITEHEADER, &accepts);
+    timed_curl_easy_perform(session, &res, &response_code, &elapsed_time);
+    process_status("server_accepts_range_put", session, res, response_code, elapsed_time, 0, "/", false);
+
+    // Ask again next time if the server couldn't be reached
+    if (res != CURLE_OK || response_code >= 500) return false;
+
+    range_put_support = accepts;
+    log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "server_accepts_range_put: %s", accepts ? "yes" : "no");
+    return accepts;
+}
+
+// PUT length bytes of fd from offset, retrying across the fileserver nodes.
+// With total >= 0 the body is that range of a total-byte file (Content-Range);
+// otherwise it is the whole file. if_match, if not NULL, is the etag the
+// server's copy must still have.
+static void put_range(const char *path, fd_t fd, off_t offset, off_t length, off_t total, const char *if_match,
+        char *etag, CURLcode *res, long *response_code, GError **gerr) {
+    static const char *funcname = "put_range";
+
+    *res = CURLE_OK;
+    *response_code = 500; // seed it as bad so we can enter the loop
+
+    // If we're in saint mode, skip the PUT altogether
+    for (int idx = 0;
+         idx < num_filesystem_server_nodes && (*res != CURLE_OK || *response_code >= 500);
+         idx++) {
+        long elapsed_time = 0;
+        CURL *session;
+        struct curl_slist *slist = NULL;
+        struct put_body body;
+        char *header = NULL;
+        bool non_retriable_error;
+
+        body.fd = fd;
+        body.start = offset;
+        body.offset = offset;
+        body.end = offset + length;
+
+        // REVIEW: We didn't use to check for sesssion == NULL, so now we 
+        // also call try_release_request_outstanding. Is this OK?
+        session = session_request_init(path, NULL, false);
+        if (!session || inject_error(filecache_error_putsession)) {
+            g_set_error(gerr, curl_quark(), E_FC_CURLERR, "%s: Failed session_request_init on PUT", funcname);
+            // TODO(kibra): Manually cleaning up this lock sucks. We should make sure this happens in a better way.
+            try_release_request_outstanding();
+            return;
+        }
+
+        curl_easy_setopt(session, CURLOPT_CUSTOMREQUEST, "PUT");
+        curl_easy_setopt(session, CURLOPT_UPLOAD, 1L);
+        curl_easy_setopt(session, CURLOPT_INFILESIZE, length);
+        curl_easy_setopt(session, CURLOPT_READFUNCTION, put_read_callback);
+        curl_easy_setopt(session, CURLOPT_READDATA, (void *) &body);
+        curl_easy_setopt(session, CURLOPT_SEEKFUNCTION, put_seek_callback);
+        curl_easy_setopt(session, CURLOPT_SEEKDATA, (void *) &body);
+#if LIBCURL_VERSION_NUM >= 0x073e00
+        curl_easy_setopt(session, CURLOPT_UPLOAD_BUFFERSIZE, (long) PUT_BUFFER_SIZE);
+#endif
+
+        // Our own fileserver never rejects a PUT up front, so don't spend a
+        // round trip on Expect: 100-continue before sending the body
+        slist = curl_slist_append(slist, "Expect:");
+        if (total >= 0) {
+            asprintf(&header, "Content-Range: bytes %lld-%lld/%lld",
+                (long long) offset, (long long) (offset + length - 1), (long long) total);
+            slist = curl_slist_append(slist, header);
+            free(header);
+        }
+        if (if_match) {
+            asprintf(&header, "If-Match: %s", if_match);
+            slist = curl_slist_append(slist, header);
+            free(header);
+        }
+        slist = enhanced_logging(slist, LOG_DYNAMIC, SECTION_FILECACHE_COMM, "put_range: %s", path);
+        if (slist) curl_easy_setopt(session, CURLOPT_HTTPHEADER, slist);
+
+        // Set a header capture path.
+        etag[0] = '\0';
+        curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, capture_etag);
+        curl_easy_setopt(session, CURLOPT_WRITEHEADER, etag);
 
-    if (sdata == NULL || inject_error(filecache_error_writesdata)) {
-        g_set_error(gerr, filecache_quark(), E_FC_SDATANULL, "filecache_write: sdata is NULL");
-        return -1;
-    }
+        timed_curl_easy_perform(session, res, response_code, &elapsed_time);
 
-    log_print(LOG_DEBUG, SECTION_FILECACHE_IO, "filecache_write: fd=%d", sdata->fd);
+        if (slist) curl_slist_free_all(slist);
 
-    if (!sdata->writable || inject_error(filecache_error_writewriteable)) {
-        g_set_error(gerr, system_quark(), EBADF, "filecache_write: not writable");
-        return -1;
+        non_retriable_error = process_status(funcname, session, *res, *response_code, elapsed_time, idx, path, false);
+        // Some errors should not be retried. (Non-errors will fail the
+        // for loop test and fall through naturally)
+        if (non_retriable_error) break;
     }
+}
 
-    // Don't write to a file while it is being PUT
-    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: acquiring shared file lock on fd %d", sdata->fd);
-    if (flock(sdata->fd, LOCK_SH) || inject_error(filecache_error_writeflock1)) {
-        g_set_error(gerr, system_quark(), errno, "filecache_write: error acquiring shared file lock");
-        return -1;
+// Upload a large file in upload_chunk_size ranges, recording each one which
+// lands, so a later attempt at the same content picks up where this one stopped
+static void put_chunked(filecache_t *cache, const char *path, fd_t fd, const struct upload_progress *identity,
+        off_t size, char *etag, CURLcode *res, long *response_code, GError **gerr) {
+    struct upload_progress progress;
+    bool restarted = false;
+
+    progress = *identity;
+    progress.offset = 0;
+    if (upload_progress_get(cache, path, identity, &progress)) {
+        BUMP(filecache_upload_resumed);
+        log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "put_chunked: resuming %s at %lld of %lld",
+            path, (long long) progress.offset, (long long) size);
     }
-    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: acquired shared file lock on fd %d", sdata->fd);
 
-    bytes_written = pwrite(sdata->fd, buf, size, offset);
+    do {
+        off_t length = MIN((off_t) upload_chunk_size, size - progress.offset);
 
-    // If pwrite fails, file goes to forensic haven
-    if (bytes_written < 0 || inject_error(filecache_error_writewrite)) {
-        set_error(sdata, errno);
-        g_set_error(gerr, system_quark(), errno, "filecache_write: pwrite failed");
-        log_print(LOG_INFO, SECTION_FILECACHE_IO, "filecache_write: %ld::%d %lu %ld :: %s", bytes_written, sdata->fd, size, offset, strerror(errno));
-    } else {
-        sdata->modified = true;
-        log_print(LOG_INFO, SECTION_FILECACHE_IO, "filecache_write: wrote %d bytes on fd %d", bytes_written, sdata->fd);
-    }
+        put_range(path, fd, progress.offset, length, size, NULL, etag, res, response_code, gerr);
+        if (*gerr) return;
 
-    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: releasing shared file lock on fd %d", sdata->fd);
-    if (flock(sdata->fd, LOCK_UN) || inject_error(filecache_error_writeflock2)) {
-        g_set_error(gerr, system_quark(), errno, "filecache_write: error releasing shared file lock");
-        // Since we've already written (or not), just fall through and return bytes_written
-    }
-    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_write: released shared file lock on fd %d", sdata->fd);
+        // The server lost the earlier ranges, or never had them; start over once
+        if (*res == CURLE_OK && (*response_code == 409 || *response_code == 416) && progress.offset > 0 && !restarted) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "put_chunked: %s rejected range at %lld (%ld); restarting",
+                path, (long long) progress.offset, *response_code);
+            progress.offset = 0;
+            restarted = true;
+            continue;
+        }
+        if (*res != CURLE_OK || *response_code < 200 || *response_code >= 300) return;
 
-    return bytes_written;
-}
+        BUMP(filecache_upload_chunks);
+        progress.offset += length;
+        if (progress.offset < size) upload_progress_set(cache, path, &progress);
+    } while (progress.offset < size);
 
-// close the file
-void filecache_close(struct fuse_file_info *info, GError **gerr) {
-    struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+    upload_progress_delete(cache, path);
+}
 
-    BUMP(filecache_close);
+// The size of the server's copy of path, from a HEAD; -1 if it can't be had
+static off_t server_size(const char *path) {
+    CURL *session;
+    CURLcode res = CURLE_OK;
+    long response_code = 0;
+    long elapsed_time = 0;
+    off_t size = -1;
 
-    if (sdata == NULL || inject_error(filecache_error_closesdata)) {
-        g_set_error(gerr, filecache_quark(), E_FC_SDATANULL, "filecache_close: sdata is NULL");
-        return;
+    session = session_request_init(path, NULL, false);
+    if (!session) {
+        try_release_request_outstanding();
+        return -1;
+    }
+    curl_easy_setopt(session, CURLOPT_NOBODY, 1L);
+    timed_curl_easy_perform(session, &res, &response_code, &elapsed_time);
+    process_status("server_size", session, res, response_code, elapsed_time, 0, path, false);
+
+    if (res == CURLE_OK && response_code >= 200 && response_code < 300) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+        curl_off_t length = -1;
+        if (curl_easy_getinfo(session, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) == CURLE_OK) size = length;
+#else
+        double length = -1;
+        if (curl_easy_getinfo(session, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &length) == CURLE_OK) size = length;
+#endif
     }
+    return size;
+}
 
-    log_print(LOG_INFO, SECTION_FILECACHE_FILE, "filecache_close: fd (%d).", sdata->fd);
+// Send just what the session appended since the server had its content at
+// synced_size. There is no lock and no snapshot; if a write lands during the
+// upload, filecache_sync sees it and the next sync PUTs again. Returns false
+// if the file has to be PUT whole: before anything is sent, if the server
+// hasn't said it takes range PUTs, or after, if the server's copy doesn't come
+// out the size of ours, as when a server stores the tail as the whole file.
+static bool put_append(struct filecache_sdata *sdata, const char *path, char *etag) {
+    GError *tmpgerr = NULL;
+    CURLcode res = CURLE_OK;
+    long response_code = 0;
+    struct stat st;
+    off_t base = sdata->synced_size;
+    off_t stored;
 
-    if (sdata->fd <= 0 || inject_error(filecache_error_closefd))  {
-        g_set_error(gerr, system_quark(), EBADF, "filecache_close doesn't have legitimate file descriptor");
+    if (base <= 0 || sdata->base_etag[0] == '\0') return false;
+    if (fstat(sdata->fd, &st) || st.st_size <= base) return false;
+    // A server which ignored Content-Range would replace the file with its tail
+    if (!server_accepts_range_put()) return false;
+
+    put_range(path, sdata->fd, base, st.st_size - base, st.st_size, sdata->base_etag, etag, &res, &response_code, &tmpgerr);
+    if (tmpgerr) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "put_append: %s", tmpgerr->message);
+        g_clear_error(&tmpgerr);
+        return false;
     }
-    else {
-        if (close(sdata->fd) < 0 || inject_error(filecache_error_closeclose)) {
-            g_set_error(gerr, system_quark(), errno, "filecache_close: close failed on fd (%d)", sdata->fd);
-        }
-        else {
-            log_print(LOG_DEBUG, SECTION_FILECACHE_FILE, "filecache_close: closed fd (%d).", sdata->fd);
-        }
+    if (res != CURLE_OK || response_code < 200 || response_code >= 300) {
+        BUMP(filecache_put_append_refused);
+        log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "put_append: %s not appended (%ld: %s); sending it whole",
+            path, response_code, curl_easy_strerror(res));
+        return false;
     }
 
-    free(sdata);
+    // A 2xx alone doesn't say the tail went on the end
+    stored = server_size(path);
+    if (stored != st.st_size) {
+        BUMP(filecache_put_append_refused);
+        log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "put_append: server has %lld bytes of %s after append, not %lld; sending it whole",
+            (long long) stored, path, (long long) st.st_size);
+        range_put_support = 0;
+        return false;
+    }
 
-    return;
+    BUMP(filecache_put_append);
+    log_print(LOG_INFO, SECTION_FILECACHE_COMM, "put_append: sent %lld bytes of %s at %lld",
+        (long long) (st.st_size - base), path, (long long) base);
+    return true;
 }
 
 /* PUT's from fd to URI */
 /* Our modification to include etag support on put */
-static void put_return_etag(const char *path, int fd, char *etag, GError **gerr) {
+static void put_return_etag(filecache_t *cache, const char *path, fd_t fd, struct cache_lock *lock, char *etag, GError **gerr) {
     static const char *funcname = "put_return_etag";
+    GError *tmpgerr = NULL;
+    bool locked = false;
+    fd_t snapfd = -1;
+    struct upload_progress identity;
     struct stat st;
     struct timespec start_time;
     long response_code = 500; // seed it as bad so we can enter the loop
@@ -1027,11 +3841,35 @@ static void put_return_etag(const char *path, int fd, char *etag, GError **gerr)
     log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "enter: %s(,%s,%d,,)", funcname, path, fd);
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: acquiring exclusive file lock on fd %d", funcname, fd);
-    if (flock(fd, LOCK_EX) || inject_error(filecache_error_etagflock1)) {
-        g_set_error(gerr, system_quark(), errno, "%s: error acquiring exclusive file lock", funcname);
+    cache_lock_take(lock, true, &tmpgerr);
+    if (tmpgerr || inject_error(filecache_error_etagflock1)) {
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "%s: ", funcname);
+        } else {
+            cache_lock_drop(lock);
+            g_set_error(gerr, system_quark(), EIO, "%s: error acquiring exclusive file lock", funcname);
+        }
         return;
     }
     log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: acquired exclusive file lock on fd %d", funcname, fd);
+    locked = true;
+
+    // What a chunked upload of this content records its progress against;
+    // taken from the live file, since a snapshot is new every time
+    memset(&identity, 0, sizeof(struct upload_progress));
+    if (fstat(fd, &st) == 0) {
+        identity.size = st.st_size;
+        identity.mtime = st.st_mtim;
+    }
+
+    // Upload from a snapshot if we can, and let writers carry on
+    if (lock) snapfd = snapshot_cache_file(fd, lock->filename);
+    if (snapfd >= 0) {
+        cache_lock_drop(lock);
+        locked = false;
+        log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: PUT reads snapshot fd %d; released lock on fd %d", funcname, snapfd, fd);
+        fd = snapfd;
+    }
 
     assert(etag);
 
@@ -1042,58 +3880,23 @@ static void put_return_etag(const char *path, int fd, char *etag, GError **gerr)
 
     log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "%s: file size %d", funcname, st.st_size);
 
-    // If we're in saint mode, skip the PUT altogether
-    for (int idx = 0;
-         idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500);
-         idx++) {
-        long elapsed_time = 0;
-        CURL *session;
-        struct curl_slist *slist = NULL;
-        FILE *fp;
-
-        fp = fdopen(dup(fd), "r");
-        if (!fp) {
-            g_set_error(gerr, system_quark(), errno, "%s: NULL fp from fdopen on fd %d for path %s", funcname, fd, path);
-            goto finish;
-        }
-        if (fseek(fp, 0L, SEEK_SET) == (off_t)-1) {
-            g_set_error(gerr, system_quark(), errno, "%s: fseek error on path %s", funcname, path);
-            goto finish;
-        }
-
-        // REVIEW: We didn't use to check for sesssion == NULL, so now we 
-        // also call try_release_request_outstanding. Is this OK?
-        session = session_request_init(path, NULL, false);
-        if (!session || inject_error(filecache_error_freshsession)) {
-            g_set_error(gerr, curl_quark(), E_FC_CURLERR, "%s: Failed session_request_init on GET", funcname);
-            // TODO(kibra): Manually cleaning up this lock sucks. We should make sure this happens in a better way.
-            try_release_request_outstanding();
-            goto finish;
+    if (upload_chunk_size > 0 && st.st_size > upload_chunk_size && server_accepts_range_put()) {
+        put_chunked(cache, path, fd, &identity, st.st_size, etag, &res, &response_code, &tmpgerr);
+        // Said it took ranges, but doesn't; don't ask it to again
+        if (!tmpgerr && res == CURLE_OK && (response_code == 400 || response_code == 405 || response_code == 501)) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "%s: %s refused a range (%ld); sending it whole",
+                funcname, path, response_code);
+            range_put_support = 0;
+            upload_progress_delete(cache, path);
+            put_range(path, fd, 0, st.st_size, -1, NULL, etag, &res, &response_code, &tmpgerr);
         }
-
-        curl_easy_setopt(session, CURLOPT_CUSTOMREQUEST, "PUT");
-        curl_easy_setopt(session, CURLOPT_UPLOAD, 1L);
-        curl_easy_setopt(session, CURLOPT_INFILESIZE, st.st_size);
-        curl_easy_setopt(session, CURLOPT_READDATA, (void *) fp);
-
-        slist = enhanced_logging(slist, LOG_DYNAMIC, SECTION_FILECACHE_COMM, "put_return_tag: %s", path);
-        if (slist) curl_easy_setopt(session, CURLOPT_HTTPHEADER, slist);
-
-        // Set a header capture path.
-        etag[0] = '\0';
-        curl_easy_setopt(session, CURLOPT_HEADERFUNCTION, capture_etag);
-        curl_easy_setopt(session, CURLOPT_WRITEHEADER, etag);
-
-        timed_curl_easy_perform(session, &res, &response_code, &elapsed_time);
-
-        fclose(fp);
-
-        if (slist) curl_slist_free_all(slist);
-
-        bool non_retriable_error = process_status(funcname, session, res, response_code, elapsed_time, idx, path, false);
-        // Some errors should not be retried. (Non-errors will fail the
-        // for loop test and fall through naturally)
-        if (non_retriable_error) break;
+    }
+    else {
+        put_range(path, fd, 0, st.st_size, -1, NULL, etag, &res, &response_code, &tmpgerr);
+    }
+    if (tmpgerr) {
+        g_propagate_error(gerr, tmpgerr);
+        goto finish;
     }
 
     if ((res != CURLE_OK || response_code >= 500) || inject_error(filecache_error_etagcurl1)) {
@@ -1190,38 +3993,603 @@ static void put_return_etag(const char *path, int fd, char *etag, GError **gerr)
             stats_counter("small-puts", 1, samplerate);
             stats_timer("small-put-latency", elapsed_time);
         }
-        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: PUT on size %s (%lu) for %s -- Current:Average latency %lu :: %lu",
-            funcname, sz, st.st_size, path, elapsed_time, (latency / count));
+        log_print(LOG_DEBUG, SECTION_FILECACHE_OPEN, "%s: PUT on size %s (%lu) for %s -- Current:Average latency %lu :: %lu",
+            funcname, sz, st.st_size, path, elapsed_time, (latency / count));
+
+        if (st.st_size >= LG && elapsed_time > large_time_allotment) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "%s: large (%lu) PUT for %s exceeded time allotment %lu with %lu",
+                funcname, st.st_size, path, large_time_allotment, elapsed_time);
+            stats_counter("exceeded-time-large-PUT-count", 1, samplerate);
+            stats_timer("exceeded-time-large-PUT-latency", elapsed_time);
+        }
+        else if (st.st_size < LG && elapsed_time > small_time_allotment) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "%s: small (%lu) PUT for %s exceeded time allotment %lu with %lu",
+                funcname, st.st_size, path, small_time_allotment, elapsed_time);
+            stats_counter("exceeded-time-small-PUT-count", 1, samplerate);
+            stats_timer("exceeded-time-small-PUT-latency", elapsed_time);
+        }
+    }
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "PUT returns etag: %s", etag);
+
+finish:
+
+    if (locked) {
+        cache_lock_drop(lock);
+        log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: released exclusive file lock on fd %d", funcname, fd);
+    }
+    if (snapfd >= 0) close(snapfd);
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "exit: %s", funcname);
+
+    return;
+}
+
+static char *writeback_key(const char *path) {
+    char *key = NULL;
+
+    asprintf(&key, "%s%s", writeback_prefix, path);
+    return key;
+}
+
+// Returns true, and fills in *record, if path has an upload pending
+static bool writeback_record_get(filecache_t *cache, const char *path, struct writeback_record *record) {
+    leveldb_readoptions_t *options;
+    char *ldberr = NULL;
+    char *value;
+    size_t vallen;
+    char *key;
+
+    key = writeback_key(path);
+    options = leveldb_readoptions_create();
+    value = leveldb_get(cache, options, key, strlen(key) + 1, &vallen, &ldberr);
+    leveldb_readoptions_destroy(options);
+    free(key);
+
+    if (ldberr != NULL) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "writeback_record_get: leveldb_get error %s on %s", ldberr, path);
+        free(ldberr);
+        free(value);
+        return false;
+    }
+    if (value == NULL || vallen != sizeof(struct writeback_record)) {
+        free(value);
+        return false;
+    }
+    memcpy(record, value, sizeof(struct writeback_record));
+    free(value);
+    return true;
+}
+
+// Journal writes are synced; a close which returned must not lose its upload in a crash
+static void writeback_record_set(filecache_t *cache, const char *path, const struct writeback_record *record, GError **gerr) {
+    leveldb_writeoptions_t *options;
+    char *ldberr = NULL;
+    char *key;
+
+    key = writeback_key(path);
+    options = leveldb_writeoptions_create();
+    leveldb_writeoptions_set_sync(options, true);
+    leveldb_put(cache, options, key, strlen(key) + 1, (const char *) record, sizeof(struct writeback_record), &ldberr);
+    leveldb_writeoptions_destroy(options);
+    free(key);
+
+    if (ldberr != NULL || inject_error(filecache_error_setldb)) {
+        g_set_error(gerr, leveldb_quark(), E_FC_LDBERR, "writeback_record_set: leveldb_put error %s", ldberr ? ldberr : "inject-error");
+        free(ldberr);
+    }
+}
+
+// Caller holds writeback_mutex
+static void writeback_record_delete(filecache_t *cache, const char *path) {
+    struct writeback_record record;
+    leveldb_writeoptions_t *options;
+    char *ldberr = NULL;
+    char *key;
+
+    if (!writeback_record_get(cache, path, &record)) return;
+
+    key = writeback_key(path);
+    options = leveldb_writeoptions_create();
+    leveldb_delete(cache, options, key, strlen(key) + 1, &ldberr);
+    leveldb_writeoptions_destroy(options);
+    free(key);
+
+    if (ldberr != NULL) {
+        log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "writeback_record_delete: leveldb_delete error %s on %s", ldberr, path);
+        free(ldberr);
+        return;
+    }
+    DROP(filecache_writeback_depth);
+}
+
+// Queue path for the uploaders, unless it already is. Caller holds writeback_mutex
+static void writeback_push(const char *path, time_t not_before) {
+    struct writeback_item *item;
+
+    if (g_hash_table_lookup(writeback_queued, path)) return;
+
+    item = malloc(sizeof(struct writeback_item));
+    if (item == NULL) {
+        // The journal entry remains, so the upload happens after the next restart
+        log_print(LOG_ERR, SECTION_FILECACHE_COMM, "writeback_push: malloc failed; %s stays in the journal", path);
+        return;
+    }
+    item->path = strdup(path);
+    item->not_before = not_before;
+    g_hash_table_insert(writeback_queued, strdup(path), GINT_TO_POINTER(1));
+    g_queue_push_tail(writeback_queue, item);
+    pthread_cond_signal(&writeback_cond);
+}
+
+// Record a new local version of path which needs uploading, no sooner than delay seconds from now
+static void writeback_enqueue(filecache_t *cache, const char *path, bool created, int delay, GError **gerr) {
+    struct writeback_record record;
+    GError *tmpgerr = NULL;
+    bool pending;
+
+    pthread_mutex_lock(&writeback_mutex);
+    pending = writeback_record_get(cache, path, &record);
+    if (!pending) {
+        memset(&record, 0, sizeof(struct writeback_record));
+        record.created = created;
+    }
+    record.queued_at = time(NULL);
+    ++record.generation;
+    record.attempts = 0;
+    writeback_record_set(cache, path, &record, &tmpgerr);
+    if (tmpgerr) {
+        pthread_mutex_unlock(&writeback_mutex);
+        g_propagate_prefixed_error(gerr, tmpgerr, "writeback_enqueue: ");
+        return;
+    }
+    if (!pending) BUMP(filecache_writeback_depth);
+    BUMP(filecache_writeback_queued);
+    writeback_push(path, delay > 0 ? record.queued_at + delay : 0);
+    pthread_mutex_unlock(&writeback_mutex);
+
+    log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "writeback_enqueue: %s generation %lu", path, record.generation);
+}
+
+// Drop any pending upload of path, which is being deleted
+static void writeback_cancel(filecache_t *cache, const char *path) {
+    if (!writeback_running) return;
+    pthread_mutex_lock(&writeback_mutex);
+    writeback_record_delete(cache, path);
+    pthread_mutex_unlock(&writeback_mutex);
+}
+
+// Carry a pending upload of old_path over to new_path
+static void writeback_move(filecache_t *cache, const char *old_path, const char *new_path, GError **gerr) {
+    struct writeback_record record;
+    struct writeback_record existing;
+    GError *tmpgerr = NULL;
+
+    if (!writeback_running) return;
+    pthread_mutex_lock(&writeback_mutex);
+    if (!writeback_record_get(cache, old_path, &record)) goto finish;
+    // Nothing under a local-only name is uploaded
+    if (filecache_local_only(new_path)) {
+        writeback_record_delete(cache, old_path);
+        goto finish;
+    }
+    if (writeback_record_get(cache, new_path, &existing)) {
+        // Keep new_path's generations increasing, so an upload in flight for it can't clear this one
+        record.generation = MAX(record.generation, existing.generation) + 1;
+    }
+    else {
+        ++record.generation;
+        BUMP(filecache_writeback_depth);
+    }
+    record.attempts = 0;
+    // new_path may well have an older version on the server, which a later rename or unlink must see to
+    record.created = false;
+    writeback_record_set(cache, new_path, &record, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "writeback_move: ");
+        goto finish;
+    }
+    writeback_record_delete(cache, old_path);
+    writeback_push(new_path, 0);
+
+finish:
+    pthread_mutex_unlock(&writeback_mutex);
+}
+
+// Caller holds writeback_mutex
+static bool writeback_under_held_prefix(const char *path) {
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init(&iter, writeback_held_prefixes);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (strncmp(path, (const char *) key, strlen((const char *) key)) == 0) return true;
+    }
+    return false;
+}
+
+// Caller holds writeback_mutex
+static bool writeback_is_held(const char *path, const char *path2) {
+    return g_hash_table_lookup(writeback_held, path) || (path2 && g_hash_table_lookup(writeback_held, path2)) ||
+        writeback_under_held_prefix(path) || (path2 && writeback_under_held_prefix(path2));
+}
+
+// Caller holds writeback_mutex
+static void writeback_set_held(const char *path, const char *path2) {
+    g_hash_table_insert(writeback_held, strdup(path), GINT_TO_POINTER(1));
+    if (path2 && strcmp(path, path2)) g_hash_table_insert(writeback_held, strdup(path2), GINT_TO_POINTER(1));
+}
+
+// Keep uploads off path, and path2 if not NULL, until filecache_writeback_release.
+// Waits for any upload of either to finish. Both are taken at once, so two
+// renames in opposite directions can't deadlock.
+void filecache_writeback_hold(const char *path, const char *path2) {
+    if (!writeback_running) return;
+    pthread_mutex_lock(&writeback_mutex);
+    while (writeback_is_held(path, path2)) {
+        pthread_cond_wait(&writeback_held_cond, &writeback_mutex);
+    }
+    writeback_set_held(path, path2);
+    pthread_mutex_unlock(&writeback_mutex);
+}
+
+void filecache_writeback_release(const char *path, const char *path2) {
+    if (!writeback_running) return;
+    pthread_mutex_lock(&writeback_mutex);
+    g_hash_table_remove(writeback_held, path);
+    if (path2) g_hash_table_remove(writeback_held, path2);
+    pthread_cond_broadcast(&writeback_held_cond);
+    pthread_mutex_unlock(&writeback_mutex);
+}
+
+bool filecache_writeback_pending(filecache_t *cache, const char *path) {
+    struct writeback_record record;
+
+    if (!writeback_running) return false;
+    return writeback_record_get(cache, path, &record);
+}
+
+// Is path a new file whose first upload is still pending? Then the server
+// has nothing under its name, and a rename or unlink needn't go there.
+// Only meaningful while the caller holds path.
+bool filecache_writeback_unsent(filecache_t *cache, const char *path) {
+    struct writeback_record record;
+
+    if (!writeback_running) return false;
+    return writeback_record_get(cache, path, &record) && record.created;
+}
+
+// Upload path, which was renamed here from a local-only name and so has never
+// been on the server. With the journal running it is queued like any other
+// upload; otherwise it is PUT now.
+void filecache_publish(filecache_t *cache, const char *path, GError **gerr) {
+    struct filecache_pdata *pdata = NULL;
+    struct cache_lock *lock;
+    GError *tmpgerr = NULL;
+    fd_t fd = -1;
+
+    BUMP(filecache_publish);
+
+    pdata = filecache_pdata_get(cache, path, &tmpgerr);
+    if (tmpgerr == NULL && (pdata == NULL || PDATA_INLINE(pdata))) {
+        g_set_error(&tmpgerr, filecache_quark(), E_FC_PDATANULL, "no cache file for %s", path);
+    }
+    if (tmpgerr) goto finish;
+
+    fd = open(pdata->filename, O_RDONLY);
+    if (fd < 0) {
+        g_set_error(&tmpgerr, system_quark(), errno, "can't open %s", pdata->filename);
+        goto finish;
+    }
+
+    if (writeback_running) {
+        // The content has to be on disk before the journal promises to upload it
+        if (fdatasync(fd)) {
+            g_set_error(&tmpgerr, system_quark(), errno, "failed fdatasync on %s", pdata->filename);
+            goto finish;
+        }
+        // The server may have an older file of this name, so it isn't "created"
+        writeback_enqueue(cache, path, false, 0, &tmpgerr);
+        goto finish;
+    }
 
-        if (st.st_size >= LG && elapsed_time > large_time_allotment) {
-            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "%s: large (%lu) PUT for %s exceeded time allotment %lu with %lu",
-                funcname, st.st_size, path, large_time_allotment, elapsed_time);
-            stats_counter("exceeded-time-large-PUT-count", 1, samplerate);
-            stats_timer("exceeded-time-large-PUT-latency", elapsed_time);
+    log_print(LOG_INFO, SECTION_FILECACHE_COMM, "filecache_publish: PUT %s", path);
+    lock = cache_lock_acquire(pdata->filename);
+    put_return_etag(cache, path, fd, lock, pdata->etag, &tmpgerr);
+    cache_lock_unref(lock);
+    if (tmpgerr) goto finish;
+
+    pdata->last_server_update = time(NULL);
+    filecache_pdata_set(cache, path, pdata, &tmpgerr);
+
+finish:
+    if (tmpgerr) g_propagate_prefixed_error(gerr, tmpgerr, "filecache_publish: ");
+    if (fd >= 0) close(fd);
+    free(pdata);
+}
+
+// Caller holds writeback_mutex
+static bool writeback_prefix_busy(const char *prefix) {
+    size_t len = strlen(prefix);
+    GHashTableIter iter;
+    gpointer key;
+    bool busy = false;
+
+    for (GList *elem = writeback_queue->head; elem; elem = elem->next) {
+        struct writeback_item *item = elem->data;
+        if (strncmp(item->path, prefix, len) == 0) {
+            // Don't make a rename wait out a backoff
+            item->not_before = 0;
+            busy = true;
         }
-        else if (st.st_size < LG && elapsed_time > small_time_allotment) {
-            log_print(LOG_WARNING, SECTION_FILECACHE_OPEN, "%s: small (%lu) PUT for %s exceeded time allotment %lu with %lu",
-                funcname, st.st_size, path, small_time_allotment, elapsed_time);
-            stats_counter("exceeded-time-small-PUT-count", 1, samplerate);
-            stats_timer("exceeded-time-small-PUT-latency", elapsed_time);
+    }
+    g_hash_table_iter_init(&iter, writeback_held);
+    while (!busy && g_hash_table_iter_next(&iter, &key, NULL)) {
+        busy = (strncmp((const char *) key, prefix, len) == 0);
+    }
+    // Another rename of this directory, or of one above or below it
+    g_hash_table_iter_init(&iter, writeback_held_prefixes);
+    while (!busy && g_hash_table_iter_next(&iter, &key, NULL)) {
+        size_t keylen = strlen((const char *) key);
+        busy = (strncmp((const char *) key, prefix, keylen < len ? keylen : len) == 0);
+    }
+    return busy;
+}
+
+// Wait, up to timeout seconds, until nothing under the directory prefix has an
+// upload queued or running, then keep uploads off it until
+// filecache_writeback_release_prefix. A directory MOVE on the server would
+// otherwise race the uploads of files inside it, and an upload to an old path
+// after the MOVE would bring the old tree back. Returns false, holding
+// nothing, on timeout.
+bool filecache_writeback_hold_prefix(const char *prefix, int timeout) {
+    time_t deadline = time(NULL) + timeout;
+    bool drained;
+
+    if (!writeback_running) return true;
+    pthread_mutex_lock(&writeback_mutex);
+    pthread_cond_broadcast(&writeback_cond);
+    while (!(drained = !writeback_prefix_busy(prefix)) && time(NULL) < deadline) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += 1;
+        pthread_cond_timedwait(&writeback_held_cond, &writeback_mutex, &wake);
+    }
+    if (drained) g_hash_table_insert(writeback_held_prefixes, strdup(prefix), GINT_TO_POINTER(1));
+    pthread_mutex_unlock(&writeback_mutex);
+    return drained;
+}
+
+void filecache_writeback_release_prefix(const char *prefix) {
+    if (!writeback_running) return;
+    pthread_mutex_lock(&writeback_mutex);
+    g_hash_table_remove(writeback_held_prefixes, prefix);
+    pthread_cond_broadcast(&writeback_held_cond);
+    pthread_mutex_unlock(&writeback_mutex);
+}
+
+// The upload of path failed; retry with backoff, or give up
+static void writeback_failed(filecache_t *cache, const char *cache_path, const char *path,
+        struct writeback_record *record, off_t size, const GError *gerr) {
+    struct writeback_record current;
+    GError *tmpgerr = NULL;
+    bool overtaken;
+
+    pthread_mutex_lock(&writeback_mutex);
+    overtaken = !writeback_record_get(cache, path, &current) || current.generation != record->generation;
+    if (overtaken) {
+        // A newer version (or a delete) came along meanwhile; it is already queued
+        pthread_mutex_unlock(&writeback_mutex);
+        return;
+    }
+    if (++current.attempts < WRITEBACK_MAX_ATTEMPTS) {
+        int backoff = MIN(1 << current.attempts, WRITEBACK_MAX_BACKOFF);
+
+        BUMP(filecache_writeback_retries);
+        log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "writeback_failed: upload %u of %s failed, retrying in %ds: %s",
+            current.attempts, path, backoff, gerr->message);
+        writeback_record_set(cache, path, &current, &tmpgerr);
+        if (tmpgerr) {
+            log_print(LOG_WARNING, SECTION_FILECACHE_COMM, "writeback_failed: %s", tmpgerr->message);
+            g_clear_error(&tmpgerr);
         }
+        writeback_push(path, time(NULL) + backoff);
+        pthread_mutex_unlock(&writeback_mutex);
+        return;
     }
+    writeback_record_delete(cache, path);
+    pthread_mutex_unlock(&writeback_mutex);
 
-    log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "PUT returns etag: %s", etag);
+    BUMP(filecache_writeback_failed);
+    log_print(LOG_ERR, SECTION_FILECACHE_COMM, "writeback_failed: giving up on %s after %u attempts: %s",
+        path, current.attempts, gerr->message);
+
+    // Same as dav_release does for a failed PUT: keep the content in the
+    // forensic haven, and drop the path from the local caches
+    filecache_forensic_haven(cache_path, cache, path, size, &tmpgerr);
+    if (tmpgerr) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "writeback_failed: %s", tmpgerr->message);
+        g_clear_error(&tmpgerr);
+    }
+    filecache_delete(cache, path, true, &tmpgerr);
+    if (tmpgerr) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "writeback_failed: %s", tmpgerr->message);
+        g_clear_error(&tmpgerr);
+    }
+    stat_cache_delete(cache, path, &tmpgerr);
+    if (tmpgerr) {
+        log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "writeback_failed: %s", tmpgerr->message);
+        g_clear_error(&tmpgerr);
+    }
+}
+
+// PUT the current local copy of path. Caller has path held.
+static void writeback_upload(filecache_t *cache, const char *cache_path, const char *path) {
+    struct writeback_record record;
+    struct writeback_record current;
+    struct filecache_pdata *pdata = NULL;
+    struct cache_lock *lock;
+    GError *tmpgerr = NULL;
+    char etag[ETAG_MAX + 1];
+    struct stat st;
+    time_t lag;
+    fd_t fd = -1;
+
+    // Gone from the journal if the path was deleted, or renamed (then it is queued under its new name)
+    if (!writeback_record_get(cache, path, &record)) return;
+
+    pdata = filecache_pdata_get(cache, path, &tmpgerr);
+    if (tmpgerr == NULL && (pdata == NULL || PDATA_INLINE(pdata))) {
+        g_set_error(&tmpgerr, filecache_quark(), E_FC_PDATANULL, "writeback_upload: no cache file for %s", path);
+    }
+    if (tmpgerr) {
+        writeback_failed(cache, cache_path, path, &record, 0, tmpgerr);
+        goto finish;
+    }
+
+    fd = open(pdata->filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        g_set_error(&tmpgerr, system_quark(), errno, "writeback_upload: can't open %s", pdata->filename);
+        writeback_failed(cache, cache_path, path, &record, 0, tmpgerr);
+        goto finish;
+    }
+
+    log_print(LOG_INFO, SECTION_FILECACHE_COMM, "writeback_upload: PUT %s generation %lu", path, record.generation);
+    lock = cache_lock_acquire(pdata->filename);
+    put_return_etag(cache, path, fd, lock, etag, &tmpgerr);
+    cache_lock_unref(lock);
+    if (tmpgerr) {
+        writeback_failed(cache, cache_path, path, &record, st.st_size, tmpgerr);
+        goto finish;
+    }
+
+    pthread_mutex_lock(&writeback_mutex);
+    if (writeback_record_get(cache, path, &current) && current.generation == record.generation) {
+        writeback_record_delete(cache, path);
+        // The server now has what the local copy has
+        free(pdata);
+        pdata = filecache_pdata_get(cache, path, &tmpgerr);
+        if (pdata && pdata->last_server_update == 0) {
+            strncpy(pdata->etag, etag, ETAG_MAX);
+            pdata->etag[ETAG_MAX] = '\0';
+            pdata->last_server_update = time(NULL);
+            filecache_pdata_set(cache, path, pdata, &tmpgerr);
+        }
+    }
+    pthread_mutex_unlock(&writeback_mutex);
+    if (tmpgerr) {
+        // The upload itself succeeded; the next open just revalidates
+        log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "writeback_upload: %s", tmpgerr->message);
+    }
+
+    lag = time(NULL) - record.queued_at;
+    BUMP(filecache_writeback_uploaded);
+    TIMING(filecache_writeback_lag, lag);
+    stats_timer("writeback-lag", lag * 1000);
 
 finish:
+    if (fd >= 0) close(fd);
+    if (tmpgerr) g_clear_error(&tmpgerr);
+    free(pdata);
+}
+
+static void *writeback_worker(__unused void *ptr) {
+    log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "enter writeback_worker");
+
+    while (true) {
+        struct writeback_item *item = NULL;
+
+        pthread_mutex_lock(&writeback_mutex);
+        while (item == NULL) {
+            time_t now = time(NULL);
+            // Take the first item which is due, skipping paths a rename or unlink holds
+            for (GList *elem = writeback_queue->head; elem; elem = elem->next) {
+                struct writeback_item *candidate = elem->data;
+                if (candidate->not_before <= now && !writeback_is_held(candidate->path, NULL)) {
+                    item = candidate;
+                    g_queue_delete_link(writeback_queue, elem);
+                    break;
+                }
+            }
+            if (item == NULL) {
+                struct timespec wake;
+                clock_gettime(CLOCK_REALTIME, &wake);
+                wake.tv_sec += 1;
+                pthread_cond_timedwait(&writeback_cond, &writeback_mutex, &wake);
+            }
+        }
+        g_hash_table_remove(writeback_queued, item->path);
+        writeback_set_held(item->path, NULL);
+        stats_gauge("writeback-queue-depth", FETCH(filecache_writeback_depth));
+        pthread_mutex_unlock(&writeback_mutex);
+
+        writeback_upload(writeback_cache, writeback_cache_path, item->path);
 
-    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: releasing exclusive file lock on fd %d", funcname, fd);
-    if (flock(fd, LOCK_UN) || inject_error(filecache_error_etagflock2)) {
-        g_set_error(gerr, system_quark(), errno, "%s: error releasing exclusive file lock", funcname);
+        filecache_writeback_release(item->path, NULL);
+        free(item->path);
+        free(item);
     }
-    else {
-        log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "%s: released exclusive file lock on fd %d", funcname, fd);
+    return NULL;
+}
+
+// Start the upload journal: requeue whatever it still holds from before a
+// restart, and start the uploaders. With all_files, every close defers its
+// PUT to them (write-back mode); new files wait new_delay seconds first.
+void filecache_writeback_init(filecache_t *cache, const char *cache_path, int threads, bool all_files, int new_delay,
+        GError **gerr) {
+    leveldb_iterator_t *iter;
+    leveldb_readoptions_t *options;
+    size_t prefix_len = strlen(writeback_prefix);
+    int recovered = 0;
+    int started = 0;
+
+    writeback_cache = cache;
+    writeback_cache_path = strdup(cache_path);
+    writeback_queue = g_queue_new();
+    writeback_queued = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    writeback_held = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    writeback_held_prefixes = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+
+    options = leveldb_readoptions_create();
+    leveldb_readoptions_set_fill_cache(options, false);
+    iter = leveldb_create_iterator(cache, options);
+    pthread_mutex_lock(&writeback_mutex);
+    for (leveldb_iter_seek(iter, writeback_prefix, prefix_len); leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
+        size_t klen;
+        const char *key = leveldb_iter_key(iter, &klen);
+        char *path;
+
+        if (klen <= prefix_len || strncmp(key, writeback_prefix, prefix_len)) break;
+        // Keys are stored with their terminating null
+        path = strndup(key + prefix_len, klen - prefix_len);
+        writeback_push(path, 0);
+        BUMP(filecache_writeback_depth);
+        free(path);
+        ++recovered;
     }
+    pthread_mutex_unlock(&writeback_mutex);
+    leveldb_iter_destroy(iter);
+    leveldb_readoptions_destroy(options);
 
-    log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "exit: %s", funcname);
+    for (int idx = 0; idx < threads; idx++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, writeback_worker, NULL)) {
+            log_print(LOG_ERR, SECTION_FILECACHE_COMM, "filecache_writeback_init: failed to start uploader %d", idx);
+            continue;
+        }
+        pthread_detach(thread);
+        ++started;
+    }
+    if (started == 0) {
+        g_set_error(gerr, system_quark(), EAGAIN, "filecache_writeback_init: no uploader threads");
+        return;
+    }
 
-    return;
+    writeback_running = true;
+    writeback_enabled = all_files;
+    new_file_delay = new_delay;
+    log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_writeback_init: %s; new files wait %ds; %d uploaders; %d uploads recovered from the journal",
+        all_files ? "write-back mode" : "new files only", new_delay, started, recovered);
 }
 
 // top-level sync call
@@ -1230,6 +4598,11 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
     struct filecache_pdata *pdata = NULL;
     GError *tmpgerr = NULL;
     bool wrote_data = false;
+    unsigned long writes;
+    unsigned char digest[CONTENT_HASH_LEN];
+    bool have_digest;
+    bool is_new = false;
+    bool defer = false;
 
     BUMP(filecache_sync);
 
@@ -1268,6 +4641,25 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
         goto finish;
     }
 
+    // Whatever the sync sends or records, it may not be what the RAM tier holds
+    ram_tier_invalidate(path);
+
+    // A local-only path is synced to the file cache and nowhere else
+    if (do_put && filecache_local_only(path)) {
+        if (sdata->modified) BUMP(filecache_put_local_only);
+        log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "filecache_sync: %s is local-only; no PUT", path);
+        do_put = false;
+    }
+
+    // Once the open file's pdata marks the local copy as newest, a sync without
+    // a PUT has nothing to change, so don't touch leveldb on every write.
+    if (sdata->modified && !do_put && open_file_is_local(sdata->ofile)) {
+        BUMP(filecache_pdata_deferred);
+        log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "filecache_sync: pdata already local on %s", path);
+        wrote_data = true;
+        goto finish;
+    }
+
     // Write this data to the persistent cache
     // Update the file cache
     pdata = filecache_pdata_get(cache, path, &tmpgerr);
@@ -1284,7 +4676,13 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
     log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "filecache_sync(%s, fd=%d): cachefile=%s", path, sdata->fd, pdata->filename);
 
     if (sdata->modified) {
-        if (do_put) {
+        // In write-back mode the PUT is left to the uploaders, and so is the
+        // first upload of a new file if those are deferred; see writeback_enqueue below
+        if (do_put && writeback_running) {
+            is_new = sdata->created || filecache_writeback_unsent(cache, path);
+            defer = writeback_enabled || (is_new && new_file_delay > 0);
+        }
+        if (do_put && !defer) {
             log_print(LOG_DEBUG, SECTION_FILECACHE_COMM, "filecache_sync: Seeking fd=%d", sdata->fd);
             // If this lseek fails, file eventually goes to forensic haven.
             if ((lseek(sdata->fd, 0, SEEK_SET) == (off_t)-1) || inject_error(filecache_error_synclseek)) {
@@ -1296,15 +4694,28 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
 
             log_print(LOG_INFO, SECTION_FILECACHE_COMM, "About to PUT file (%s, fd=%d).", path, sdata->fd);
 
-            put_return_etag(path, sdata->fd, pdata->etag, &tmpgerr);
+            writes = __sync_fetch_and_or(&sdata->writes, 0);
+            have_digest = content_hash_compute(sdata->fd, digest);
+            if (have_digest && sdata->base_etag[0] != '\0' && content_hash_matches(cache, path, sdata->base_etag, digest)) {
+                // Written back with the bytes the server already has; keep its version
+                BUMP(filecache_put_unchanged);
+                log_print(LOG_INFO, SECTION_FILECACHE_COMM, "filecache_sync: %s unchanged from %s; skipping PUT", path, sdata->base_etag);
+                pipeline_end(sdata, NULL, NULL);
+                strncpy(pdata->etag, sdata->base_etag, ETAG_MAX + 1);
+                have_digest = false;
+            }
+            // If the writes were already streamed to the server, only the tail is left to wait for;
+            // if the session only appended, only what it appended is sent
+            else if (!pipeline_end(sdata, path, pdata->etag) && !put_append(sdata, path, pdata->etag)) {
+                put_return_etag(cache, path, sdata->fd, sdata->lock, pdata->etag, &tmpgerr);
+            }
 
             // if we fail PUT for any reason, file will eventually go to forensic haven.
             // We err in put_return_etag on:
-            // -- failure to get flock
+            // -- timeout waiting for the exclusive cache_lock
             // -- failure on fstat of fd
             // -- retry_curl_easy_perform not CURL_OK
             // -- curl response code not between 200 and 300
-            // -- failure to release flock
             if (tmpgerr) {
                 /* Outside of calls to fsync itself, we call filecache_sync and PUT the file twice,
                  * once on dav_flush, then closely after on dav_release. If we call set_error on the
@@ -1327,9 +4738,26 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
 
             log_print(LOG_INFO, SECTION_FILECACHE_COMM, "filecache_sync: PUT successful: %s : %s : old-timestamp: %lu: etag = %s", path, pdata->filename, pdata->last_server_update, pdata->etag);
 
-            // If the PUT succeeded, the file isn't locally modified.
-            sdata->modified = false;
-            pdata->last_server_update = time(NULL);
+            if (__sync_fetch_and_or(&sdata->writes, 0) != writes) {
+                // Writes landed while the PUT read its snapshot; the server already
+                // trails the local copy, and the next sync PUTs again
+                log_print(LOG_INFO, SECTION_FILECACHE_COMM, "filecache_sync: %s written during PUT; still modified", path);
+                strncpy(pdata->etag, "", 1);
+                pdata->last_server_update = 0;
+                sdata->synced_size = 0;
+            }
+            else {
+                struct stat st;
+
+                // If the PUT succeeded, the file isn't locally modified.
+                sdata->modified = false;
+                pdata->last_server_update = time(NULL);
+                if (have_digest) content_hash_set(cache, path, pdata->etag, digest);
+                strncpy(sdata->base_etag, pdata->etag, ETAG_MAX + 1);
+                // Further appends by this session only need to send what follows
+                sdata->synced_size = 0;
+                if (append_put && pdata->etag[0] != '\0' && fstat(sdata->fd, &st) == 0) sdata->synced_size = st.st_size;
+            }
         }
         else {
             // If we don't PUT the file, we don't have an etag, so zero it out
@@ -1351,6 +4779,31 @@ bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info
             g_propagate_prefixed_error(gerr, tmpgerr, "filecache_sync: ");
             goto finish;
         }
+
+        if (do_put && defer) {
+            // The content has to be on disk before the journal promises to upload it
+            int ret = fdatasync(sdata->fd);
+            // An injected failure leaves errno as it was
+            if (ret == 0 && inject_error(filecache_error_syncfdatasync)) {
+                ret = -1;
+                errno = EIO;
+            }
+            if (ret) {
+                set_error(sdata, errno);
+                log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_sync: error on fdatasync on %s", path);
+                g_set_error(gerr, system_quark(), errno, "filecache_sync: failed fdatasync");
+                goto finish;
+            }
+            writeback_enqueue(cache, path, is_new, is_new ? new_file_delay : 0, &tmpgerr);
+            if (tmpgerr) {
+                set_error(sdata, tmpgerr->code);
+                log_print(LOG_NOTICE, SECTION_FILECACHE_COMM, "filecache_sync: writeback_enqueue failed on %s", path);
+                g_propagate_prefixed_error(gerr, tmpgerr, "filecache_sync: ");
+                goto finish;
+            }
+            // Not yet on the server, but no longer this session's to PUT
+            sdata->modified = false;
+        }
     }
     log_print(LOG_INFO, SECTION_FILECACHE_COMM, "filecache_sync: Updated stat cache %d:%s:%s:%lu", sdata->fd, path, pdata->filename, pdata->last_server_update);
 
@@ -1366,6 +4819,7 @@ finish:
 // top-level truncate call
 void filecache_truncate(struct fuse_file_info *info, off_t s, GError **gerr) {
     struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+    GError *tmpgerr = NULL;
 
     BUMP(filecache_truncate);
 
@@ -1376,30 +4830,39 @@ void filecache_truncate(struct fuse_file_info *info, off_t s, GError **gerr) {
 
     log_print(LOG_INFO, SECTION_FILECACHE_FILE, "filecache_truncate(%d)", sdata->fd);
 
-    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_truncate: acquiring shared file lock on fd %d", sdata->fd);
-    if (flock(sdata->fd, LOCK_SH) || inject_error(filecache_error_truncflock1)) {
-        g_set_error(gerr, system_quark(), errno, "filecache_truncate: error acquiring shared file lock");
+    cache_lock_take(sdata->lock, false, &tmpgerr);
+    if (tmpgerr || inject_error(filecache_error_truncflock1)) {
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "filecache_truncate: ");
+        } else {
+            cache_lock_drop(sdata->lock);
+            g_set_error(gerr, system_quark(), EIO, "filecache_truncate: error acquiring shared file lock");
+        }
         return;
     }
-    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_truncate: acquired shared file lock on fd %d", sdata->fd);
 
     if ((ftruncate(sdata->fd, s) < 0) || inject_error(filecache_error_truncftrunc)) {
         g_set_error(gerr, system_quark(), errno, "filecache_truncate: ftruncate failed");
         // fall through to release lock ...
     }
-
-    log_print(LOG_DEBUG, SECTION_FILECACHE_FLOCK, "filecache_truncate: releasing shared file lock on fd %d", sdata->fd);
-    if (flock(sdata->fd, LOCK_UN) || inject_error(filecache_error_truncflock2)) {
-        if (!gerr) {
-            g_set_error(gerr, system_quark(), errno, "filecache_truncate: error releasing shared file lock");
-        }
-        else {
-            log_print(LOG_CRIT, SECTION_FILECACHE_FILE, "filecache_truncate: error releasing shared file lock :: %s", g_strerror(errno));
+    else {
+        __sync_fetch_and_add(&sdata->writes, 1);
+        sdata->size = s;
+        sdata->size_known = true;
+        open_file_set_size(sdata->ofile, s, false);
+        ram_tier_session_dirty(sdata);
+        if (s < sdata->synced_size) sdata->synced_size = 0;
+        // Truncating an empty file before writing it is fine; anything else can't be streamed
+        if (pipelined_put) {
+            pthread_mutex_lock(&pipeline_mutex);
+            if (s != 0 || sdata->append_offset != 0) pipeline_abandon(sdata);
+            pthread_mutex_unlock(&pipeline_mutex);
         }
-        return;
     }
 
-    // If we got an error on ftruncate, we fell through to flock. If we didn't get an error there, we need
+    cache_lock_drop(sdata->lock);
+
+    // If we got an error on ftruncate, we fell through to release the lock. We need
     // to return before setting sdata modified.
     if (gerr) return;
 
@@ -1410,6 +4873,50 @@ void filecache_truncate(struct fuse_file_info *info, off_t s, GError **gerr) {
     return;
 }
 
+// Size of the file open on an inline session, or -1 if it has a descriptor instead
+off_t filecache_inline_size(struct fuse_file_info *info) {
+    struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+
+    if (sdata == NULL || !sdata->is_inline) return -1;
+    return sdata->isize;
+}
+
+// Size the session's writes have left the file at, or -1 if it hasn't written
+off_t filecache_size(struct fuse_file_info *info) {
+    struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+
+    if (sdata == NULL || !sdata->size_known) return -1;
+    return sdata->size;
+}
+
+// Writes leave the stat cache behind; returns true, once every interval
+// seconds, when a writer should bring it up to date
+bool filecache_stat_due(struct fuse_file_info *info, int interval) {
+    struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
+    time_t now = time(NULL);
+
+    if (sdata == NULL || now - sdata->stat_flushed < interval) return false;
+    sdata->stat_flushed = now;
+    return true;
+}
+
+// Size of path as left by a write still open on this mount, if any
+bool filecache_open_size(const char *path, off_t *size) {
+    struct open_file *entry;
+    off_t written = 0;
+
+    pthread_mutex_lock(&open_files_mutex);
+    entry = open_file_lookup(path);
+    if (entry && entry->refcount > 0) {
+        written = __sync_fetch_and_or(&entry->written_size, 0);
+    }
+    pthread_mutex_unlock(&open_files_mutex);
+
+    if (written == 0) return false;
+    *size = written - 1;
+    return true;
+}
+
 int filecache_fd(struct fuse_file_info *info) {
     struct filecache_sdata *sdata = (struct filecache_sdata *)info->fh;
 
@@ -1429,6 +4936,7 @@ void filecache_set_error(struct fuse_file_info *info, int error_code) {
 // deletes entry from ldb cache
 void filecache_delete(filecache_t *cache, const char *path, bool unlink_cachefile, GError **gerr) {
     struct filecache_pdata *pdata;
+    struct open_file *entry;
     leveldb_writeoptions_t *options;
     GError *tmpgerr = NULL;
     char *key;
@@ -1438,6 +4946,13 @@ void filecache_delete(filecache_t *cache, const char *path, bool unlink_cachefil
 
     log_print(LOG_INFO, SECTION_FILECACHE_CACHE, "filecache_delete: path (%s).", path);
 
+    ram_tier_invalidate(path);
+
+    // There is nothing left to upload
+    writeback_cancel(cache, path);
+    upload_progress_delete(cache, path);
+    content_hash_delete(cache, path);
+
     pdata = filecache_pdata_get(cache, path, &tmpgerr);
     if (tmpgerr) {
         g_propagate_prefixed_error(gerr, tmpgerr, "filecache_delete: ");
@@ -1446,6 +4961,13 @@ void filecache_delete(filecache_t *cache, const char *path, bool unlink_cachefil
 
     if (!pdata) return;
 
+    // Sessions which still have the old file open keep their copy, but
+    // nobody else should find it under this path any more
+    pthread_mutex_lock(&open_files_mutex);
+    entry = open_file_lookup(path);
+    if (entry) open_file_detach(entry);
+    pthread_mutex_unlock(&open_files_mutex);
+
     key = path2key(path);
 
     options = leveldb_writeoptions_create();
@@ -1453,11 +4975,9 @@ void filecache_delete(filecache_t *cache, const char *path, bool unlink_cachefil
     leveldb_writeoptions_destroy(options);
     free(key);
 
-    if (unlink_cachefile && pdata) {
+    if (unlink_cachefile && pdata && !PDATA_INLINE(pdata)) {
         log_print(LOG_DEBUG, SECTION_FILECACHE_CACHE, "filecache_delete: unlinking %s", pdata->filename);
-        if (unlink(pdata->filename)) {
-            log_print(LOG_WARNING, SECTION_FILECACHE_CACHE, "filecache_delete: error unlinking %s", pdata->filename);
-        }
+        cacheio_unlink(pdata->filename);
     }
 
     if (ldberr != NULL || inject_error(filecache_error_deleteldb)) {
@@ -1470,17 +4990,22 @@ void filecache_delete(filecache_t *cache, const char *path, bool unlink_cachefil
     return;
 }
 
+// True for the two-hex-digit names cache_file_shard hands out
+static bool is_shard_name(const char *name) {
+    return strlen(name) == 2 && isxdigit((unsigned char)name[0]) && isxdigit((unsigned char)name[1]);
+}
+
 static int clear_files(const char *filecache_path, time_t stamped_time, GError **gerr) {
     const char *fname = "clear_files";
     struct dirent *diriter;
     DIR *dir;
     char cachefile_path[PATH_MAX + 1]; // path to file in the cache
+    GPtrArray *doomed; // paths to unlink, all in one batch at the end
+    int *errors;
     int ret = 0;
     int visited = 0;
     int unlinked = 0;
 
-    BUMP(filecache_orphans);
-
     cachefile_path[PATH_MAX] = '\0';
 
     dir = opendir(filecache_path);
@@ -1489,6 +5014,7 @@ static int clear_files(const char *filecache_path, time_t stamped_time, GError *
         return -1;
     }
 
+    doomed = g_ptr_array_new();
     while ((diriter = readdir(dir)) != NULL) {
         struct stat stbuf;
         snprintf(cachefile_path, PATH_MAX , "%s/%s", filecache_path, diriter->d_name) ;
@@ -1505,6 +5031,10 @@ static int clear_files(const char *filecache_path, time_t stamped_time, GError *
             if ((strcmp(diriter->d_name, ".") == 0) || (strcmp(diriter->d_name, "..") == 0)) {
                 log_print(LOG_DEBUG, SECTION_FILECACHE_CLEAN, "%s: found . or .. directory: %s", fname, cachefile_path);
             }
+            else if (is_shard_name(diriter->d_name)) {
+                // Shards are walked separately by clear_shards
+                log_print(LOG_DEBUG, SECTION_FILECACHE_CLEAN, "%s: skipping shard directory: %s", fname, cachefile_path);
+            }
             else {
                 log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "%s: unexpected directory in filecache: %s", fname, cachefile_path);
                 --ret;
@@ -1517,13 +5047,7 @@ static int clear_files(const char *filecache_path, time_t stamped_time, GError *
         else {
             ++visited;
             if (stbuf.st_mtime < stamped_time) {
-                if (unlink(cachefile_path)) {
-                    log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "%s: failed to unlink %s: %d %s", 
-                            fname, cachefile_path, errno, strerror(errno));
-                    --ret;
-                }
-                log_print(LOG_INFO, SECTION_FILECACHE_CLEAN, "%s: unlinked %s", fname, cachefile_path);
-                ++unlinked;
+                g_ptr_array_add(doomed, strdup(cachefile_path));
             }
             else {
                 log_print(LOG_INFO, SECTION_FILECACHE_CLEAN, "%s: didn't unlink %s: %d %d", 
@@ -1532,6 +5056,23 @@ static int clear_files(const char *filecache_path, time_t stamped_time, GError *
         }
     }
     closedir(dir);
+
+    errors = calloc(doomed->len ? doomed->len : 1, sizeof(int));
+    if (errors) cacheio_unlink_batch((char **) doomed->pdata, doomed->len, errors);
+    for (unsigned idx = 0; idx < doomed->len; idx++) {
+        char *path = g_ptr_array_index(doomed, idx);
+        if (errors == NULL || errors[idx]) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "%s: failed to unlink %s: %d %s",
+                    fname, path, errors ? errors[idx] : ENOMEM, strerror(errors ? errors[idx] : ENOMEM));
+            --ret;
+        }
+        log_print(LOG_INFO, SECTION_FILECACHE_CLEAN, "%s: unlinked %s", fname, path);
+        ++unlinked;
+        free(path);
+    }
+    free(errors);
+    g_ptr_array_free(doomed, true);
+
     log_print(LOG_INFO, SECTION_FILECACHE_CLEAN, "%s: visited %d files, unlinked %d, and had %d issues", 
             fname, visited, unlinked, ret);
 
@@ -1539,6 +5080,99 @@ static int clear_files(const char *filecache_path, time_t stamped_time, GError *
     return visited - unlinked;
 }
 
+struct clear_shards_ctx {
+    const char *files_path;
+    time_t stamped_time;
+    unsigned next_shard;
+    pthread_mutex_t lock;
+    int files_left;
+    GError *gerr;
+};
+
+// Claims top-level shards one at a time and clears every leaf shard under each
+static void *clear_shards_worker(void *ptr) {
+    struct clear_shards_ctx *ctx = (struct clear_shards_ctx *)ptr;
+    char path[PATH_MAX];
+    unsigned idx;
+
+    while ((idx = __sync_fetch_and_add(&ctx->next_shard, 1)) < FILES_SHARD_FANOUT) {
+        struct dirent *diriter;
+        DIR *dir;
+
+        snprintf(path, PATH_MAX, "%s/%02x", ctx->files_path, idx);
+        dir = opendir(path);
+        // Shards are created lazily, so most caches won't have them all
+        if (dir == NULL) continue;
+
+        while ((diriter = readdir(dir)) != NULL) {
+            char leaf[PATH_MAX];
+            GError *tmpgerr = NULL;
+            int left;
+
+            if (!is_shard_name(diriter->d_name)) continue;
+            snprintf(leaf, PATH_MAX, "%s/%s", path, diriter->d_name);
+            left = clear_files(leaf, ctx->stamped_time, &tmpgerr);
+            pthread_mutex_lock(&ctx->lock);
+            if (tmpgerr) {
+                // Keep the first error; the rest only get logged
+                log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "clear_shards_worker: %s", tmpgerr->message);
+                if (ctx->gerr == NULL) ctx->gerr = tmpgerr;
+                else g_clear_error(&tmpgerr);
+            }
+            else {
+                ctx->files_left += left;
+            }
+            pthread_mutex_unlock(&ctx->lock);
+        }
+        closedir(dir);
+    }
+    return NULL;
+}
+
+// clear_files over the whole sharded files directory, including any files still
+// sitting at the top level from the old flat layout. Returns the number of files left.
+static int clear_shards(const char *files_path, time_t stamped_time, GError **gerr) {
+    struct clear_shards_ctx ctx;
+    pthread_t workers[CLEANUP_WORKERS];
+    int started = 0;
+    GError *tmpgerr = NULL;
+    int left;
+
+    BUMP(filecache_orphans);
+
+    left = clear_files(files_path, stamped_time, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "clear_shards: ");
+        return -1;
+    }
+
+    ctx.files_path = files_path;
+    ctx.stamped_time = stamped_time;
+    ctx.next_shard = 0;
+    pthread_mutex_init(&ctx.lock, NULL);
+    ctx.files_left = left;
+    ctx.gerr = NULL;
+
+    // The calling thread works too, so a failed pthread_create only costs parallelism
+    for (int idx = 0; idx < CLEANUP_WORKERS - 1; idx++) {
+        if (pthread_create(&workers[started], NULL, clear_shards_worker, &ctx)) {
+            log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "clear_shards: failed to start worker %d", idx);
+            break;
+        }
+        ++started;
+    }
+    clear_shards_worker(&ctx);
+    for (int idx = 0; idx < started; idx++) {
+        pthread_join(workers[idx], NULL);
+    }
+    pthread_mutex_destroy(&ctx.lock);
+
+    if (ctx.gerr) {
+        g_propagate_prefixed_error(gerr, ctx.gerr, "clear_shards: ");
+    }
+    return ctx.files_left;
+}
+
 void filecache_forensic_haven(const char *cache_path, filecache_t *cache, const char *path, off_t fsize, GError **gerr) {
     const char *fname = "filecache_forensic_haven";
     struct filecache_pdata *pdata = NULL;
@@ -1622,6 +5256,7 @@ finish:
     asprintf(&newpath, "%s/%s/", cache_path, forensic_haven_dir);
     // Clear out all files older than a day
     while (files_left >= files_kept && hours > 0) {
+        BUMP(filecache_orphans);
         files_left = clear_files(newpath, time(NULL) - (hours * 60 * 60), &subgerr);
         if (subgerr) {
             log_print(LOG_ERR, SECTION_FILECACHE_FILE, 
@@ -1645,6 +5280,9 @@ void filecache_pdata_move(filecache_t *cache, const char *old_path, const char *
 
     BUMP(filecache_pdata_move);
 
+    ram_tier_invalidate(old_path);
+    ram_tier_invalidate(new_path);
+
     pdata = filecache_pdata_get(cache, old_path, &tmpgerr);
     if (tmpgerr) {
         g_propagate_prefixed_error(gerr, tmpgerr, "filecache_pdata_move: ");
@@ -1658,12 +5296,42 @@ void filecache_pdata_move(filecache_t *cache, const char *old_path, const char *
 
     log_print(LOG_INFO, SECTION_FILECACHE_FILE, "filecache_pdata_move: Update last_server_update on %s: timestamp: %lu", pdata->filename, pdata->last_server_update);
 
-    filecache_pdata_set(cache, new_path, pdata, &tmpgerr);
+    if (PDATA_INLINE(pdata)) {
+        // The content moves with the pdata
+        struct filecache_pdata stored;
+        size_t len = 0;
+        char *data;
+
+        pthread_mutex_lock(&inline_mutex);
+        data = filecache_inline_get(cache, old_path, &stored, &len, &tmpgerr);
+        if (data) {
+            filecache_value_set(cache, new_path, &stored, data, len, &tmpgerr);
+        }
+        else if (!tmpgerr) {
+            filecache_pdata_set(cache, new_path, &stored, &tmpgerr);
+        }
+        pthread_mutex_unlock(&inline_mutex);
+        free(data);
+    }
+    else {
+        filecache_pdata_set(cache, new_path, pdata, &tmpgerr);
+    }
     if (tmpgerr) {
         g_propagate_prefixed_error(gerr, tmpgerr, "filecache_pdata_move: Moving entry from path %s to %s failed: ", old_path, new_path);
         goto finish;
     }
 
+    // Sessions which have old_path open follow it to new_path
+    open_file_move(old_path, new_path);
+    // Whatever was known about the server's copy at new_path no longer applies
+    content_hash_delete(cache, new_path);
+
+    writeback_move(cache, old_path, new_path, &tmpgerr);
+    if (tmpgerr) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "filecache_pdata_move: ");
+        goto finish;
+    }
+
     // We don't want to unlink the cachefile for 'old' since we use it for 'new'
     filecache_delete(cache, old_path, false, &tmpgerr);
     if (tmpgerr) {
@@ -1694,10 +5362,112 @@ static const char *key2path(const char *key) {
     return NULL;
 }
 
+// True if the top level of the files directory still holds cache files from the flat layout
+static bool has_flat_files(const char *files_path) {
+    struct dirent *diriter;
+    DIR *dir;
+    bool found = false;
+
+    dir = opendir(files_path);
+    if (dir == NULL) return false;
+    while (!found && (diriter = readdir(dir)) != NULL) {
+        found = (strncmp(diriter->d_name, "fusedav-cache-", strlen("fusedav-cache-")) == 0);
+    }
+    closedir(dir);
+    return found;
+}
+
+/* Caches created before files were sharded keep every cache file directly in files/.
+ * Move the ones the filecache still references into their shards; the first
+ * filecache_cleanup unlinks whatever is left at the top level. Must run before
+ * the filesystem starts serving, since it rewrites pdata behind any open sessions.
+ */
+void filecache_migrate_layout(filecache_t *cache, const char *cache_path, GError **gerr) {
+    leveldb_iterator_t *iter = NULL;
+    leveldb_readoptions_t *options;
+    char files_path[PATH_MAX];
+    size_t files_path_len;
+    size_t klen;
+    int migrated = 0;
+    int failed = 0;
+
+    snprintf(files_path, PATH_MAX, "%s/files/", cache_path);
+    files_path_len = strlen(files_path);
+    if (!has_flat_files(files_path)) return;
+
+    log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "filecache_migrate_layout: moving cache files in %s into shards", files_path);
+
+    options = leveldb_readoptions_create();
+    leveldb_readoptions_set_fill_cache(options, false);
+    iter = leveldb_create_iterator(cache, options);
+    leveldb_iter_seek(iter, filecache_prefix, strlen(filecache_prefix));
+
+    for (; leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
+        struct filecache_pdata pdata;
+        const char *value;
+        const char *bname;
+        const char *path;
+        char *key;
+        char shard[8];
+        char oldname[PATH_MAX];
+        GError *tmpgerr = NULL;
+
+        // The iterator's key is only valid until the next call on it, and pdata_set needs the path
+        key = strndup(leveldb_iter_key(iter, &klen), klen);
+        path = key2path(key);
+        if (path == NULL) {
+            free(key);
+            break;
+        }
+        value = leveldb_iter_value(iter, &klen);
+        if (value == NULL || klen != sizeof(pdata)) {
+            free(key);
+            continue;
+        }
+        memcpy(&pdata, value, sizeof(pdata));
+
+        // Only files directly under files/ need to move
+        bname = pdata.filename + files_path_len;
+        if (strncmp(pdata.filename, files_path, files_path_len) != 0 || strchr(bname, '/') != NULL) {
+            free(key);
+            continue;
+        }
+
+        strncpy(oldname, pdata.filename, PATH_MAX);
+        cache_file_shard(bname, shard, sizeof(shard));
+        snprintf(pdata.filename, PATH_MAX, "%s%s/%s", files_path, shard, oldname + files_path_len);
+        if (make_shard_dir(cache_path, shard) == 0 && rename(oldname, pdata.filename) == 0) {
+            filecache_pdata_set(cache, path, &pdata, &tmpgerr);
+            if (!tmpgerr) {
+                ++migrated;
+                free(key);
+                continue;
+            }
+            // Put the file back so the old entry still points at it
+            log_print(LOG_WARNING, SECTION_FILECACHE_CLEAN, "filecache_migrate_layout: %s", tmpgerr->message);
+            g_clear_error(&tmpgerr);
+            rename(pdata.filename, oldname);
+        }
+        // A file which fails to move stays where it is; its pdata still points at it
+        log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "filecache_migrate_layout: failed to move %s for %s", oldname, path);
+        ++failed;
+        free(key);
+    }
+
+    leveldb_iter_destroy(iter);
+    leveldb_readoptions_destroy(options);
+
+    log_print(LOG_NOTICE, SECTION_FILECACHE_CLEAN, "filecache_migrate_layout: moved %d cache files into shards, %d failed", migrated, failed);
+    if (failed > 0) {
+        g_set_error(gerr, filecache_quark(), EIO, "filecache_migrate_layout: %d cache files could not be moved", failed);
+    }
+}
+
 void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, GError **gerr) {
     leveldb_iterator_t *iter = NULL;
     leveldb_readoptions_t *options;
     GError *tmpgerr = NULL;
+    struct writeback_record record;
 
     char *newpath = NULL;
     size_t klen;
@@ -1740,7 +5510,8 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
             strncpy(fname, pdata->filename, PATH_MAX);
 
             // If the cache file doesn't exist, delete the entry from the level_db cache
-            ret = access(fname, F_OK);
+            // Inline files have no cache file
+            ret = PDATA_INLINE(pdata) ? 0 : access(fname, F_OK);
             if (ret) {
                 filecache_delete(cache, path, true, &tmpgerr);
                 if (tmpgerr) {
@@ -1752,7 +5523,10 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
                     ++pruned_files;
                 }
             }
-            else if ((first && pdata->last_server_update == 0) ||
+            // A local copy still waiting in the write-back journal is the only copy there is,
+            // as is that of a local-only file
+            else if ((first && pdata->last_server_update == 0 && !writeback_record_get(cache, path, &record) &&
+                        !filecache_local_only(path)) ||
                      ((pdata->last_server_update != 0) && (starttime - pdata->last_server_update > AGE_OUT_THRESHOLD))) {
                 log_print(LOG_DEBUG, SECTION_FILECACHE_CLEAN, "filecache_cleanup: Unlinking %s", fname);
                 filecache_delete(cache, path, true, &tmpgerr);
@@ -1767,7 +5541,7 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
                     ++unlinked_files;
                 }
             }
-            else {
+            else if (!PDATA_INLINE(pdata)) {
                 // put a timestamp on the file
                 ret = utime(fname, NULL);
                 if (ret) {
@@ -1788,7 +5562,7 @@ void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, G
     // possible race where we are updating a file inside the window where we are starting the cache cleanup
     // Ignore return value, which is files still left in the directory
     asprintf(&newpath, "%s/files", cache_path);
-    clear_files(newpath, (starttime - 1), &tmpgerr);
+    clear_shards(newpath, (starttime - 1), &tmpgerr);
     free(newpath);
     if (tmpgerr) {
         g_propagate_prefixed_error(gerr, tmpgerr, "filecache_cleanup: ");
@@ -41,7 +41,8 @@
 typedef leveldb_t filecache_t;
 
 void filecache_print_stats(void);
-void filecache_init(char *cache_path, GError **gerr);
+void filecache_init(char *cache_path, int inline_size, int upload_chunk_mb, bool pipeline_puts, bool append_puts,
+        GError **gerr);
 void filecache_delete(filecache_t *cache, const char *path, bool unlink, GError **gerr);
 void filecache_open(char *cache_path, filecache_t *cache, const char *path, struct fuse_file_info *info, bool grace, GError **gerr);
 ssize_t filecache_read(struct fuse_file_info *info, char *buf, size_t size, off_t offset, GError **gerr);
@@ -50,10 +51,32 @@ void filecache_close(struct fuse_file_info *info, GError **gerr);
 bool filecache_sync(filecache_t *cache, const char *path, struct fuse_file_info *info, bool do_put, GError **gerr);
 void filecache_truncate(struct fuse_file_info *info, off_t s, GError **gerr);
 int filecache_fd(struct fuse_file_info *info);
+off_t filecache_inline_size(struct fuse_file_info *info);
+off_t filecache_size(struct fuse_file_info *info);
+bool filecache_stat_due(struct fuse_file_info *info, int interval);
+bool filecache_open_size(const char *path, off_t *size);
 void filecache_set_error(struct fuse_file_info *info, int error_code);
 void filecache_forensic_haven(const char *cache_path, filecache_t *cache, const char *path, off_t fsize, GError **gerr);
 void filecache_pdata_move(filecache_t *cache, const char *old_path, const char *new_path, GError **gerr);
+void filecache_parallel_get_init(int size_mb, int streams);
+void filecache_fadvise_init(bool enable, int stream_mb, bool direct);
+void filecache_ram_tier_init(int capacity_mb, int file_kb);
+size_t filecache_ram_tier_used(unsigned *files);
+void filecache_local_only_init(const char *patterns);
+bool filecache_local_only(const char *path);
+bool filecache_prefetch(filecache_t *cache, const char *cache_path, const char *path, GError **gerr);
+void filecache_stale_init(filecache_t *cache, const char *cache_path, const char *patterns);
+void filecache_publish(filecache_t *cache, const char *path, GError **gerr);
 void filecache_cleanup(filecache_t *cache, const char *cache_path, bool first, GError **gerr);
+void filecache_migrate_layout(filecache_t *cache, const char *cache_path, GError **gerr);
+void filecache_writeback_init(filecache_t *cache, const char *cache_path, int threads, bool all_files, int new_delay,
+        GError **gerr);
+bool filecache_writeback_pending(filecache_t *cache, const char *path);
+bool filecache_writeback_unsent(filecache_t *cache, const char *path);
+void filecache_writeback_hold(const char *path, const char *path2);
+void filecache_writeback_release(const char *path, const char *path2);
+bool filecache_writeback_hold_prefix(const char *prefix, int timeout);
+void filecache_writeback_release_prefix(const char *prefix);
 struct curl_slist* enhanced_logging(struct curl_slist *slist, int log_level, int section, const char *format, ...);
 
 #endif
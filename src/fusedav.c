@@ -45,6 +45,9 @@
 #include "fusedav-statsd.h"
 #include "signal_handling.h"
 #include "stats.h"
+#include "prefetch.h"
+#include "warm.h"
+#include "cacheio.h"
 
 mode_t mask = 0;
 struct fuse* fuse = NULL;
@@ -54,6 +57,12 @@ struct fuse* fuse = NULL;
 // Run cache cleanup once a day.
 #define CACHE_CLEANUP_INTERVAL 86400
 
+// How often a writer brings the stat cache up to date between flushes
+#define STAT_FLUSH_INTERVAL 5 // seconds
+
+// How long a directory rename waits for uploads of the files in it
+#define WRITEBACK_DRAIN_TIMEOUT 30 // seconds
+
 // 'Soft" limit for core dump to ensure we get them
 #define NEW_RLIM_CUR (512 * 1024*1024)
 
@@ -177,19 +186,33 @@ static void fill_stat_generic(struct stat *st, mode_t mode, bool is_dir, int fd,
     log_print(LOG_DEBUG, SECTION_FUSEDAV_STAT, "Done with fill_stat_generic: fd = %d : size = %d", fd, st->st_size);
 }
 
-static void getdir_propfind_callback(__unused void *userdata, const char *path, struct stat st,
-    unsigned long status_code, GError **gerr) {
+// userdata is the config; prefetchers have no fuse context to take it from
+static void getdir_propfind_callback(void *userdata, const char *path, struct stat st,
+    const char *etag, unsigned long status_code, GError **gerr) {
 
     static const char *funcname = "getdir_propfind_callback";
-    struct fusedav_config *config = fuse_get_context()->private_data;
+    struct fusedav_config *config = userdata;
     struct stat_cache_value *existing = NULL;
     struct stat_cache_value value;
     GError *subgerr1 = NULL ;
 
     log_print(LOG_INFO, SECTION_FUSEDAV_PROP, "%s: %s (%lu)", funcname, path, status_code);
 
+    // Until its upload lands, the local version is newer than anything the server reports
+    if (filecache_writeback_pending(config->cache, path)) {
+        log_print(LOG_DEBUG, SECTION_FUSEDAV_PROP, "%s: %s has an upload pending; keeping local stat", funcname, path);
+        return;
+    }
+
+    // Nor does the server have a say about local-only paths, even if it has a file by that name
+    if (filecache_local_only(path)) {
+        log_print(LOG_DEBUG, SECTION_FUSEDAV_PROP, "%s: %s is local-only; keeping local stat", funcname, path);
+        return;
+    }
+
     memset(&value, 0, sizeof(struct stat_cache_value));
     value.st = st;
+    strcpy(value.etag, etag);
     // Indicate that this update is the result of a propfind
     stat_cache_from_propfind(&value, true);
 
@@ -443,16 +466,30 @@ static void getdir_cache_callback(__unused const char *path_prefix, const char *
     }
 }
 
-static void update_directory(const char *path, bool attempt_progressive_update, GError **gerr) {
+// A file whose upload is still pending is missing from the server, not deleted,
+// and a local-only one is never there
+static bool keep_unlisted(stat_cache_t *cache, const char *path) {
+    return filecache_writeback_pending(cache, path) || filecache_local_only(path);
+}
+
+static void update_directory(struct fusedav_config *config, const char *path, bool attempt_progressive_update,
+        GError **gerr) {
     const char *funcname = "update_directory";
-    struct fusedav_config *config = fuse_get_context()->private_data;
     GError *tmpgerr = NULL;
     bool needs_update = true;
     time_t timestamp;
     int propfind_result;
 
+    // The stat cache is all there is of a local-only directory
+    if (filecache_local_only(path)) {
+        BUMP(dav_local_only);
+        log_print(LOG_DEBUG, SECTION_FUSEDAV_STAT, "%s: %s is local-only; no PROPFIND", funcname, path);
+        timestamp = time(NULL);
+        needs_update = false;
+    }
+
     // Attempt to freshen the cache.
-    if (attempt_progressive_update && config->progressive_propfind) {
+    if (needs_update && attempt_progressive_update && config->progressive_propfind) {
         time_t last_updated;
         timestamp = time(NULL);
         last_updated = stat_cache_read_updated_children(config->cache, path, &tmpgerr);
@@ -464,7 +501,7 @@ static void update_directory(const char *path, bool attempt_progressive_update,
         log_print(LOG_DEBUG, SECTION_FUSEDAV_STAT, "%s: Freshening directory data: %s", funcname, path);
 
         propfind_result = simple_propfind_with_redirect(path, PROPFIND_DEPTH_ONE, last_updated - CLOCK_SKEW,
-            getdir_propfind_callback, NULL, &tmpgerr);
+            getdir_propfind_callback, config, &tmpgerr);
         // On true error, we set an error and return, avoiding the complete PROPFIND.
         // On sucess we avoid the complete PROPFIND
         // On ESTALE, we do a complete PROPFIND
@@ -498,7 +535,7 @@ static void update_directory(const char *path, bool attempt_progressive_update,
         // min_generation gets value here
         min_generation = stat_cache_get_local_generation();
         // getdir_propfind_callback calls stat_cache_value_set, which makes local_generation one higher than min_generation
-        propfind_result = simple_propfind_with_redirect(path, PROPFIND_DEPTH_ONE, 0, getdir_propfind_callback, NULL, &tmpgerr);
+        propfind_result = simple_propfind_with_redirect(path, PROPFIND_DEPTH_ONE, 0, getdir_propfind_callback, config, &tmpgerr);
         BUMP(propfind_complete_cache);
         if (tmpgerr) {
             g_propagate_prefixed_error(gerr, tmpgerr, "%s: ", funcname);
@@ -511,7 +548,7 @@ static void update_directory(const char *path, bool attempt_progressive_update,
 
         // All files in propfind list will have local_generation > min_generation and will not be subject to deletion
         log_print(LOG_INFO, SECTION_FUSEDAV_STAT, "%s: Complete PROPFIND, calling stat_cache_delete_older): %s", funcname, path);
-        stat_cache_delete_older(config->cache, path, min_generation, &tmpgerr);
+        stat_cache_delete_older(config->cache, path, min_generation, keep_unlisted, &tmpgerr);
         if (tmpgerr) {
             g_propagate_prefixed_error(gerr, tmpgerr, "%s: ", funcname);
             return;
@@ -591,7 +628,7 @@ static int dav_readdir(
                     "dav_readdir: Updating directory: %s; attempt_progressive_update will be %d",
                     path, ret == -STAT_CACHE_OLD_DATA);
 
-            update_directory(path, (ret == -STAT_CACHE_OLD_DATA), &gerr);
+            update_directory(config, path, (ret == -STAT_CACHE_OLD_DATA), &gerr);
 
             log_print(LOG_DEBUG, SECTION_FUSEDAV_STAT, 
                     "dav_readdir: Second call to stat_cache_enumerate: %d", ret);
@@ -620,11 +657,21 @@ static int dav_readdir(
     }
 
     log_print(LOG_DEBUG, SECTION_FUSEDAV_DIR, "dav_readdir: Successful readdir for path: %s", path);
+    prefetch_readdir(path);
     return 0;
 }
 
+// Warm a directory listing for the prefetchers and the manifest warmer
+static void prefetch_directory(void *userdata, const char *path, GError **gerr) {
+    struct fusedav_config *config = userdata;
+    GError *tmpgerr = NULL;
+
+    update_directory(config, path, stat_cache_read_updated_children(config->cache, path, NULL) > 0, &tmpgerr);
+    if (tmpgerr) g_propagate_prefixed_error(gerr, tmpgerr, "prefetch_directory: ");
+}
+
 static void getattr_propfind_callback(__unused void *userdata, const char *path, struct stat st,
-        unsigned long status_code, GError **gerr) {
+        const char *etag, unsigned long status_code, GError **gerr) {
     struct fusedav_config *config = fuse_get_context()->private_data;
     struct stat_cache_value value;
     GError *subgerr = NULL;
@@ -632,6 +679,7 @@ static void getattr_propfind_callback(__unused void *userdata, const char *path,
     // Zero-out structure; some fields we don't populate but want to be 0, e.g. st_atim.tv_nsec
     memset(&value, 0, sizeof(struct stat_cache_value));
     value.st = st;
+    strcpy(value.etag, etag);
 
     if (status_code == 410) {
         log_print(LOG_NOTICE, SECTION_FUSEDAV_PROP, "getattr_propfind_callback: Deleting from stat cache: %s", path);
@@ -840,6 +888,18 @@ static void get_stat(const char *path, struct stat *stbuf, GError **gerr) {
         skip_freshness_check = SAINT_MODE;
     }
 
+    // A local-only path is in the stat cache, or nowhere
+    if (filecache_local_only(path)) {
+        ret = get_stat_from_cache(path, stbuf, ALREADY_FRESH, &tmpgerr);
+        if (tmpgerr) {
+            g_propagate_prefixed_error(gerr, tmpgerr, "%s: ", funcname);
+        }
+        else if (ret == -ENOENT) {
+            g_set_error(gerr, fusedav_quark(), ENOENT, "%s: ENOENT", funcname);
+        }
+        return;
+    }
+
     // Check if we can directly hit this entry in the stat cache.
     ret = get_stat_from_cache(path, stbuf, skip_freshness_check, &tmpgerr);
 
@@ -949,7 +1009,7 @@ static void get_stat(const char *path, struct stat *stbuf, GError **gerr) {
             funcname, parent_path, (parent_children_update_ts > 0));
         // If parent_children_update_ts is 0, there are no entries for updated_children in statcache
         // In that case, skip the progressive propfind and go straight to complete propfind
-        update_directory(parent_path, (parent_children_update_ts > 0), &subgerr);
+        update_directory(config, parent_path, (parent_children_update_ts > 0), &subgerr);
         if (subgerr) {
             g_propagate_prefixed_error(gerr, subgerr, "%s: ", funcname);
             goto fail;
@@ -1050,8 +1110,15 @@ static void common_getattr(const char *path, struct stat *stbuf, struct fuse_fil
         // These are taken care of by fill_stat_generic below if path is NULL
         if (S_ISDIR(stbuf->st_mode))
             stbuf->st_mode |= S_IFDIR;
-        if (S_ISREG(stbuf->st_mode))
+        if (S_ISREG(stbuf->st_mode)) {
+            off_t size;
             stbuf->st_mode |= S_IFREG;
+            // Writes don't update the stat cache each time; a file being written has the newer size
+            if (filecache_open_size(path, &size)) {
+                stbuf->st_size = size;
+                stbuf->st_blocks = (size + 511) / 512;
+            }
+        }
     }
     else {
         int fd = filecache_fd(info);
@@ -1064,6 +1131,14 @@ static void common_getattr(const char *path, struct stat *stbuf, struct fuse_fil
             g_propagate_prefixed_error(gerr, tmpgerr, "common_getattr: ");
             return;
         }
+        // Files stored inline in the filecache have no fd to take the size from
+        if (fd < 0) {
+            off_t size = filecache_inline_size(info);
+            if (size >= 0) {
+                stbuf->st_size = size;
+                stbuf->st_blocks = (size + 511) / 512;
+            }
+        }
     }
 
     // Zero-out unused nanosecond fields.
@@ -1139,6 +1214,21 @@ static void common_unlink(const char *path, bool do_unlink, GError **gerr) {
         return;
     }
 
+    // An upload finishing after the DELETE would bring the file back
+    filecache_writeback_hold(path, NULL);
+
+    // A new file which was never uploaded has nothing on the server to delete
+    if (do_unlink && filecache_writeback_unsent(config->cache, path)) {
+        BUMP(dav_unlink_unsent);
+        log_print(LOG_INFO, SECTION_FUSEDAV_FILE, "%s: %s was never uploaded; no DELETE", funcname, path);
+        do_unlink = false;
+    }
+    else if (do_unlink && filecache_local_only(path)) {
+        BUMP(dav_local_only);
+        log_print(LOG_DEBUG, SECTION_FUSEDAV_FILE, "%s: %s is local-only; no DELETE", funcname, path);
+        do_unlink = false;
+    }
+
     if (do_unlink) {
         CURLcode res = CURLE_OK;
         long response_code = 500; // seed it as bad so we can enter the loop
@@ -1152,6 +1242,7 @@ static void common_unlink(const char *path, bool do_unlink, GError **gerr) {
                 g_set_error(gerr, fusedav_quark(), ENETDOWN, "%s(%s): failed to get request session", funcname, path);
                 // TODO(kibra): Manually cleaning up this lock sucks. We should make sure this happens in a better way.
                 try_release_request_outstanding();
+                filecache_writeback_release(path, NULL);
                 return;
             }
 
@@ -1175,6 +1266,7 @@ static void common_unlink(const char *path, bool do_unlink, GError **gerr) {
             trigger_saint_event(CLUSTER_FAILURE);
             set_dynamic_logging();
             g_set_error(gerr, fusedav_quark(), ENETDOWN, "%s: DELETE failed: %s", funcname, curl_easy_strerror(res));
+            filecache_writeback_release(path, NULL);
             return;
         } else {
             trigger_saint_event(CLUSTER_SUCCESS);
@@ -1188,6 +1280,7 @@ static void common_unlink(const char *path, bool do_unlink, GError **gerr) {
     log_print(LOG_DEBUG, SECTION_FUSEDAV_FILE, "%s: calling stat_cache_negative_entry on %s", funcname, path);
     stat_cache_value_set(config->cache, path, &value, &gerr3);
     // stat_cache_negative_entry(config->cache, path, update, &gerr3);
+    filecache_writeback_release(path, NULL);
 
     // If we need to combine 2 errors, use one of the error messages in the propagated prefix
     if (gerr2 && gerr3) {
@@ -1236,6 +1329,7 @@ static int dav_rmdir(const char *path) {
     struct stat st;
     long response_code = 500; // seed it as bad so we can enter the loop
     CURLcode res = CURLE_OK;
+    bool local_only = filecache_local_only(path);
 
     if (use_readonly_mode()) {
         log_print(LOG_WARNING, SECTION_FUSEDAV_FILE, "dav_rmdir: %s aborted; in readonly mode", path);
@@ -1252,7 +1346,7 @@ static int dav_rmdir(const char *path) {
         return processed_gerror(funcname, path, &gerr);
     }
 
-    update_directory(path, true, &gerr);
+    update_directory(config, path, true, &gerr);
     if (gerr) {
         return processed_gerror(funcname, path, &gerr);
     }
@@ -1275,7 +1369,7 @@ static int dav_rmdir(const char *path) {
     // not the directory itself
     snprintf(fn, sizeof(fn), "%s/", path);
 
-    for (int idx = 0; idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500); idx++) {
+    for (int idx = 0; !local_only && idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500); idx++) {
         CURL *session;
         struct curl_slist *slist = NULL;
         long elapsed_time = 0;
@@ -1302,7 +1396,11 @@ static int dav_rmdir(const char *path) {
         if (non_retriable_error) break;
     }
 
-    if (res != CURLE_OK || response_code >= 500) {
+    if (local_only) {
+        BUMP(dav_local_only);
+        log_print(LOG_DEBUG, SECTION_FUSEDAV_DIR, "%s: %s is local-only; no DELETE", funcname, path);
+    }
+    else if (res != CURLE_OK || response_code >= 500) {
         trigger_saint_event(CLUSTER_FAILURE);
         set_dynamic_logging();
         log_print(LOG_ERR, SECTION_FUSEDAV_DIR, "%s(%s): DELETE failed: %s", funcname, path, curl_easy_strerror(res));
@@ -1337,6 +1435,7 @@ static int dav_mkdir(const char *path, mode_t mode) {
     GError *gerr = NULL;
     long response_code = 500; // seed it as bad so we can enter the loop
     CURLcode res = CURLE_OK;
+    bool local_only = filecache_local_only(path);
 
     if (use_readonly_mode()) {
         log_print(LOG_WARNING, SECTION_FUSEDAV_FILE, "dav_mkdir: %s aborted; in readonly mode", path);
@@ -1350,7 +1449,7 @@ static int dav_mkdir(const char *path, mode_t mode) {
 
     snprintf(fn, sizeof(fn), "%s/", path);
 
-    for (int idx = 0; idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500); idx++) {
+    for (int idx = 0; !local_only && idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500); idx++) {
         CURL *session;
         struct curl_slist *slist = NULL;
         long elapsed_time = 0;
@@ -1377,7 +1476,11 @@ static int dav_mkdir(const char *path, mode_t mode) {
         if (non_retriable_error) break;
     }
 
-    if (res != CURLE_OK || response_code >= 500) {
+    if (local_only) {
+        BUMP(dav_local_only);
+        log_print(LOG_DEBUG, SECTION_FUSEDAV_DIR, "%s: %s is local-only; no MKCOL", funcname, path);
+    }
+    else if (res != CURLE_OK || response_code >= 500) {
         trigger_saint_event(CLUSTER_FAILURE);
         set_dynamic_logging();
         log_print(LOG_ERR, SECTION_FUSEDAV_DIR, "%s(%s): MKCOL failed: %s", funcname, path, curl_easy_strerror(res));
@@ -1416,6 +1519,11 @@ static int dav_rename(const char *from, const char *to) {
     struct stat_cache_value *entry = NULL;
     long response_code = 500; // seed it as bad so we can enter the loop
     CURLcode res = CURLE_OK;
+    bool held = false;
+    bool held_prefix = false;
+    bool unsent = false;
+    bool from_local = filecache_local_only(from);
+    bool to_local = filecache_local_only(to);
 
     if (use_readonly_mode()) {
         log_print(LOG_WARNING, SECTION_FUSEDAV_FILE, "dav_rename: %s aborted; in readonly mode", from);
@@ -1437,11 +1545,33 @@ static int dav_rename(const char *from, const char *to) {
     }
 
     if (S_ISDIR(st.st_mode)) {
+        // The server and the caches would disagree about what is in the directory
+        if (from_local != to_local) {
+            log_print(LOG_INFO, SECTION_FUSEDAV_FILE, "%s: %s -> %s crosses local-only paths", funcname, from, to);
+            server_ret = -EXDEV;
+            goto finish;
+        }
         snprintf(fn, sizeof(fn), "%s/", from);
         from = fn;
+        // Let pending uploads of files in the directory land, and keep new
+        // ones off it, until it has moved
+        if (!filecache_writeback_hold_prefix(from, WRITEBACK_DRAIN_TIMEOUT)) {
+            log_print(LOG_WARNING, SECTION_FUSEDAV_FILE, "%s: uploads under %s still pending", funcname, from);
+            server_ret = -EBUSY;
+            goto finish;
+        }
+        held_prefix = true;
+    }
+    else {
+        // No upload of either file may run while the server and the caches move
+        filecache_writeback_hold(from, to);
+        held = true;
+        // A new file still waiting for its first upload has nothing on the
+        // server to move; the upload just goes to the new name
+        unsent = filecache_writeback_unsent(config->cache, from);
     }
 
-    for (int idx = 0; idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500); idx++) {
+    for (int idx = 0; !unsent && !from_local && idx < num_filesystem_server_nodes && (res != CURLE_OK || response_code >= 500); idx++) {
         CURL *session;
         struct curl_slist *slist = NULL;
         char *header = NULL;
@@ -1455,17 +1585,23 @@ static int dav_rename(const char *from, const char *to) {
             goto finish;
         }
 
-        curl_easy_setopt(session, CURLOPT_CUSTOMREQUEST, "MOVE");
+        // A file going local-only leaves the server
+        if (to_local) {
+            curl_easy_setopt(session, CURLOPT_CUSTOMREQUEST, "DELETE");
+        }
+        else {
+            curl_easy_setopt(session, CURLOPT_CUSTOMREQUEST, "MOVE");
 
-        // Add the destination header.
-        // @TODO: Better error handling on failure.
-        escaped_to = escape_except_slashes(session, to);
-        asprintf(&header, "Destination: %s%s", get_base_url(), escaped_to);
-        curl_free(escaped_to);
-        escaped_to = NULL;
-        slist = curl_slist_append(slist, header);
-        free(header);
-        header = NULL;
+            // Add the destination header.
+            // @TODO: Better error handling on failure.
+            escaped_to = escape_except_slashes(session, to);
+            asprintf(&header, "Destination: %s%s", get_base_url(), escaped_to);
+            curl_free(escaped_to);
+            escaped_to = NULL;
+            slist = curl_slist_append(slist, header);
+            free(header);
+            header = NULL;
+        }
 
         slist = enhanced_logging(slist, LOG_INFO, SECTION_FUSEDAV_FILE, "%s: %s to %s", funcname, from, to);
 
@@ -1488,8 +1624,21 @@ static int dav_rename(const char *from, const char *to) {
      * fails with 404: may be doing the move on an open file, so this may be ok
      *                 mv 'from' to 'to', delete 'from'
      * fails, not 404: error, exit
+     * skipped because from was never uploaded: move locally
+     * skipped because from is local-only: move locally, then upload 'to' if it isn't
+     * DELETE instead, because to is local-only: same as for a move
      */
-    if(res != CURLE_OK || response_code >= 500) {
+    if (unsent) {
+        BUMP(dav_rename_unsent);
+        log_print(LOG_INFO, SECTION_FUSEDAV_FILE, "%s: %s was never uploaded; no MOVE", funcname, from);
+    }
+    else if (from_local) {
+        BUMP(dav_local_only);
+        log_print(LOG_DEBUG, SECTION_FUSEDAV_FILE, "%s: %s is local-only; no MOVE", funcname, from);
+        // A directory has no file cache entry, so the stat cache move is all there is
+        if (S_ISDIR(st.st_mode)) server_ret = 0;
+    }
+    else if(res != CURLE_OK || response_code >= 500) {
         trigger_saint_event(CLUSTER_FAILURE);
         set_dynamic_logging();
         log_print(LOG_ERR, SECTION_FUSEDAV_FILE, "%s: MOVE failed: %s", funcname, curl_easy_strerror(res));
@@ -1559,10 +1708,21 @@ static int dav_rename(const char *from, const char *to) {
     }
     local_ret = 0;
 
+    // The file has been local-only all its life, so the server has yet to see it
+    if (from_local && !to_local && !S_ISDIR(st.st_mode)) {
+        filecache_publish(config->cache, to, &gerr);
+        if (gerr) {
+            local_ret = processed_gerror(funcname, to, &gerr);
+            goto finish;
+        }
+    }
+
 finish:
 
     log_print(LOG_DEBUG, SECTION_FUSEDAV_FILE, "Exiting: %s(%s, %s); %d %d", funcname, from, to, server_ret, local_ret);
 
+    if (held) filecache_writeback_release(from, to);
+    if (held_prefix) filecache_writeback_release_prefix(from);
     free(entry);
 
     // if either the server move or the local move succeed, we return success
@@ -1864,6 +2024,8 @@ static int dav_open(const char *path, struct fuse_file_info *info) {
         return ret;
     }
 
+    prefetch_open(path);
+
     // Update stat cache value to reset the file size to 0 on trunc.
     if (info->flags & O_TRUNC) {
         struct stat_cache_value value;
@@ -1966,32 +2128,39 @@ static int dav_write(const char *path, const char *buf, size_t size, off_t offse
 
     if (path != NULL) {
         int fd;
+
+        if (file_too_big(filecache_size(info), config->max_file_size, path)) {
+            // The file will now carry along with it the fact that there has been an error.
+            // Eventually, this will send the file to forensic haven
+            filecache_set_error(info, EFBIG);
+            return (-EFBIG);
+        }
+
+        // Only the first write of a session touches leveldb here; after that
+        // the pdata is already marked local in memory
         filecache_sync(config->cache, path, info, false, &gerr);
         if (gerr) {
             return processed_gerror("dav_write: ", path, &gerr);
         }
 
+        // getattr takes the size from the open file meanwhile, and flush,
+        // fsync and release write the stat cache; this is just for crashes
+        if (!filecache_stat_due(info, STAT_FLUSH_INTERVAL)) {
+            return bytes_written;
+        }
+
         // Zero-out structure; some fields we don't populate but want to be 0, e.g. st_atim.tv_nsec
         memset(&value, 0, sizeof(struct stat_cache_value));
 
         fd = filecache_fd(info);
         // mode = 0 (unspecified), is_dir = false; fd to get size
         fill_stat_generic(&(value.st), 0, false, fd, &gerr);
+        if (!gerr) {
+            stat_cache_value_set(config->cache, path, &value, &gerr);
+        }
         if (gerr) {
             return processed_gerror("dav_write: ", path, &gerr);
         }
-        else {
-            if (file_too_big(value.st.st_size, config->max_file_size, path)) {
-                // The file will now carry along with it the fact that there has been an error.
-                // Eventually, this will send the file to forensic haven
-                filecache_set_error(info, EFBIG);
-                return (-EFBIG);
-            }
-            stat_cache_value_set(config->cache, path, &value, &gerr);
-            if (gerr) {
-                return processed_gerror("dav_write: ", path, &gerr);
-            }
-        }
     }
 
    return bytes_written;
@@ -2351,11 +2520,17 @@ int main(int argc, char *argv[]) {
     }
 
     // Ensure directory exists for file content cache.
-    filecache_init(config.cache_path, &gerr);
+    filecache_init(config.cache_path, config.inline_file_size, config.upload_chunk_size, config.pipelined_put,
+        config.append_put, &gerr);
     if (gerr) {
         log_print(LOG_CRIT, SECTION_FUSEDAV_MAIN, "main: %s.", gerr->message);
         goto finish;
     }
+    filecache_local_only_init(config.local_only_paths);
+    filecache_parallel_get_init(config.parallel_get_size, config.parallel_get_streams);
+    filecache_fadvise_init(config.fadvise, config.fadvise_stream_size, config.direct_downloads);
+    cacheio_init(config.io_uring);
+    filecache_ram_tier_init(config.ram_tier_size, config.ram_tier_file_size);
     log_print(LOG_DEBUG, SECTION_FUSEDAV_MAIN, "Opened ldb file cache.");
 
     // Open the stat cache.
@@ -2367,6 +2542,38 @@ int main(int argc, char *argv[]) {
     }
     log_print(LOG_DEBUG, SECTION_FUSEDAV_MAIN, "Opened stat cache.");
 
+    // Move cache files from the old flat files directory into shards
+    filecache_migrate_layout(config.cache, config.cache_path, &gerr);
+    if (gerr) {
+        // Not fatal; files which didn't move are still usable where they are
+        processed_gerror("main: ", config.cache_path, &gerr);
+    }
+
+    // Start the uploaders, picking up whatever the journal still holds from before a restart
+    if (config.writeback || config.new_file_delay > 0) {
+        filecache_writeback_init(config.cache, config.cache_path, config.upload_threads, config.writeback,
+            config.new_file_delay, &gerr);
+        if (gerr) {
+            log_print(LOG_CRIT, SECTION_FUSEDAV_MAIN, "main: %s.", gerr->message);
+            goto finish;
+        }
+    }
+
+    // Start the revalidators for files which may be served stale
+    filecache_stale_init(config.cache, config.cache_path, config.stale_while_revalidate);
+
+    // Start the prefetchers, which need the stat cache open
+    if (config.prefetch_threads > 0) {
+        prefetch_init(config.cache, config.cache_path, config.prefetch_threads, config.prefetch_file_size,
+            prefetch_directory, &config);
+    }
+
+    // Warm the caches from the manifest, now and whenever it changes
+    if (config.warm_manifest) {
+        warm_init(config.cache, config.cache_path, config.warm_manifest, config.warm_threads, config.warm_rate,
+            prefetch_directory, &config);
+    }
+
     if (write_package_version_file(config.cache_path)) {
         log_print(LOG_CRIT, SECTION_FUSEDAV_MAIN, "Failed to create package version file. Not fatal.");
     }
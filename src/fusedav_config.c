@@ -131,6 +131,28 @@ static void print_config(struct fusedav_config *config) {
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "log_level_by_section %s", config->log_level_by_section);
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "log_prefix %s", config->log_prefix);
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "max_file_size %d", config->max_file_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "inline_file_size %d", config->inline_file_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "writeback %d", config->writeback);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "upload_threads %d", config->upload_threads);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "upload_chunk_size %d", config->upload_chunk_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "pipelined_put %d", config->pipelined_put);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "append_put %d", config->append_put);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "new_file_delay %d", config->new_file_delay);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "local_only_paths %s", config->local_only_paths);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "parallel_get_size %d", config->parallel_get_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "parallel_get_streams %d", config->parallel_get_streams);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "fadvise %d", config->fadvise);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "fadvise_stream_size %d", config->fadvise_stream_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "direct_downloads %d", config->direct_downloads);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "io_uring %d", config->io_uring);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "ram_tier_size %d", config->ram_tier_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "ram_tier_file_size %d", config->ram_tier_file_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "stale_while_revalidate %s", config->stale_while_revalidate);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "prefetch_threads %d", config->prefetch_threads);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "prefetch_file_size %d", config->prefetch_file_size);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "warm_manifest %s", config->warm_manifest);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "warm_threads %d", config->warm_threads);
+    log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "warm_rate %d", config->warm_rate);
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "statsd_host %s", config->statsd_host);
     log_print(LOG_DEBUG, SECTION_CONFIG_DEFAULT, "statsd_port %s", config->statsd_port);
 
@@ -157,6 +179,28 @@ log_level=5
 log_level_by_section=0
 log_prefix=6f7a106722f74cc7bd96d4d06785ed78
 max_file_size=256
+inline_file_size=4096
+writeback=false
+upload_threads=4
+upload_chunk_size=0
+pipelined_put=false
+append_put=false
+new_file_delay=0
+local_only_paths=*.swp;.~lock.*;/tmp
+parallel_get_size=0
+parallel_get_streams=4
+fadvise=false
+fadvise_stream_size=64
+direct_downloads=false
+io_uring=false
+ram_tier_size=0
+ram_tier_file_size=64
+stale_while_revalidate=*.css:60;*.js:60;*.html:10
+prefetch_threads=0
+prefetch_file_size=64
+warm_manifest=/srv/bindings/6f7a106722f74cc7bd96d4d06785ed78/warm.manifest
+warm_threads=4
+warm_rate=20
 statsd_host=127.0.0.1
 statsd_port=8126
 */
@@ -199,6 +243,28 @@ static void parse_configs(struct fusedav_config *config, GError **gerr) {
         keytuple(fusedav, log_level_by_section, STRING),
         keytuple(fusedav, log_prefix, STRING),
         keytuple(fusedav, max_file_size, INT),
+        keytuple(fusedav, inline_file_size, INT),
+        keytuple(fusedav, writeback, BOOL),
+        keytuple(fusedav, upload_threads, INT),
+        keytuple(fusedav, upload_chunk_size, INT),
+        keytuple(fusedav, pipelined_put, BOOL),
+        keytuple(fusedav, append_put, BOOL),
+        keytuple(fusedav, new_file_delay, INT),
+        keytuple(fusedav, local_only_paths, STRING),
+        keytuple(fusedav, parallel_get_size, INT),
+        keytuple(fusedav, parallel_get_streams, INT),
+        keytuple(fusedav, fadvise, BOOL),
+        keytuple(fusedav, fadvise_stream_size, INT),
+        keytuple(fusedav, direct_downloads, BOOL),
+        keytuple(fusedav, io_uring, BOOL),
+        keytuple(fusedav, ram_tier_size, INT),
+        keytuple(fusedav, ram_tier_file_size, INT),
+        keytuple(fusedav, stale_while_revalidate, STRING),
+        keytuple(fusedav, prefetch_threads, INT),
+        keytuple(fusedav, prefetch_file_size, INT),
+        keytuple(fusedav, warm_manifest, STRING),
+        keytuple(fusedav, warm_threads, INT),
+        keytuple(fusedav, warm_rate, INT),
         keytuple(fusedav, statsd_host, STRING),
         keytuple(fusedav, statsd_port, STRING),
         {NULL, NULL, 0, 0}
@@ -289,6 +355,14 @@ void configure_fusedav(struct fusedav_config *config, struct fuse_args *args, ch
     config->singlethread = false;
     config->nodaemon = false;
     config->max_file_size = 256; // 256M
+    config->upload_threads = 4;
+    config->upload_chunk_size = 0; // MB; 0 to always PUT whole files
+    config->parallel_get_streams = 4;
+    config->fadvise_stream_size = 64; // 64M
+    config->ram_tier_file_size = 64; // 64K
+    config->prefetch_file_size = 64; // 64K
+    config->warm_threads = 4;
+    config->warm_rate = 20; // requests a second
     config->log_level = 5; // default log_level: LOG_NOTICE
     asprintf(&config->statsd_host, "%s", "127.0.0.1");
     asprintf(&config->statsd_port, "%s", "8126");
@@ -53,6 +53,28 @@ struct fusedav_config {
     char *log_level_by_section;
     char *log_prefix;
     int  max_file_size;
+    int  inline_file_size;
+    bool writeback;
+    int  upload_threads;
+    int  upload_chunk_size;
+    bool pipelined_put;
+    bool append_put;
+    int  new_file_delay;
+    char *local_only_paths;
+    int  parallel_get_size;
+    int  parallel_get_streams;
+    bool fadvise;
+    int  fadvise_stream_size;
+    bool direct_downloads;
+    bool io_uring;
+    int  ram_tier_size;
+    int  ram_tier_file_size;
+    char *stale_while_revalidate;
+    int  prefetch_threads;
+    int  prefetch_file_size;
+    char *warm_manifest;
+    int  warm_threads;
+    int  warm_rate;
     char *statsd_host;
     char *statsd_port;
     char *conf;
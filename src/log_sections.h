@@ -68,7 +68,9 @@
 
 #define SECTION_STATS_DEFAULT 39
 
+#define SECTION_PREFETCH_DEFAULT 40
+
 // Update if more sections are added
-#define SECTIONS SECTION_STATS_DEFAULT
+#define SECTIONS SECTION_PREFETCH_DEFAULT
 
 #endif
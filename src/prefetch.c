@@ -0,0 +1,427 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+#include "filecache.h"
+#include "session.h"
+#include "log.h"
+#include "log_sections.h"
+#include "stats.h"
+#include "util.h"
+
+/* Prefetching from observed access.
+ *
+ * Tree walkers (backups, find, autoloaders) go through a directory one item
+ * at a time, each a round trip of its own when cold. So every visit to a
+ * directory, begun by a readdir or by the first open in it after
+ * PREFETCH_VISIT_GAP seconds of quiet, is handed to a small pool of
+ * low-priority prefetcher threads:
+ *
+ * - After a readdir, they warm the listings of its subdirectories, so the
+ *   walker's next readdirs and getattrs are answered from the stat cache.
+ * - They fetch the small files in it which were opened in at least
+ *   PREFETCH_MIN_VISITS earlier visits and in at least half of all visits:
+ *   the files which are commonly opened together.
+ *
+ * What they bring in is remembered for PREFETCH_USE_WINDOW seconds; a
+ * readdir or open of it within that time counts as used, anything else
+ * as wasted. The queue is bounded, and work which doesn't fit is dropped.
+ * Nothing is prefetched outside the healthy state, so saint mode is left to
+ * the foreground. The histories live only in memory.
+ */
+
+#define PREFETCH_QUEUE_MAX 256
+#define PREFETCH_DIRS_MAX 4096 // directories with a history
+#define PREFETCH_NAMES_MAX 256 // files with a history, per directory
+#define PREFETCH_SCAN_MAX 4096 // entries looked at for subdirectories, per readdir
+#define PREFETCH_SUBDIRS_MAX 64 // listings warmed per readdir
+#define PREFETCH_TRACKED_MAX 4096 // prefetches awaiting use
+#define PREFETCH_VISIT_GAP 10 // seconds
+#define PREFETCH_MIN_VISITS 2
+#define PREFETCH_USE_WINDOW 60 // seconds
+#define PREFETCH_NICE 10
+
+enum prefetch_kind {
+    PREFETCH_VISIT,
+    PREFETCH_DIRECTORY,
+    PREFETCH_FILE
+};
+
+struct prefetch_job {
+    enum prefetch_kind kind;
+    bool listed; // visits only: begun by a readdir
+    char *key; // kind prefix and path; key in queued
+};
+
+struct dir_history {
+    unsigned visits;
+    time_t last_access;
+    GHashTable *names; // name -> struct name_history
+};
+
+struct name_history {
+    unsigned visits; // visits in which the file was opened
+    unsigned last_visit;
+};
+
+static stat_cache_t *prefetch_cache = NULL;
+static char *prefetch_cache_path = NULL;
+static off_t prefetch_file_size = 0;
+static prefetch_directory_callback prefetch_directory = NULL;
+static void *prefetch_userdata = NULL;
+
+// All but running protected by prefetch_mutex. queued holds the keys of the
+// jobs in the queue or being worked on; tracked maps the keys of finished
+// prefetches to when they finished.
+static bool prefetch_running = false;
+static GQueue *prefetch_queue = NULL;
+static GHashTable *prefetch_queued = NULL;
+static GHashTable *prefetch_histories = NULL;
+static GHashTable *prefetch_tracked = NULL;
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+// Keys are the path behind a letter for the kind, as "d/a/b"
+static char *job_key(enum prefetch_kind kind, const char *path) {
+    char *key = NULL;
+    char letter = (kind == PREFETCH_VISIT) ? 'v' : (kind == PREFETCH_DIRECTORY) ? 'd' : 'f';
+
+    asprintf(&key, "%c%s", letter, path);
+    return key;
+}
+
+static void dir_history_free(void *ptr) {
+    struct dir_history *history = ptr;
+
+    g_hash_table_destroy(history->names);
+    free(history);
+}
+
+// Queue a job unless the same one is already queued. Caller holds prefetch_mutex
+static void job_push(enum prefetch_kind kind, const char *path, bool listed) {
+    struct prefetch_job *job;
+    char *key = job_key(kind, path);
+
+    if (g_hash_table_lookup(prefetch_queued, key)) {
+        free(key);
+        return;
+    }
+    if (g_queue_get_length(prefetch_queue) >= PREFETCH_QUEUE_MAX) {
+        BUMP(prefetch_dropped);
+        free(key);
+        return;
+    }
+    job = malloc(sizeof(struct prefetch_job));
+    if (job == NULL) {
+        free(key);
+        return;
+    }
+    job->kind = kind;
+    job->listed = listed;
+    job->key = key;
+    g_hash_table_insert(prefetch_queued, strdup(key), GINT_TO_POINTER(1));
+    g_queue_push_tail(prefetch_queue, job);
+    BUMP(prefetch_queued);
+    pthread_cond_signal(&prefetch_cond);
+}
+
+// Count a prefetch as used if path was brought in by one. Caller holds prefetch_mutex
+static void tracked_use(enum prefetch_kind kind, const char *path) {
+    char *key = job_key(kind, path);
+
+    if (g_hash_table_remove(prefetch_tracked, key)) BUMP(prefetch_used);
+    free(key);
+}
+
+// Count the prefetches nobody came for as wasted. Caller holds prefetch_mutex
+static void tracked_expire(time_t now) {
+    static time_t last_expire = 0;
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+
+    if (now == last_expire) return;
+    last_expire = now;
+
+    g_hash_table_iter_init(&iter, prefetch_tracked);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (now - (time_t) GPOINTER_TO_SIZE(value) > PREFETCH_USE_WINDOW) {
+            g_hash_table_iter_remove(&iter);
+            BUMP(prefetch_wasted);
+        }
+    }
+}
+
+// Record an access to dir, and to name in it if not NULL. Returns true if it
+// begins a new visit. Caller holds prefetch_mutex
+static bool history_note(const char *dir, const char *name, time_t now) {
+    struct dir_history *history;
+    bool new_visit = false;
+
+    history = g_hash_table_lookup(prefetch_histories, dir);
+    if (history == NULL) {
+        // Make room by forgetting the directory left alone longest
+        if (g_hash_table_size(prefetch_histories) >= PREFETCH_DIRS_MAX) {
+            GHashTableIter iter;
+            gpointer key;
+            gpointer value;
+            gpointer oldest = NULL;
+            time_t oldest_access = now;
+
+            g_hash_table_iter_init(&iter, prefetch_histories);
+            while (g_hash_table_iter_next(&iter, &key, &value)) {
+                if (((struct dir_history *) value)->last_access <= oldest_access) {
+                    oldest = key;
+                    oldest_access = ((struct dir_history *) value)->last_access;
+                }
+            }
+            if (oldest) g_hash_table_remove(prefetch_histories, oldest);
+        }
+        history = calloc(1, sizeof(struct dir_history));
+        if (history == NULL) return false;
+        history->names = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+        g_hash_table_insert(prefetch_histories, strdup(dir), history);
+    }
+
+    if (now - history->last_access > PREFETCH_VISIT_GAP) {
+        ++history->visits;
+        new_visit = true;
+    }
+    history->last_access = now;
+
+    if (name) {
+        struct name_history *opened = g_hash_table_lookup(history->names, name);
+        if (opened == NULL && g_hash_table_size(history->names) < PREFETCH_NAMES_MAX) {
+            opened = calloc(1, sizeof(struct name_history));
+            if (opened) g_hash_table_insert(history->names, strdup(name), opened);
+        }
+        if (opened && opened->last_visit != history->visits) {
+            ++opened->visits;
+            opened->last_visit = history->visits;
+        }
+    }
+
+    return new_visit;
+}
+
+// The readdir of path has been answered
+void prefetch_readdir(const char *path) {
+    time_t now = time(NULL);
+
+    if (!prefetch_running || path == NULL) return;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    tracked_use(PREFETCH_DIRECTORY, path);
+    history_note(path, NULL, now);
+    // Even within a visit; the subdirectories' listings may have gone stale since
+    job_push(PREFETCH_VISIT, path, true);
+    pthread_mutex_unlock(&prefetch_mutex);
+}
+
+// path has been opened
+void prefetch_open(const char *path) {
+    const char *slash;
+    char *dir;
+
+    if (!prefetch_running || path == NULL) return;
+    slash = strrchr(path, '/');
+    if (slash == NULL || slash[1] == '\0') return;
+    dir = (slash == path) ? strdup("/") : strndup(path, slash - path);
+
+    pthread_mutex_lock(&prefetch_mutex);
+    tracked_use(PREFETCH_FILE, path);
+    if (history_note(dir, slash + 1, time(NULL))) job_push(PREFETCH_VISIT, dir, false);
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    free(dir);
+}
+
+// Queue what a visit to dir calls for
+static void visit(const char *dir, bool listed) {
+    GPtrArray *candidates = g_ptr_array_new();
+    GPtrArray *subdirs = g_ptr_array_new();
+    struct dir_history *history;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    history = g_hash_table_lookup(prefetch_histories, dir);
+    if (history) {
+        GHashTableIter iter;
+        gpointer key;
+        gpointer value;
+
+        g_hash_table_iter_init(&iter, history->names);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            struct name_history *opened = value;
+            if (opened->visits >= PREFETCH_MIN_VISITS && opened->visits * 2 >= history->visits) {
+                g_ptr_array_add(candidates, path_child(dir, key));
+            }
+        }
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    if (listed) {
+        GPtrArray *names = g_ptr_array_new();
+        struct child_names children = {names, PREFETCH_SCAN_MAX};
+        stat_cache_enumerate(prefetch_cache, dir, child_names_collect, &children, true);
+        for (unsigned idx = 0; idx < names->len && subdirs->len < PREFETCH_SUBDIRS_MAX; idx++) {
+            char *path = path_child(dir, g_ptr_array_index(names, idx));
+            struct stat_cache_value *value = stat_cache_value_get(prefetch_cache, path, true, NULL);
+            if (value && S_ISDIR(value->st.st_mode) && !stat_cache_children_fresh(prefetch_cache, path)) {
+                g_ptr_array_add(subdirs, path);
+            }
+            else {
+                free(path);
+            }
+            free(value);
+        }
+        for (unsigned idx = 0; idx < names->len; idx++) {
+            free(g_ptr_array_index(names, idx));
+        }
+        g_ptr_array_free(names, true);
+    }
+
+    pthread_mutex_lock(&prefetch_mutex);
+    for (unsigned idx = 0; idx < candidates->len; idx++) {
+        char *path = g_ptr_array_index(candidates, idx);
+        struct stat_cache_value *value = stat_cache_value_get(prefetch_cache, path, true, NULL);
+        if (value && S_ISREG(value->st.st_mode) && value->st.st_size <= prefetch_file_size) {
+            job_push(PREFETCH_FILE, path, false);
+        }
+        free(value);
+        free(path);
+    }
+    for (unsigned idx = 0; idx < subdirs->len; idx++) {
+        job_push(PREFETCH_DIRECTORY, g_ptr_array_index(subdirs, idx), false);
+        free(g_ptr_array_index(subdirs, idx));
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    g_ptr_array_free(candidates, true);
+    g_ptr_array_free(subdirs, true);
+}
+
+static void run_job(struct prefetch_job *job) {
+    const char *path = job->key + 1;
+    GError *gerr = NULL;
+    bool done = false;
+
+    switch (job->kind) {
+    case PREFETCH_VISIT:
+        visit(path, job->listed);
+        return;
+    case PREFETCH_DIRECTORY:
+        // The foreground may have got there first
+        if (stat_cache_children_fresh(prefetch_cache, path)) return;
+        prefetch_directory(prefetch_userdata, path, &gerr);
+        done = (gerr == NULL);
+        if (done) BUMP(prefetch_directories);
+        break;
+    case PREFETCH_FILE:
+        done = filecache_prefetch(prefetch_cache, prefetch_cache_path, path, &gerr);
+        if (done) BUMP(prefetch_files);
+        break;
+    }
+
+    if (gerr) {
+        log_print(LOG_INFO, SECTION_PREFETCH_DEFAULT, "run_job: %s: %s", path, gerr->message);
+        BUMP(prefetch_failed);
+        g_clear_error(&gerr);
+    }
+    if (done) {
+        pthread_mutex_lock(&prefetch_mutex);
+        if (g_hash_table_size(prefetch_tracked) < PREFETCH_TRACKED_MAX) {
+            g_hash_table_replace(prefetch_tracked, strdup(job->key), GSIZE_TO_POINTER((gsize) time(NULL)));
+        }
+        pthread_mutex_unlock(&prefetch_mutex);
+    }
+}
+
+static void *prefetch_worker(__unused void *ptr) {
+    thread_nice(PREFETCH_NICE, "prefetch_worker");
+
+    while (true) {
+        struct prefetch_job *job = NULL;
+
+        pthread_mutex_lock(&prefetch_mutex);
+        while (job == NULL) {
+            struct timespec wake;
+
+            tracked_expire(time(NULL));
+            job = g_queue_pop_head(prefetch_queue);
+            if (job) break;
+            clock_gettime(CLOCK_REALTIME, &wake);
+            wake.tv_sec += PREFETCH_USE_WINDOW;
+            pthread_cond_timedwait(&prefetch_cond, &prefetch_mutex, &wake);
+        }
+        pthread_mutex_unlock(&prefetch_mutex);
+
+        if (get_saint_state() == STATE_HEALTHY) run_job(job);
+
+        pthread_mutex_lock(&prefetch_mutex);
+        g_hash_table_remove(prefetch_queued, job->key);
+        pthread_mutex_unlock(&prefetch_mutex);
+        free(job->key);
+        free(job);
+    }
+    return NULL;
+}
+
+// Start the prefetcher threads. Files up to file_kb KB are fetched ahead of
+// opens; directory_callback warms a listing.
+void prefetch_init(stat_cache_t *cache, const char *cache_path, int threads, int file_kb,
+        prefetch_directory_callback directory_callback, void *userdata) {
+    int started = 0;
+
+    prefetch_cache = cache;
+    prefetch_cache_path = strdup(cache_path);
+    prefetch_file_size = (off_t) file_kb * 1024;
+    prefetch_directory = directory_callback;
+    prefetch_userdata = userdata;
+    prefetch_queue = g_queue_new();
+    prefetch_queued = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    prefetch_histories = g_hash_table_new_full(g_str_hash, g_str_equal, free, dir_history_free);
+    prefetch_tracked = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+
+    for (int idx = 0; idx < threads; idx++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, prefetch_worker, NULL)) {
+            log_print(LOG_ERR, SECTION_PREFETCH_DEFAULT, "prefetch_init: failed to start prefetcher %d", idx);
+            continue;
+        }
+        pthread_detach(thread);
+        ++started;
+    }
+    if (started == 0) {
+        log_print(LOG_ERR, SECTION_PREFETCH_DEFAULT, "prefetch_init: no prefetchers; prefetching is off");
+        return;
+    }
+
+    prefetch_running = true;
+    log_print(LOG_NOTICE, SECTION_PREFETCH_DEFAULT, "prefetch_init: %d prefetchers; files up to %d KB", started, file_kb);
+}
@@ -0,0 +1,34 @@
+#ifndef fooprefetchhfoo
+#define fooprefetchhfoo
+
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#include <glib.h>
+
+#include "statcache.h"
+
+// Brings the listing of the directory at path into the stat cache
+typedef void (*prefetch_directory_callback)(void *userdata, const char *path, GError **gerr);
+
+void prefetch_init(stat_cache_t *cache, const char *cache_path, int threads, int file_kb,
+        prefetch_directory_callback directory_callback, void *userdata);
+void prefetch_readdir(const char *path);
+void prefetch_open(const char *path);
+
+#endif
@@ -50,6 +50,7 @@ struct response_state {
     char path[PATH_MAX];
     unsigned long status_code;
     struct stat st;
+    char etag[STAT_ETAG_LEN];
 };
 
 struct element_state {
@@ -219,6 +220,13 @@ static void endElement(void *userData, const XML_Char *name) {
     else if (strcmp(name, "DAV:getcontentlength") == 0) {
         state->rstate.st.st_size = atol(state->estate.current_data);
     }
+    else if (strcmp(name, "DAV:getetag") == 0) {
+        // One too long to keep whole is dropped; a cut-down etag must never match
+        if (strlen(state->estate.current_data) < STAT_ETAG_LEN) {
+            strcpy(state->rstate.etag, state->estate.current_data);
+        }
+        log_print(LOG_DEBUG, SECTION_PROPS_DEFAULT, "DAV:getetag: %s", state->estate.current_data);
+    }
     else if (strcmp(name, "DAV:getlastmodified") == 0) {
         state->rstate.st.st_mtime = curl_getdate(state->estate.current_data, NULL);
         state->rstate.st.st_atime = state->rstate.st.st_mtime;
@@ -264,7 +272,8 @@ static void endElement(void *userData, const XML_Char *name) {
 
         log_print(LOG_DEBUG, SECTION_PROPS_DEFAULT, "endElement: Response for path: %s (code %lu, size, %lu)",
             state->rstate.path, state->rstate.status_code, state->rstate.st.st_size);
-        state->callback(state->userdata, state->rstate.path, state->rstate.st, state->rstate.status_code, &subgerr);
+        state->callback(state->userdata, state->rstate.path, state->rstate.st, state->rstate.etag,
+            state->rstate.status_code, &subgerr);
         if (subgerr) {
             // There's no mechanism to pass gerr back from endElement, so just print here
             log_print(LOG_ERR, SECTION_PROPS_DEFAULT, "endElement: Error from callback (%d : %s)",
@@ -516,7 +525,7 @@ int simple_propfind(const char *path, size_t depth, time_t last_updated, props_r
         // Tell the callback that the item is gone.
         log_print(LOG_INFO, SECTION_PROPS_DEFAULT, "%s: 410 response, 404.", funcname);
         memset(&state.rstate, 0, sizeof(struct response_state));
-        state.callback(state.userdata, path, state.rstate.st, 410, &subgerr);
+        state.callback(state.userdata, path, state.rstate.st, "", 410, &subgerr);
         if (subgerr) {
             g_propagate_prefixed_error(gerr, subgerr, "%s: ", funcname);
             goto finish;
@@ -25,7 +25,8 @@
 #define PROPFIND_DEPTH_ONE 1
 #define PROPFIND_DEPTH_INFINITY 2
 
-typedef void (*props_result_callback)(void *userdata, const char *href, struct stat st, unsigned long status_code, GError **gerr);
+typedef void (*props_result_callback)(void *userdata, const char *href, struct stat st, const char *etag,
+        unsigned long status_code, GError **gerr);
 int simple_propfind(const char *path, size_t depth, time_t last_updated, props_result_callback results, void *userdata, GError **gerr);
 bool use_readonly_mode(void);
 
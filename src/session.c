@@ -783,6 +783,33 @@ static void construct_resolve_slist(GHashTable *addr_table) {
     }
 }
 
+/* A resolve list naming just one of this thread's healthy nodes, the nth of
+ * them (wrapping around), so requests made side by side can each go to a
+ * different node. NULL if no node is known to be healthy; the caller then
+ * keeps the usual resolve_slist. Free with curl_slist_free_all.
+ */
+struct curl_slist *session_node_resolve(int n) {
+    GHashTableIter iter;
+    gpointer key, value;
+    const char *healthy[MAX_NODES];
+    int count = 0;
+
+    if (node_status.node_hash_table == NULL) return NULL;
+
+    g_hash_table_iter_init (&iter, node_status.node_hash_table);
+    while (count < MAX_NODES && g_hash_table_iter_next (&iter, &key, &value)) {
+        struct health_status_s *healthstatus = (struct health_status_s *)value;
+        if (healthstatus->score == HEALTHY && healthstatus->curladdr[0] != '\0') {
+            healthy[count++] = healthstatus->curladdr;
+        }
+    }
+    if (count == 0) return NULL;
+
+    log_print(LOG_DEBUG, SECTION_SESSION_DEFAULT, "session_node_resolve: %d of %d healthy: %s",
+        n % count, count, healthy[n % count]);
+    return curl_slist_append(NULL, healthy[n % count]);
+}
+
 /* For reference, keep the different sockaddr structs available for inspection
  *
  * struct addrinfo {
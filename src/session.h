@@ -33,6 +33,7 @@ bool process_status(const char *fcn_name, CURL *session, const CURLcode res,
 const char *get_base_url(void);
 char *escape_except_slashes(CURL *session, const char *path);
 void delete_tmp_session(CURL *session);
+struct curl_slist *session_node_resolve(int n);
 void aggregate_log_print_server(unsigned int log_level, unsigned int section, const char *name, time_t *previous_time,
     const char *description1, unsigned long *count1, unsigned long value1,
     const char *description2, long *count2, long value2);
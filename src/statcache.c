@@ -983,7 +983,17 @@ bool stat_cache_dir_has_child(stat_cache_t *cache, const char *path) {
     return has_children;
 }
 
-void stat_cache_delete_older(stat_cache_t *cache, const char *path_prefix, unsigned long minimum_local_generation, GError **gerr) {
+// Would stat_cache_enumerate list path without going to the server?
+bool stat_cache_children_fresh(stat_cache_t *cache, const char *path) {
+    time_t timestamp = stat_cache_read_updated_children(cache, path, NULL);
+
+    return timestamp > 0 && time(NULL) - timestamp <= CACHE_TIMEOUT;
+}
+
+// Entries older than minimum_local_generation are gone from the server, except
+// for the paths keep, if given, says are missing from it for some other reason
+void stat_cache_delete_older(stat_cache_t *cache, const char *path_prefix, unsigned long minimum_local_generation,
+        bool (*keep) (stat_cache_t *cache, const char *path), GError **gerr) {
     struct stat_cache_iterator *iter;
     struct stat_cache_entry *entry;
     GError *tmpgerr = NULL;
@@ -1002,7 +1012,8 @@ void stat_cache_delete_older(stat_cache_t *cache, const char *path_prefix, unsig
         if (entry->value->st.st_mode != 0) {
             log_print(LOG_DEBUG, SECTION_STATCACHE_CACHE, "stat_cache_delete_older: %s: min_gen %lu: loc_gen %lu",
                 entry->key, minimum_local_generation, entry->value->local_generation);
-            if (entry->value->local_generation < minimum_local_generation) {
+            if (entry->value->local_generation < minimum_local_generation &&
+                !(keep && keep(cache, key2path(entry->key)))) {
                 stat_cache_negative_set(&value);
                 stat_cache_value_set(cache, key2path(entry->key), &value, &tmpgerr);
                 if (tmpgerr) {
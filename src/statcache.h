@@ -25,7 +25,7 @@
 #include <errno.h>
 #include <stdbool.h>
 
-#define RGEN_LEN 128
+#define STAT_ETAG_LEN 128
 #define STAT_CACHE_OLD_DATA 2
 #define STAT_CACHE_NO_DATA 1
 
@@ -59,7 +59,7 @@ struct stat_cache_value {
     unsigned long local_generation;
     time_t updated;
     bool from_propfind; // A propfind caused this update
-    char remote_generation[RGEN_LEN];
+    char etag[STAT_ETAG_LEN]; // DAV:getetag as of that propfind; empty if none, or too long to keep
 };
 
 void stat_cache_print_stats(void);
@@ -82,12 +82,14 @@ time_t stat_cache_next_propfind(struct stat_cache_value value, const char *path)
 void stat_cache_from_propfind(struct stat_cache_value *value, bool bvalue);
 void stat_cache_delete(stat_cache_t *cache, const char* path, GError **gerr);
 void stat_cache_delete_parent(stat_cache_t *cache, const char *path, GError **gerr);
-void stat_cache_delete_older(stat_cache_t *cache, const char *key_prefix, unsigned long minimum_local_generation, GError **gerr);
+void stat_cache_delete_older(stat_cache_t *cache, const char *key_prefix, unsigned long minimum_local_generation,
+        bool (*keep) (stat_cache_t *cache, const char *path), GError **gerr);
 
 void stat_cache_walk(void);
 int stat_cache_enumerate(stat_cache_t *cache, const char *key_prefix, void (*f) (const char *path_prefix, 
             const char *filename, void *user), void *user, bool force);
 bool stat_cache_dir_has_child(stat_cache_t *cache, const char *path);
+bool stat_cache_children_fresh(stat_cache_t *cache, const char *path);
 void stat_cache_prune(stat_cache_t *cache, bool first);
 
 #endif
@@ -32,6 +32,7 @@
 #include "log_sections.h"
 #include "stats.h"
 #include "statcache.h"
+#include "filecache.h"
 
 #define MAX_LINE_LEN 256
 
@@ -79,8 +80,8 @@ static void malloc_stats_output(void *cbopaque, const char *s) {
 }
 
 #define STAT_PATH_SIZE 80
-// xxsm, xsm, sm, med, lg, xlg * 2 (one for get, one for put)
-#define latency_items 13
+// xxsm, xsm, sm, med, lg, xlg * 2 (one for get, one for put), plus split gets
+#define latency_items 14
 void dump_stats(bool log, const char *cache_path) {
     struct latency_s {
         unsigned long count;
@@ -89,6 +90,8 @@ void dump_stats(bool log, const char *cache_path) {
     };
     struct latency_s latency[latency_items];
     char str[MAX_LINE_LEN];
+    size_t ram_used;
+    unsigned ram_files;
     int fd = -1;
 
     log_print(LOG_DEBUG, SECTION_FUSEDAV_OUTPUT, "dump_stats: Enter %s :: logging -- %d", cache_path, log);
@@ -173,6 +176,8 @@ void dump_stats(bool log, const char *cache_path) {
     print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  getattr:          %u", FETCH(dav_getattr));
     print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  local_only:       %u", FETCH(dav_local_only));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  mkdir:            %u", FETCH(dav_mkdir));
     print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  mknod:            %u", FETCH(dav_mknod));
@@ -187,10 +192,14 @@ void dump_stats(bool log, const char *cache_path) {
     print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  rename:           %u", FETCH(dav_rename));
     print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  rename_unsent:    %u", FETCH(dav_rename_unsent));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  rmdir:            %u", FETCH(dav_rmdir));
     print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  unlink:           %u", FETCH(dav_unlink));
     print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  unlink_unsent:    %u", FETCH(dav_unlink_unsent));
+    print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  utimens:          %u", FETCH(dav_utimens));
     print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  write:            %u", FETCH(dav_write));
@@ -203,6 +212,42 @@ void dump_stats(bool log, const char *cache_path) {
     snprintf(str, MAX_LINE_LEN, "  nprop:            %u", FETCH(propfind_negative_cache));
     print_line(log, fd, LOG_NOTICE, SECTION_FUSEDAV_OUTPUT, str);
 
+    snprintf(str, MAX_LINE_LEN, "Prefetch:");
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    snprintf(str, MAX_LINE_LEN, "  queued:           %u", FETCH(prefetch_queued));
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    snprintf(str, MAX_LINE_LEN, "  dropped:          %u", FETCH(prefetch_dropped));
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    snprintf(str, MAX_LINE_LEN, "  directories:      %u", FETCH(prefetch_directories));
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    snprintf(str, MAX_LINE_LEN, "  files:            %u", FETCH(prefetch_files));
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    snprintf(str, MAX_LINE_LEN, "  failed:           %u", FETCH(prefetch_failed));
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    snprintf(str, MAX_LINE_LEN, "  used:             %u", FETCH(prefetch_used));
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    snprintf(str, MAX_LINE_LEN, "  wasted:           %u", FETCH(prefetch_wasted));
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    // Of the prefetches which have been decided either way
+    if (FETCH(prefetch_used) + FETCH(prefetch_wasted) > 0) {
+        snprintf(str, MAX_LINE_LEN, "  accuracy:         %u%%",
+            (FETCH(prefetch_used) * 100) / (FETCH(prefetch_used) + FETCH(prefetch_wasted)));
+        print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    }
+
+    snprintf(str, MAX_LINE_LEN, "Warming:");
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    snprintf(str, MAX_LINE_LEN, "  directories:      %u", FETCH(warm_directories));
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    snprintf(str, MAX_LINE_LEN, "  files:            %u", FETCH(warm_files));
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    snprintf(str, MAX_LINE_LEN, "  kb:               %u", FETCH(warm_kb));
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    snprintf(str, MAX_LINE_LEN, "  skipped:          %u", FETCH(warm_skipped));
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+    snprintf(str, MAX_LINE_LEN, "  failed:           %u", FETCH(warm_failed));
+    print_line(log, fd, LOG_NOTICE, SECTION_PREFETCH_DEFAULT, str);
+
 
     snprintf(str, MAX_LINE_LEN, "  cache_file:       %u", FETCH(filecache_cache_file));
     print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
@@ -248,6 +293,116 @@ void dump_stats(bool log, const char *cache_path) {
     print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
     snprintf(str, MAX_LINE_LEN, "  key2path:         %u", FETCH(filecache_key2path));
     print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  pdata_hit:        %u", FETCH(filecache_pdata_hit));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  pdata_deferred:   %u", FETCH(filecache_pdata_deferred));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  open_reuse:       %u", FETCH(filecache_open_reuse));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  inline_store:     %u", FETCH(filecache_inline_store));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  inline_open:      %u", FETCH(filecache_inline_open));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  inline_spill:     %u", FETCH(filecache_inline_spill));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  get_coalesced:    %u", FETCH(filecache_get_coalesced));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  writeback_depth:  %u", FETCH(filecache_writeback_depth));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  writeback_queued: %u", FETCH(filecache_writeback_queued));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  writeback_uploaded: %u", FETCH(filecache_writeback_uploaded));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  writeback_retries: %u", FETCH(filecache_writeback_retries));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  writeback_failed: %u", FETCH(filecache_writeback_failed));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    if (FETCH(filecache_writeback_uploaded) > 0) {
+        snprintf(str, MAX_LINE_LEN, "  writeback_lag_avg: %u s",
+            FETCH(filecache_writeback_lag) / FETCH(filecache_writeback_uploaded));
+        print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    }
+    snprintf(str, MAX_LINE_LEN, "  lock_write_waits: %u (%u ms)", FETCH(filecache_lock_write_waits), FETCH(filecache_lock_write_wait_ms));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  lock_upload_waits: %u (%u ms)", FETCH(filecache_lock_upload_waits), FETCH(filecache_lock_upload_wait_ms));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  lock_timeouts:    %u", FETCH(filecache_lock_timeouts));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  snapshot_reflink: %u", FETCH(filecache_snapshot_reflink));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  snapshot_copy:    %u", FETCH(filecache_snapshot_copy));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  snapshot_none:    %u", FETCH(filecache_snapshot_none));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  upload_chunks:    %u", FETCH(filecache_upload_chunks));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  upload_resumed:   %u", FETCH(filecache_upload_resumed));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  pipeline_started: %u", FETCH(filecache_pipeline_started));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  pipeline_done:    %u", FETCH(filecache_pipeline_completed));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  pipeline_abandon: %u", FETCH(filecache_pipeline_abandoned));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  pipeline_failed:  %u", FETCH(filecache_pipeline_failed));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  put_unchanged:    %u", FETCH(filecache_put_unchanged));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  put_local_only:   %u", FETCH(filecache_put_local_only));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  put_append:       %u", FETCH(filecache_put_append));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  append_refused:   %u", FETCH(filecache_put_append_refused));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  publish:          %u", FETCH(filecache_publish));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  get_ranges:       %u", FETCH(filecache_get_parallel_ranges));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  get_split_failed: %u", FETCH(filecache_get_parallel_fallback));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  get_writes:       %u", FETCH(filecache_get_body_writes));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  get_prealloc:     %u", FETCH(filecache_get_preallocated));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  get_direct:       %u", FETCH(filecache_direct_downloads));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  uring_writes:     %u", FETCH(filecache_uring_writes));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  uring_unlinks:    %u", FETCH(filecache_uring_unlinks));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  uring_fallbacks:  %u", FETCH(filecache_uring_fallbacks));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  ram_hits:         %u", FETCH(filecache_ram_hits));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  ram_misses:       %u", FETCH(filecache_ram_misses));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    // Of the read-only opens while the tier is on
+    if (FETCH(filecache_ram_hits) + FETCH(filecache_ram_misses) > 0) {
+        snprintf(str, MAX_LINE_LEN, "  ram_hit_rate:     %u%%",
+            (FETCH(filecache_ram_hits) * 100) / (FETCH(filecache_ram_hits) + FETCH(filecache_ram_misses)));
+        print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    }
+    snprintf(str, MAX_LINE_LEN, "  ram_admitted:     %u", FETCH(filecache_ram_admitted));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  ram_evicted:      %u", FETCH(filecache_ram_evicted));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  ram_invalidated:  %u", FETCH(filecache_ram_invalidated));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    ram_used = filecache_ram_tier_used(&ram_files);
+    snprintf(str, MAX_LINE_LEN, "  ram_used_kb:      %lu (%u files)", (unsigned long) (ram_used / 1024), ram_files);
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  fadv_sequential:  %u", FETCH(filecache_fadvise_sequential));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  fadv_dontneed:    %u", FETCH(filecache_fadvise_dontneed));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  etag_confirmed:   %u", FETCH(filecache_get_etag_confirmed));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  stale_served:     %u", FETCH(filecache_stale_served));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  stale_checked:    %u", FETCH(filecache_stale_revalidated));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
+    snprintf(str, MAX_LINE_LEN, "  stale_failed:     %u", FETCH(filecache_stale_failed));
+    print_line(log, fd, LOG_NOTICE, SECTION_FILECACHE_OUTPUT, str);
 
     latency[0].count = FETCH(filecache_get_304_count);
     latency[1].count = FETCH(filecache_get_xxsm_count);
@@ -262,6 +417,7 @@ void dump_stats(bool log, const char *cache_path) {
     latency[10].count = FETCH(filecache_put_med_count);
     latency[11].count = FETCH(filecache_put_lg_count);
     latency[12].count = FETCH(filecache_put_xlg_count);
+    latency[13].count = FETCH(filecache_get_parallel_count);
     latency[0].timing = FETCH(filecache_get_304_count);
     latency[1].timing = FETCH(filecache_get_xxsm_timing);
     latency[2].timing = FETCH(filecache_get_xsm_timing);
@@ -275,6 +431,7 @@ void dump_stats(bool log, const char *cache_path) {
     latency[10].timing = FETCH(filecache_put_med_timing);
     latency[11].timing = FETCH(filecache_put_lg_timing);
     latency[12].timing = FETCH(filecache_put_xlg_timing);
+    latency[13].timing = FETCH(filecache_get_parallel_timing);
     latency[0].name = "get_304";
     latency[1].name = "get_xxsm";
     latency[2].name = "get_xsm";
@@ -288,6 +445,7 @@ void dump_stats(bool log, const char *cache_path) {
     latency[10].name = "put_med";
     latency[11].name = "put_lg";
     latency[12].name = "put_xlg";
+    latency[13].name = "get_split";
 
     // Since the names are of variable lengths, the values don't line up.
     // Figure out a way to align
@@ -30,6 +30,7 @@ struct statistics {
     unsigned dav_ftruncate;
     unsigned dav_fgetattr;
     unsigned dav_getattr;
+    unsigned dav_local_only;
     unsigned dav_mkdir;
     unsigned dav_mknod;
     unsigned dav_open;
@@ -37,8 +38,10 @@ struct statistics {
     unsigned dav_readdir;
     unsigned dav_release;
     unsigned dav_rename;
+    unsigned dav_rename_unsent;
     unsigned dav_rmdir;
     unsigned dav_unlink;
+    unsigned dav_unlink_unsent;
     unsigned dav_utimens;
     unsigned dav_write;
 
@@ -46,6 +49,20 @@ struct statistics {
     unsigned propfind_progressive_cache;
     unsigned propfind_complete_cache;
 
+    unsigned prefetch_queued;
+    unsigned prefetch_dropped;
+    unsigned prefetch_directories;
+    unsigned prefetch_files;
+    unsigned prefetch_failed;
+    unsigned prefetch_used;
+    unsigned prefetch_wasted;
+
+    unsigned warm_directories;
+    unsigned warm_files;
+    unsigned warm_kb;
+    unsigned warm_skipped;
+    unsigned warm_failed;
+
     unsigned filecache_cache_file;
     unsigned filecache_pdata_set;
     unsigned filecache_create_file;
@@ -68,7 +85,58 @@ struct statistics {
     unsigned filecache_init;
     unsigned filecache_path2key;
     unsigned filecache_key2path;
+    unsigned filecache_pdata_hit;
+    unsigned filecache_pdata_deferred;
+    unsigned filecache_open_reuse;
+    unsigned filecache_inline_store;
+    unsigned filecache_inline_open;
+    unsigned filecache_inline_spill;
     unsigned filecache_get_304_count;
+    unsigned filecache_get_coalesced;
+    unsigned filecache_writeback_depth;
+    unsigned filecache_writeback_queued;
+    unsigned filecache_writeback_uploaded;
+    unsigned filecache_writeback_retries;
+    unsigned filecache_writeback_failed;
+    unsigned filecache_writeback_lag;
+    unsigned filecache_lock_write_waits;
+    unsigned filecache_lock_write_wait_ms;
+    unsigned filecache_lock_upload_waits;
+    unsigned filecache_lock_upload_wait_ms;
+    unsigned filecache_lock_timeouts;
+    unsigned filecache_snapshot_reflink;
+    unsigned filecache_snapshot_copy;
+    unsigned filecache_snapshot_none;
+    unsigned filecache_upload_chunks;
+    unsigned filecache_upload_resumed;
+    unsigned filecache_pipeline_started;
+    unsigned filecache_pipeline_completed;
+    unsigned filecache_pipeline_abandoned;
+    unsigned filecache_pipeline_failed;
+    unsigned filecache_put_unchanged;
+    unsigned filecache_put_local_only;
+    unsigned filecache_put_append;
+    unsigned filecache_put_append_refused;
+    unsigned filecache_publish;
+    unsigned filecache_get_parallel_ranges;
+    unsigned filecache_get_parallel_fallback;
+    unsigned filecache_get_body_writes;
+    unsigned filecache_get_preallocated;
+    unsigned filecache_direct_downloads;
+    unsigned filecache_uring_writes;
+    unsigned filecache_uring_unlinks;
+    unsigned filecache_uring_fallbacks;
+    unsigned filecache_ram_hits;
+    unsigned filecache_ram_misses;
+    unsigned filecache_ram_admitted;
+    unsigned filecache_ram_evicted;
+    unsigned filecache_ram_invalidated;
+    unsigned filecache_fadvise_sequential;
+    unsigned filecache_fadvise_dontneed;
+    unsigned filecache_get_etag_confirmed;
+    unsigned filecache_stale_served;
+    unsigned filecache_stale_revalidated;
+    unsigned filecache_stale_failed;
     unsigned filecache_get_xxsm_timing;
     unsigned filecache_get_xxsm_count;
     unsigned filecache_get_xsm_timing;
@@ -81,6 +149,8 @@ struct statistics {
     unsigned filecache_get_lg_count;
     unsigned filecache_get_xlg_timing;
     unsigned filecache_get_xlg_count;
+    unsigned filecache_get_parallel_timing;
+    unsigned filecache_get_parallel_count;
     unsigned filecache_put_xxsm_timing;
     unsigned filecache_put_xxsm_count;
     unsigned filecache_put_xsm_timing;
@@ -119,6 +189,7 @@ extern struct statistics stats;
 
 #define TIMING(op, timing) __sync_fetch_and_add(&stats.op, (timing))
 #define BUMP(op) __sync_fetch_and_add(&stats.op, 1)
+#define DROP(op) __sync_fetch_and_sub(&stats.op, 1)
 #define FETCH(c) __sync_fetch_and_or(&stats.c, 0)
 #define CLEAR(c) __sync_fetch_and_and(&stats.c, 0)
 
@@ -22,9 +22,13 @@
 
 #include <stdbool.h>
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include "util.h"
 #include "log.h"
@@ -59,6 +63,30 @@ char *path_parent(const char *uri) {
     return strndup(uri, (pnt - uri) + 1);
 }
 
+// Return value is allocated and must be freed.
+char *path_child(const char *dir, const char *name) {
+    char *path = NULL;
+
+    asprintf(&path, "%s/%s", strcmp(dir, "/") ? dir : "", name);
+    return path;
+}
+
+// A stat_cache_enumerate callback; user is a struct child_names
+void child_names_collect(__unused const char *path_prefix, const char *filename, void *user) {
+    struct child_names *children = user;
+
+    if (filename[0] == '\0') return;
+    if (children->max > 0 && children->names->len >= children->max) return;
+    g_ptr_array_add(children->names, strdup(filename));
+}
+
+// Lower the priority of the calling thread alone, so the foreground's requests go first
+void thread_nice(int nice, const char *caller) {
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice)) {
+        log_print(LOG_NOTICE, SECTION_UTIL_DEFAULT, "%s: setpriority failed: %s", caller, strerror(errno));
+    }
+}
+
 #if INJECT_ERRORS
 
 /* To invoke the inject error mechanism:
@@ -273,9 +301,11 @@ static void filecache_forensic_haven_test(void) {
         {filecache_error_etagcurl1, "filecache_error_etagcurl1"},
         {filecache_error_etagcurl2, "filecache_error_etagcurl2"},
         {filecache_error_etagflock2, "filecache_error_etagflock2"},
+        {filecache_error_putsession, "filecache_error_putsession"},
         {filecache_error_syncsdata, "filecache_error_syncsdata"},
         {filecache_error_syncpdata, "filecache_error_syncpdata"},
         {filecache_error_synclseek, "filecache_error_synclseek"},
+        {filecache_error_syncfdatasync, "filecache_error_syncfdatasync"},
         {filecache_error_deleteldb, "filecache_error_deleteldb"},
         {-1, ""}, // sentinel
     };
@@ -29,6 +29,16 @@
 #include <stdbool.h>
 
 char *path_parent(const char *uri);
+char *path_child(const char *dir, const char *name);
+
+// Collects the names stat_cache_enumerate lists for a directory; each must be freed
+struct child_names {
+    GPtrArray *names;
+    unsigned max; // 0 for no limit
+};
+void child_names_collect(const char *path_prefix, const char *filename, void *user);
+
+void thread_nice(int nice, const char *caller);
 
 // For GError
 #ifndef G_DEFINE_QUARK
@@ -107,6 +117,8 @@ void *inject_error_mechanism(void *ptr);
 #define filecache_error_movepdata 64
 #define filecache_error_orphanopendir 65
 #define filecache_error_enhanced_logging 66
+#define filecache_error_putsession 67
+#define filecache_error_syncfdatasync 68
 
 #define statcache_error_cachepath 70
 #define statcache_error_openldb 71
@@ -0,0 +1,554 @@
+/***
+  This file is part of fusedav.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "warm.h"
+#include "filecache.h"
+#include "session.h"
+#include "log.h"
+#include "log_sections.h"
+#include "stats.h"
+#include "util.h"
+
+/* Warming the caches from a manifest.
+ *
+ * Before a failover or a deploy, a new instance can be given the listings
+ * and files the old one was serving, so it doesn't take its first requests
+ * cold. The manifest is a text file, one entry a line:
+ *
+ *   # comment
+ *   max_bytes 500M         stop fetching files once this much is brought in
+ *   /sites/default/        a directory: its whole subtree
+ *   /index.php             a single file
+ *   /static/app.*.css      a glob: the files under /static it matches; as in
+ *                          stale_while_revalidate, '*' also matches '/'
+ *
+ * The watcher runs the manifest at startup and again whenever it changes, so
+ * writing a new one (best by rename) is how a running instance is told to
+ * warm up. Listings come in through the same PROPFINDs as a readdir, files
+ * through the same GETs as an open, from WARM_THREADS_MAX threads at most.
+ * To leave the server and the foreground their share, the warmer threads
+ * are niced, all of them together make at most rate requests a second, and
+ * they wait out any time not spent in the healthy state. Directories which
+ * are already fresh in the stat cache and files which are already fresh in
+ * the file cache cost nothing. Progress goes to the log every
+ * WARM_REPORT_INTERVAL seconds, and to manifest.status.
+ */
+
+#define WARM_THREADS_MAX 16
+#define WARM_POLL 5 // seconds between looks at the manifest
+#define WARM_REPORT_INTERVAL 10 // seconds
+#define WARM_NICE 10
+
+enum warm_kind {
+    WARM_ANY, // a manifest path; a directory or a file
+    WARM_DIRECTORY,
+    WARM_FILE
+};
+
+struct warm_entry {
+    char *base; // where the walk starts
+    GPatternSpec *spec; // files to fetch; NULL for all
+};
+
+struct warm_item {
+    enum warm_kind kind;
+    char *path;
+    const struct warm_entry *entry;
+};
+
+// What a run of the manifest has done
+struct warm_progress {
+    unsigned directories;
+    unsigned files;
+    unsigned skipped; // files over max_bytes
+    unsigned failed;
+    off_t bytes;
+};
+
+static stat_cache_t *warm_cache = NULL;
+static char *warm_cache_path = NULL;
+static char *warm_manifest = NULL;
+static int warm_threads = 0;
+static int warm_rate = 0;
+static prefetch_directory_callback warm_directory = NULL;
+static void *warm_userdata = NULL;
+
+// Protected by warm_mutex. One run at a time: the watcher fills the queue and
+// waits for it to drain and for busy to come back to zero. visited holds the
+// directories queued during the run, so overlapping entries are walked once.
+static GQueue *warm_queue = NULL;
+static GHashTable *warm_visited = NULL;
+static unsigned warm_busy = 0;
+static off_t warm_max_bytes = 0; // 0 for no limit
+static struct warm_progress warm_progress;
+static pthread_mutex_t warm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t warm_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t warm_done_cond = PTHREAD_COND_INITIALIZER;
+
+// When the next request may be made; protected by warm_rate_mutex
+static struct timespec warm_next_slot = {0, 0};
+static pthread_mutex_t warm_rate_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void warm_entry_free(void *ptr) {
+    struct warm_entry *entry = ptr;
+
+    if (entry->spec) g_pattern_spec_free(entry->spec);
+    free(entry->base);
+    free(entry);
+}
+
+// Queue an item. Caller holds warm_mutex
+static void item_push(enum warm_kind kind, const char *path, const struct warm_entry *entry) {
+    struct warm_item *item;
+
+    if (kind == WARM_DIRECTORY) {
+        if (g_hash_table_lookup(warm_visited, path)) return;
+        g_hash_table_insert(warm_visited, strdup(path), GINT_TO_POINTER(1));
+    }
+    item = malloc(sizeof(struct warm_item));
+    if (item == NULL) return;
+    item->kind = kind;
+    item->path = strdup(path);
+    item->entry = entry;
+    g_queue_push_tail(warm_queue, item);
+    pthread_cond_signal(&warm_cond);
+}
+
+// Wait for the foreground to be healthy and for a slot under the request rate
+static void throttle(void) {
+    struct timespec now;
+    struct timespec slot;
+
+    while (get_saint_state() != STATE_HEALTHY) {
+        sleep(1);
+    }
+    if (warm_rate <= 0) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&warm_rate_mutex);
+    if (warm_next_slot.tv_sec < now.tv_sec ||
+        (warm_next_slot.tv_sec == now.tv_sec && warm_next_slot.tv_nsec < now.tv_nsec)) {
+        warm_next_slot = now;
+    }
+    slot = warm_next_slot;
+    warm_next_slot.tv_nsec += 1000000000L / warm_rate;
+    warm_next_slot.tv_sec += warm_next_slot.tv_nsec / 1000000000L;
+    warm_next_slot.tv_nsec %= 1000000000L;
+    pthread_mutex_unlock(&warm_rate_mutex);
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &slot, NULL);
+}
+
+static void warm_dir(const char *path, const struct warm_entry *entry) {
+    GPtrArray *names = g_ptr_array_new();
+    GPtrArray *dirs;
+    GPtrArray *files;
+    struct child_names children = {names, 0};
+    GError *gerr = NULL;
+
+    if (!stat_cache_children_fresh(warm_cache, path)) {
+        throttle();
+        warm_directory(warm_userdata, path, &gerr);
+        if (gerr) {
+            log_print(LOG_INFO, SECTION_PREFETCH_DEFAULT, "warm_dir: %s: %s", path, gerr->message);
+            BUMP(warm_failed);
+            pthread_mutex_lock(&warm_mutex);
+            ++warm_progress.failed;
+            pthread_mutex_unlock(&warm_mutex);
+            g_clear_error(&gerr);
+            g_ptr_array_free(names, true);
+            return;
+        }
+    }
+    BUMP(warm_directories);
+
+    stat_cache_enumerate(warm_cache, path, child_names_collect, &children, true);
+
+    // Sort the children out before taking warm_mutex, so the stat cache reads
+    // hold up neither the other warmers nor the progress report
+    dirs = g_ptr_array_new();
+    files = g_ptr_array_new();
+    for (unsigned idx = 0; idx < names->len; idx++) {
+        char *child = path_child(path, g_ptr_array_index(names, idx));
+        struct stat_cache_value *value = stat_cache_value_get(warm_cache, child, true, NULL);
+        if (value && S_ISDIR(value->st.st_mode)) {
+            g_ptr_array_add(dirs, child);
+        }
+        else if (value && S_ISREG(value->st.st_mode) &&
+                (entry->spec == NULL || g_pattern_match_string(entry->spec, child))) {
+            g_ptr_array_add(files, child);
+        }
+        else {
+            free(child);
+        }
+        free(value);
+        free(g_ptr_array_index(names, idx));
+    }
+
+    pthread_mutex_lock(&warm_mutex);
+    ++warm_progress.directories;
+    for (unsigned idx = 0; idx < dirs->len; idx++) {
+        item_push(WARM_DIRECTORY, g_ptr_array_index(dirs, idx), entry);
+    }
+    for (unsigned idx = 0; idx < files->len; idx++) {
+        item_push(WARM_FILE, g_ptr_array_index(files, idx), entry);
+    }
+    pthread_mutex_unlock(&warm_mutex);
+
+    for (unsigned idx = 0; idx < dirs->len; idx++) free(g_ptr_array_index(dirs, idx));
+    for (unsigned idx = 0; idx < files->len; idx++) free(g_ptr_array_index(files, idx));
+    g_ptr_array_free(names, true);
+    g_ptr_array_free(dirs, true);
+    g_ptr_array_free(files, true);
+}
+
+static void warm_file(const char *path) {
+    struct stat_cache_value *value;
+    GError *gerr = NULL;
+    off_t size = 0;
+    bool fetched;
+
+    value = stat_cache_value_get(warm_cache, path, true, NULL);
+    if (value) size = value->st.st_size;
+    free(value);
+
+    // Take the bytes out of the budget up front, so the threads don't overrun it together
+    pthread_mutex_lock(&warm_mutex);
+    if (warm_max_bytes > 0 && warm_progress.bytes + size > warm_max_bytes) {
+        ++warm_progress.skipped;
+        pthread_mutex_unlock(&warm_mutex);
+        BUMP(warm_skipped);
+        return;
+    }
+    warm_progress.bytes += size;
+    pthread_mutex_unlock(&warm_mutex);
+
+    throttle();
+    fetched = filecache_prefetch(warm_cache, warm_cache_path, path, &gerr);
+
+    pthread_mutex_lock(&warm_mutex);
+    if (gerr) {
+        log_print(LOG_INFO, SECTION_PREFETCH_DEFAULT, "warm_file: %s: %s", path, gerr->message);
+        ++warm_progress.failed;
+        BUMP(warm_failed);
+        g_clear_error(&gerr);
+    }
+    else {
+        ++warm_progress.files;
+        BUMP(warm_files);
+    }
+    // Only what was brought in counts against the budget
+    if (fetched) TIMING(warm_kb, size / 1024);
+    else warm_progress.bytes -= size;
+    pthread_mutex_unlock(&warm_mutex);
+}
+
+// A path from the manifest; find out what it is from its parent's listing
+static void warm_any(const char *path, const struct warm_entry *entry) {
+    struct stat_cache_value *value;
+
+    value = stat_cache_value_get(warm_cache, path, true, NULL);
+    if (value == NULL && strcmp(path, "/")) {
+        const char *slash = strrchr(path, '/');
+        char *parent = (slash == path) ? strdup("/") : strndup(path, slash - path);
+        GError *gerr = NULL;
+
+        if (!stat_cache_children_fresh(warm_cache, parent)) {
+            throttle();
+            warm_directory(warm_userdata, parent, &gerr);
+            if (gerr) {
+                log_print(LOG_INFO, SECTION_PREFETCH_DEFAULT, "warm_any: %s: %s", parent, gerr->message);
+                g_clear_error(&gerr);
+            }
+        }
+        free(parent);
+        value = stat_cache_value_get(warm_cache, path, true, NULL);
+    }
+
+    pthread_mutex_lock(&warm_mutex);
+    if (strcmp(path, "/") == 0 || (value && S_ISDIR(value->st.st_mode))) {
+        item_push(WARM_DIRECTORY, path, entry);
+    }
+    else if (value && S_ISREG(value->st.st_mode)) {
+        item_push(WARM_FILE, path, entry);
+    }
+    else {
+        log_print(LOG_NOTICE, SECTION_PREFETCH_DEFAULT, "warm_any: %s: not found", path);
+        ++warm_progress.failed;
+        BUMP(warm_failed);
+    }
+    pthread_mutex_unlock(&warm_mutex);
+    free(value);
+}
+
+static void *warm_worker(__unused void *ptr) {
+    thread_nice(WARM_NICE, "warm_worker");
+
+    while (true) {
+        struct warm_item *item;
+
+        pthread_mutex_lock(&warm_mutex);
+        while ((item = g_queue_pop_head(warm_queue)) == NULL) {
+            pthread_cond_wait(&warm_cond, &warm_mutex);
+        }
+        ++warm_busy;
+        pthread_mutex_unlock(&warm_mutex);
+
+        switch (item->kind) {
+        case WARM_ANY:
+            warm_any(item->path, item->entry);
+            break;
+        case WARM_DIRECTORY:
+            warm_dir(item->path, item->entry);
+            break;
+        case WARM_FILE:
+            warm_file(item->path);
+            break;
+        }
+
+        pthread_mutex_lock(&warm_mutex);
+        --warm_busy;
+        if (warm_busy == 0 && g_queue_is_empty(warm_queue)) pthread_cond_broadcast(&warm_done_cond);
+        pthread_mutex_unlock(&warm_mutex);
+        free(item->path);
+        free(item);
+    }
+    return NULL;
+}
+
+// Accepts a plain number of bytes or one ending in K, M or G. Returns -1 if unparseable
+static off_t parse_size(const char *str) {
+    char *end;
+    long long size = strtoll(str, &end, 10);
+
+    if (end == str || size < 0) return -1;
+    switch (*end) {
+    case 'K': case 'k': size *= 1024; ++end; break;
+    case 'M': case 'm': size *= 1024 * 1024; ++end; break;
+    case 'G': case 'g': size *= 1024 * 1024 * 1024; ++end; break;
+    }
+    if (*end != '\0') return -1;
+    return (off_t) size;
+}
+
+// Parse the manifest into entries; sets *max_bytes if it names a limit
+static GPtrArray *manifest_read(off_t *max_bytes, GError **gerr) {
+    GPtrArray *entries = NULL;
+    char *contents = NULL;
+    char **lines = NULL;
+    GError *tmpgerr = NULL;
+
+    if (!g_file_get_contents(warm_manifest, &contents, NULL, &tmpgerr)) {
+        g_propagate_prefixed_error(gerr, tmpgerr, "manifest_read: ");
+        return NULL;
+    }
+
+    entries = g_ptr_array_new_with_free_func(warm_entry_free);
+    lines = g_strsplit(contents, "\n", -1);
+    for (int idx = 0; lines[idx]; idx++) {
+        char *line = g_strstrip(lines[idx]);
+        struct warm_entry *entry;
+        size_t len;
+
+        if (line[0] == '\0' || line[0] == '#') continue;
+
+        if (strncmp(line, "max_bytes", strlen("max_bytes")) == 0) {
+            off_t size = parse_size(g_strchug(line + strlen("max_bytes")));
+            if (size < 0) {
+                log_print(LOG_WARNING, SECTION_PREFETCH_DEFAULT, "manifest_read: bad size on line %d: %s", idx + 1, line);
+            }
+            else {
+                *max_bytes = size;
+            }
+            continue;
+        }
+
+        if (line[0] != '/') {
+            log_print(LOG_WARNING, SECTION_PREFETCH_DEFAULT, "manifest_read: ignoring line %d: %s", idx + 1, line);
+            continue;
+        }
+
+        entry = calloc(1, sizeof(struct warm_entry));
+        if (entry == NULL) continue;
+        if (strpbrk(line, "*?")) {
+            // Walk from the last directory before the first wildcard
+            char *slash;
+            entry->spec = g_pattern_spec_new(line);
+            entry->base = strndup(line, strpbrk(line, "*?") - line);
+            slash = strrchr(entry->base, '/');
+            if (slash == entry->base) slash[1] = '\0';
+            else *slash = '\0';
+        }
+        else {
+            entry->base = strdup(line);
+            len = strlen(entry->base);
+            if (len > 1 && entry->base[len - 1] == '/') entry->base[len - 1] = '\0';
+        }
+        g_ptr_array_add(entries, entry);
+    }
+
+    g_strfreev(lines);
+    g_free(contents);
+    return entries;
+}
+
+// Rewrite manifest.status for whoever is waiting on the run. Caller holds warm_mutex
+static void status_write(const char *state, time_t started) {
+    char *status_path = NULL;
+    char *status = NULL;
+    GError *gerr = NULL;
+
+    asprintf(&status_path, "%s.status", warm_manifest);
+    asprintf(&status, "state %s\nseconds %lu\ndirectories %u\nfiles %u\nbytes %lld\nskipped %u\nfailed %u\n",
+        state, (unsigned long) (time(NULL) - started), warm_progress.directories, warm_progress.files,
+        (long long) warm_progress.bytes, warm_progress.skipped, warm_progress.failed);
+    // g_file_set_contents writes a temporary file and renames it, so readers never see half
+    if (status_path && status && !g_file_set_contents(status_path, status, -1, &gerr)) {
+        log_print(LOG_WARNING, SECTION_PREFETCH_DEFAULT, "status_write: %s", gerr->message);
+        g_clear_error(&gerr);
+    }
+    free(status);
+    free(status_path);
+}
+
+static void manifest_run(void) {
+    GPtrArray *entries;
+    GError *gerr = NULL;
+    time_t started = time(NULL);
+    time_t last_report = started;
+    off_t max_bytes = 0;
+
+    entries = manifest_read(&max_bytes, &gerr);
+    if (gerr) {
+        log_print(LOG_ERR, SECTION_PREFETCH_DEFAULT, "manifest_run: %s", gerr->message);
+        g_clear_error(&gerr);
+        return;
+    }
+
+    log_print(LOG_NOTICE, SECTION_PREFETCH_DEFAULT, "manifest_run: warming %u entries from %s; max_bytes %lld",
+        entries->len, warm_manifest, (long long) max_bytes);
+
+    pthread_mutex_lock(&warm_mutex);
+    memset(&warm_progress, 0, sizeof(struct warm_progress));
+    warm_max_bytes = max_bytes;
+    warm_visited = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+    for (unsigned idx = 0; idx < entries->len; idx++) {
+        struct warm_entry *entry = g_ptr_array_index(entries, idx);
+        // A glob's base is always a directory
+        item_push(entry->spec ? WARM_DIRECTORY : WARM_ANY, entry->base, entry);
+    }
+    status_write("running", started);
+
+    while (warm_busy > 0 || !g_queue_is_empty(warm_queue)) {
+        struct timespec wake;
+
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += 1;
+        pthread_cond_timedwait(&warm_done_cond, &warm_mutex, &wake);
+
+        if (time(NULL) - last_report >= WARM_REPORT_INTERVAL) {
+            last_report = time(NULL);
+            log_print(LOG_NOTICE, SECTION_PREFETCH_DEFAULT,
+                "manifest_run: %u directories, %u files, %lld bytes, %u skipped, %u failed; %u queued",
+                warm_progress.directories, warm_progress.files, (long long) warm_progress.bytes,
+                warm_progress.skipped, warm_progress.failed, g_queue_get_length(warm_queue));
+            status_write("running", started);
+        }
+    }
+
+    status_write("done", started);
+    log_print(LOG_NOTICE, SECTION_PREFETCH_DEFAULT,
+        "manifest_run: done in %lu seconds: %u directories, %u files, %lld bytes, %u skipped, %u failed",
+        (unsigned long) (time(NULL) - started), warm_progress.directories, warm_progress.files,
+        (long long) warm_progress.bytes, warm_progress.skipped, warm_progress.failed);
+    g_hash_table_destroy(warm_visited);
+    warm_visited = NULL;
+    pthread_mutex_unlock(&warm_mutex);
+
+    g_ptr_array_free(entries, true);
+}
+
+static void *warm_watcher(__unused void *ptr) {
+    time_t last_mtime = 0;
+    off_t last_size = -1;
+
+    while (true) {
+        struct stat st;
+
+        if (stat(warm_manifest, &st) == 0 && (st.st_mtime != last_mtime || st.st_size != last_size)) {
+            last_mtime = st.st_mtime;
+            last_size = st.st_size;
+            manifest_run();
+        }
+        sleep(WARM_POLL);
+    }
+    return NULL;
+}
+
+// Start the warmer threads and the watcher over manifest. At most rate
+// requests a second, or no limit if 0; directory_callback warms a listing.
+void warm_init(stat_cache_t *cache, const char *cache_path, const char *manifest, int threads, int rate,
+        prefetch_directory_callback directory_callback, void *userdata) {
+    pthread_t thread;
+    int started = 0;
+
+    warm_cache = cache;
+    warm_cache_path = strdup(cache_path);
+    warm_manifest = strdup(manifest);
+    warm_rate = rate;
+    warm_directory = directory_callback;
+    warm_userdata = userdata;
+    warm_queue = g_queue_new();
+
+    if (threads < 1) threads = 1;
+    if (threads > WARM_THREADS_MAX) threads = WARM_THREADS_MAX;
+    for (int idx = 0; idx < threads; idx++) {
+        if (pthread_create(&thread, NULL, warm_worker, NULL)) {
+            log_print(LOG_ERR, SECTION_PREFETCH_DEFAULT, "warm_init: failed to start warmer %d", idx);
+            continue;
+        }
+        pthread_detach(thread);
+        ++started;
+    }
+    if (started == 0) {
+        log_print(LOG_ERR, SECTION_PREFETCH_DEFAULT, "warm_init: no warmers; warming is off");
+        return;
+    }
+    warm_threads = started;
+
+    if (pthread_create(&thread, NULL, warm_watcher, NULL)) {
+        log_print(LOG_ERR, SECTION_PREFETCH_DEFAULT, "warm_init: failed to start the watcher; warming is off");
+        return;
+    }
+    pthread_detach(thread);
+
+    log_print(LOG_NOTICE, SECTION_PREFETCH_DEFAULT, "warm_init: %d warmers over %s; %d requests a second",
+        warm_threads, warm_manifest, warm_rate);
+}
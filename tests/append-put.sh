@@ -0,0 +1,118 @@
+#! /bin/bash
+
+set +e
+
+usage()
+{
+cat << EOF
+usage: $0 options
+
+This script tests append uploads. It runs range-put-server.py as a
+stand-in fileserver, mounts fusedav against it with append_put=true,
+writes a log file, and then appends to it a line at a time, closing it
+after each. Every append should go to the server as just the new tail, a
+write into the middle of the file as a whole-file PUT, and the server
+copy should match what was written. It then runs the server storing range
+PUTs as whole files, and an append must still leave the whole file there.
+
+OPTIONS:
+   -h      Show this message
+   -b      Path to the fusedav binary (default: ../src/fusedav)
+   -p      Port for the stand-in server (default: 18080)
+   -s      Size of the starting file in MB (default: 4)
+   -n      Number of appends (default: 8)
+   -v      Verbose
+EOF
+}
+
+verbose=0
+fusedav=$(dirname $0)/../src/fusedav
+port=18080
+size=4
+appends=8
+
+while getopts "hb:p:s:n:v" OPTION
+do
+     case $OPTION in
+         h)
+             usage
+             exit 1
+             ;;
+         b)
+             fusedav=$OPTARG
+             ;;
+         p)
+             port=$OPTARG
+             ;;
+         s)
+             size=$OPTARG
+             ;;
+         n)
+             appends=$OPTARG
+             ;;
+         v)
+             verbose=1
+             ;;
+         ?)
+             usage
+             exit
+             ;;
+     esac
+done
+
+. $(dirname $0)/range-put-lib.sh
+
+make_workdir append-put << EOF
+append_put=true
+EOF
+
+start_server server.log
+mount_fusedav
+
+dd if=/dev/urandom of=$workdir/testlog bs=1M count=$size 2>/dev/null
+cp $workdir/testlog $workdir/mnt/testlog
+
+for line in $(seq 1 $appends); do
+    echo "log line $line" >> $workdir/testlog
+    echo "log line $line" >> $workdir/mnt/testlog
+done
+
+ranges=$(grep -c "^PUT /testlog [0-9]*-[0-9]*/[0-9]* 201$" $workdir/server.log)
+fulls=$(grep -c "^PUT /testlog full" $workdir/server.log)
+cmp -s $workdir/testlog $workdir/root/testlog
+appended=$?
+
+# Overwrite the start of the file; that can't go as an append
+printf "rewritten" | dd of=$workdir/testlog conv=notrunc 2>/dev/null
+printf "rewritten" | dd of=$workdir/mnt/testlog conv=notrunc 2>/dev/null
+rewrites=$(($(grep -c "^PUT /testlog full" $workdir/server.log) - fulls))
+cmp -s $workdir/testlog $workdir/root/testlog
+rewritten=$?
+
+unmount_fusedav
+
+# A server which stores the tail as the whole file gets the whole file after all
+start_server ignore.log --ignore-put-ranges
+mount_fusedav
+
+cp $workdir/testlog $workdir/mnt/ignored
+echo "one more line" >> $workdir/testlog
+echo "one more line" >> $workdir/mnt/ignored
+cmp -s $workdir/testlog $workdir/root/ignored
+ignored=$?
+
+unmount_fusedav
+
+[ $fulls -eq 1 ] && [ $ranges -eq $appends ]
+check $? "expected 1 full PUT and $appends appends; got $fulls and $ranges"
+
+[ $appended -eq 0 ]
+check $? "server copy differs from what was appended"
+
+[ $rewrites -eq 1 ] && [ $rewritten -eq 0 ]
+check $? "a write into the middle of the file did not PUT it whole"
+
+[ $ignored -eq 0 ]
+check $? "an append to a server ignoring Content-Range left the file short"
+
+finish
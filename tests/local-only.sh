@@ -0,0 +1,98 @@
+#! /bin/bash
+
+set +e
+
+usage()
+{
+cat << EOF
+usage: $0 options
+
+This script tests local-only paths. It runs range-put-server.py as a
+stand-in fileserver and mounts fusedav against it with local_only_paths
+set, then creates, renames and deletes swap files, lock files and a
+scratch directory. None of that may reach the server, while a readdir
+still lists the local-only entries alongside the remote ones. A swap file
+renamed to a regular name has to be uploaded under that name.
+
+OPTIONS:
+   -h      Show this message
+   -b      Path to the fusedav binary (default: ../src/fusedav)
+   -p      Port for the stand-in server (default: 18080)
+   -v      Verbose
+EOF
+}
+
+verbose=0
+fusedav=$(dirname $0)/../src/fusedav
+port=18080
+
+while getopts "hb:p:v" OPTION
+do
+     case $OPTION in
+         h)
+             usage
+             exit 1
+             ;;
+         b)
+             fusedav=$OPTARG
+             ;;
+         p)
+             port=$OPTARG
+             ;;
+         v)
+             verbose=1
+             ;;
+         ?)
+             usage
+             exit
+             ;;
+     esac
+done
+
+. $(dirname $0)/range-put-lib.sh
+
+make_workdir local-only << EOF
+local_only_paths=*.swp;.~lock.*;/scratch
+EOF
+
+start_server server.log
+mount_fusedav
+
+echo "regular" > $workdir/mnt/regular.txt
+echo "swap" > $workdir/mnt/.regular.txt.swp
+echo "lock" > $workdir/mnt/.~lock.regular.txt#
+mkdir $workdir/mnt/scratch
+echo "session" > $workdir/mnt/scratch/sess_1
+mv $workdir/mnt/.regular.txt.swp $workdir/mnt/.other.swp
+rm $workdir/mnt/.other.swp
+echo "saved" > $workdir/mnt/.saved.txt.swp
+mv $workdir/mnt/.saved.txt.swp $workdir/mnt/saved.txt
+
+listing=$(ls -a $workdir/mnt)
+session=$(cat $workdir/mnt/scratch/sess_1)
+
+unmount_fusedav
+
+if [ $verbose -eq 1 ]; then
+    echo "$listing"
+fi
+
+! grep -q -e "swp" -e "lock" -e "/scratch" $workdir/server.log
+check $? "requests for local-only paths reached the server"
+
+missing=""
+for name in regular.txt saved.txt ".~lock.regular.txt#" scratch; do
+    if ! echo "$listing" | grep -qxF "$name"; then
+        missing="$missing $name"
+    fi
+done
+[ -z "$missing" ]
+check $? "missing from the directory listing:$missing"
+
+[ "$session" == "session" ]
+check $? "could not read back a file in a local-only directory"
+
+[ "$(cat $workdir/root/saved.txt 2>/dev/null)" == "saved" ] && [ -f $workdir/root/regular.txt ]
+check $? "regular files did not reach the server"
+
+finish
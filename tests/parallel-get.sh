@@ -0,0 +1,95 @@
+#! /bin/bash
+
+set +e
+
+usage()
+{
+cat << EOF
+usage: $0 options
+
+This script tests split downloads. It runs range-put-server.py as a
+stand-in fileserver and mounts fusedav against it with parallel_get_size
+set low, then reads a large file and a small one which were put straight
+into the server's directory. The large file should arrive as a head range
+followed by parallel_get_streams ranges, the small one as a single GET,
+and both should match what the server has.
+
+OPTIONS:
+   -h      Show this message
+   -b      Path to the fusedav binary (default: ../src/fusedav)
+   -p      Port for the stand-in server (default: 18080)
+   -s      Size of the large file in MB (default: 24)
+   -n      Number of ranges to fetch at once (default: 4)
+   -v      Verbose
+EOF
+}
+
+verbose=0
+fusedav=$(dirname $0)/../src/fusedav
+port=18080
+size=24
+streams=4
+
+while getopts "hb:p:s:n:v" OPTION
+do
+     case $OPTION in
+         h)
+             usage
+             exit 1
+             ;;
+         b)
+             fusedav=$OPTARG
+             ;;
+         p)
+             port=$OPTARG
+             ;;
+         s)
+             size=$OPTARG
+             ;;
+         n)
+             streams=$OPTARG
+             ;;
+         v)
+             verbose=1
+             ;;
+         ?)
+             usage
+             exit
+             ;;
+     esac
+done
+
+. $(dirname $0)/range-put-lib.sh
+
+make_workdir parallel-get << EOF
+parallel_get_size=2
+parallel_get_streams=$streams
+EOF
+
+dd if=/dev/urandom of=$workdir/root/large bs=1M count=$size 2>/dev/null
+dd if=/dev/urandom of=$workdir/root/small bs=1K count=64 2>/dev/null
+
+start_server server.log
+mount_fusedav
+
+# The listing puts the sizes in the stat cache, which decides whether to split
+ls -l $workdir/mnt > /dev/null
+cmp -s $workdir/root/large $workdir/mnt/large
+large=$?
+cmp -s $workdir/root/small $workdir/mnt/small
+small=$?
+
+unmount_fusedav
+
+heads=$(grep -c "^GET /large 0-1048575 206$" $workdir/server.log)
+ranges=$(grep "^GET /large [0-9]*-[0-9]* 206$" $workdir/server.log | grep -vc " 0-1048575 ")
+[ $heads -eq 1 ] && [ $ranges -eq $streams ]
+check $? "expected a head and $streams ranges for the large file; got $heads and $ranges"
+
+[ $large -eq 0 ]
+check $? "the large file read back differs from the server copy"
+
+grep -q "^GET /small 200$" $workdir/server.log && [ $small -eq 0 ]
+check $? "the small file did not come as a single GET"
+
+finish
@@ -0,0 +1,151 @@
+#! /bin/bash
+
+set +e
+
+usage()
+{
+cat << EOF
+usage: $0 options
+
+This script tests pipelined uploads. It runs range-put-server.py as a
+stand-in fileserver and mounts fusedav against it with pipelined_put=true.
+Each file is written through one descriptor: a file only appended to,
+with a pause while its stream is open, should reach the server as that
+one streamed PUT; a file overwritten or truncated mid-stream should have
+its stream abandoned and be PUT whole when it is closed. It then runs the
+server dropping the connection part way through a stream, and the file
+must still arrive whole. The server copies must match what was written,
+and the pipeline stats fusedav writes on exit must show each outcome.
+
+OPTIONS:
+   -h      Show this message
+   -b      Path to the fusedav binary (default: ../src/fusedav)
+   -p      Port for the stand-in server (default: 18080)
+   -v      Verbose
+EOF
+}
+
+verbose=0
+fusedav=$(dirname $0)/../src/fusedav
+port=18080
+
+while getopts "hb:p:v" OPTION
+do
+     case $OPTION in
+         h)
+             usage
+             exit 1
+             ;;
+         b)
+             fusedav=$OPTARG
+             ;;
+         p)
+             port=$OPTARG
+             ;;
+         v)
+             verbose=1
+             ;;
+         ?)
+             usage
+             exit
+             ;;
+     esac
+done
+
+# Runs ops on one open of FILE, and the same on EXPECTED, which should end
+# up what the server has: "a MB" appends, "o OFFSET" overwrites a few bytes,
+# "t BYTES" truncates and "s SECONDS" waits with the file still open
+writer()
+{
+    python3 - "$@" << 'EOF'
+import os, sys, time
+fd = os.open(sys.argv[1], os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+expected = open(sys.argv[2], 'wb')
+ops = sys.argv[3:]
+for op, arg in zip(ops[0::2], ops[1::2]):
+    if op == 'a':
+        data = os.urandom(int(arg) * 1024 * 1024)
+        for i in range(0, len(data), 65536):
+            os.write(fd, data[i:i + 65536])
+        expected.write(data)
+    elif op == 'o':
+        os.pwrite(fd, b'rewritten', int(arg))
+        expected.seek(int(arg))
+        expected.write(b'rewritten')
+        expected.seek(0, 2)
+    elif op == 't':
+        os.ftruncate(fd, int(arg))
+        os.lseek(fd, 0, os.SEEK_END)
+        expected.truncate(int(arg))
+        expected.seek(0, 2)
+    elif op == 's':
+        time.sleep(int(arg))
+os.close(fd)
+expected.close()
+EOF
+}
+
+# The PUT goes out on release, which close doesn't wait for
+wait_put()
+{
+    for i in $(seq 30); do
+        if grep -q "^PUT /$2 full" $workdir/$1; then
+            return
+        fi
+        sleep 1
+    done
+}
+
+. $(dirname $0)/range-put-lib.sh
+
+make_workdir pipelined-put << EOF
+pipelined_put=true
+EOF
+
+start_server server.log
+mount_fusedav
+
+writer $workdir/mnt/streamed $workdir/streamed a 2 s 2 a 1
+writer $workdir/mnt/overwritten $workdir/overwritten a 2 o 100 a 1
+writer $workdir/mnt/truncated $workdir/truncated a 2 t 1000000 a 1
+for name in streamed overwritten truncated; do
+    wait_put server.log $name
+done
+
+unmount_fusedav
+started=$(stat_value pipeline_started)
+completed=$(stat_value pipeline_done)
+abandoned=$(stat_value pipeline_abandon)
+
+# Drop the connection half way into the stream
+start_server fail.log --fail-after $((1024 * 1024 + 512 * 1024))
+mount_fusedav
+
+writer $workdir/mnt/failed $workdir/failed a 2 s 1 a 1
+wait_put fail.log failed
+
+unmount_fusedav
+failed=$(stat_value pipeline_failed)
+
+for name in streamed overwritten truncated; do
+    cmp -s $workdir/$name $workdir/root/$name
+    check $? "server copy of $name differs from what was written"
+done
+
+[ $(grep -c "^PUT /streamed full $((3 * 1024 * 1024)) 201$" $workdir/server.log) -eq 1 ]
+check $? "the appended file did not arrive as a single streamed PUT"
+
+[ $(grep -c "^PUT /overwritten full" $workdir/server.log) -eq 1 ] &&
+    [ $(grep -c "^PUT /truncated full" $workdir/server.log) -eq 1 ]
+check $? "abandoned streams were not replaced by one whole-file PUT each"
+
+[ "$started" == "3" ] && [ "$completed" == "1" ] && [ "$abandoned" == "2" ]
+check $? "expected 3 streams, 1 done and 2 abandoned; stats say ${started:-none}, ${completed:-none} and ${abandoned:-none}"
+
+grep -q "^FAIL /failed" $workdir/fail.log && cmp -s $workdir/failed $workdir/root/failed
+check $? "a stream the server dropped did not fall back to a whole-file PUT"
+
+[ "$failed" == "1" ]
+check $? "expected 1 failed stream; stats say ${failed:-none}"
+
+finish
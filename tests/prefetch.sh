@@ -0,0 +1,102 @@
+#! /bin/bash
+
+set +e
+
+usage()
+{
+cat << EOF
+usage: $0 options
+
+This script tests prefetching. It runs range-put-server.py as a stand-in
+fileserver and mounts fusedav against it with prefetch_threads set. A
+listing of the root should warm the listings of its subdirectories, so
+listing one of them right after sends no PROPFIND. Two files opened
+together on two visits to a directory should be fetched on the third as
+soon as the first is opened, while a sibling never opened is not.
+
+OPTIONS:
+   -h      Show this message
+   -b      Path to the fusedav binary (default: ../src/fusedav)
+   -p      Port for the stand-in server (default: 18080)
+   -v      Verbose
+EOF
+}
+
+verbose=0
+fusedav=$(dirname $0)/../src/fusedav
+port=18080
+
+while getopts "hb:p:v" OPTION
+do
+     case $OPTION in
+         h)
+             usage
+             exit 1
+             ;;
+         b)
+             fusedav=$OPTARG
+             ;;
+         p)
+             port=$OPTARG
+             ;;
+         v)
+             verbose=1
+             ;;
+         ?)
+             usage
+             exit
+             ;;
+     esac
+done
+
+. $(dirname $0)/range-put-lib.sh
+
+make_workdir prefetch << EOF
+prefetch_threads=2
+prefetch_file_size=64
+EOF
+
+for dir in d1 d2 d3; do
+    mkdir $workdir/root/$dir
+    echo "in $dir" > $workdir/root/$dir/file
+done
+mkdir $workdir/root/lib
+for name in a b c; do
+    echo "version one" > $workdir/root/lib/$name.php
+done
+
+start_server server.log
+mount_fusedav
+
+ls $workdir/mnt > /dev/null
+sleep 1
+warmed=$(grep -cE "^PROPFIND /d1/? 207$" $workdir/server.log)
+ls $workdir/mnt/d1 > /dev/null
+listed=$(grep -cE "^PROPFIND /d1/? 207$" $workdir/server.log)
+
+# Two visits, more than PREFETCH_VISIT_GAP apart, which open a.php and b.php
+for visit in 1 2; do
+    cat $workdir/mnt/lib/a.php $workdir/mnt/lib/b.php > /dev/null
+    sleep 11
+done
+
+# The third visit starts with a.php; b.php should come in behind it
+echo "version two" > $workdir/root/lib/b.php
+cat $workdir/mnt/lib/a.php > /dev/null
+sleep 1
+prefetched=$(grep -c "^GET /lib/b.php 200$" $workdir/server.log)
+content=$(cat $workdir/mnt/lib/b.php)
+untouched=$(grep -c "^GET /lib/c.php" $workdir/server.log)
+
+unmount_fusedav
+
+[ $warmed -eq 1 ] && [ $listed -eq 1 ]
+check $? "expected one PROPFIND of /d1, ahead of its listing; got $warmed before and $listed after"
+
+[ $prefetched -eq 2 ] && [ "$content" == "version two" ]
+check $? "b.php was not fetched ahead of its open (GETs: $prefetched, content: $content)"
+
+[ $untouched -eq 0 ]
+check $? "c.php was fetched though nothing opened it"
+
+finish
@@ -0,0 +1,86 @@
+#! /bin/bash
+
+set +e
+
+usage()
+{
+cat << EOF
+usage: $0 options
+
+This script tests revalidation by PROPFIND etag. It runs
+range-put-server.py as a stand-in fileserver and mounts fusedav against
+it, reads a file, waits out the refresh interval, lists the directory and
+reads the file again. The listing reports the etag fusedav already holds,
+so the second read must not send a GET. After the file changes on the
+server, the same sequence must fetch the new content.
+
+OPTIONS:
+   -h      Show this message
+   -b      Path to the fusedav binary (default: ../src/fusedav)
+   -p      Port for the stand-in server (default: 18080)
+   -v      Verbose
+EOF
+}
+
+verbose=0
+fusedav=$(dirname $0)/../src/fusedav
+port=18080
+
+while getopts "hb:p:v" OPTION
+do
+     case $OPTION in
+         h)
+             usage
+             exit 1
+             ;;
+         b)
+             fusedav=$OPTARG
+             ;;
+         p)
+             port=$OPTARG
+             ;;
+         v)
+             verbose=1
+             ;;
+         ?)
+             usage
+             exit
+             ;;
+     esac
+done
+
+. $(dirname $0)/range-put-lib.sh
+
+make_workdir propfind-etag < /dev/null
+
+echo "first version" > $workdir/root/file.txt
+
+start_server server.log
+mount_fusedav
+
+# Longer than REFRESH_INTERVAL and the stat cache timeout
+wait_out() {
+    sleep 5
+    ls -l $workdir/mnt > /dev/null
+}
+
+ls -l $workdir/mnt > /dev/null
+first=$(cat $workdir/mnt/file.txt)
+wait_out
+again=$(cat $workdir/mnt/file.txt)
+gets_unchanged=$(grep -c "^GET /file.txt" $workdir/server.log)
+
+echo "second version" > $workdir/root/file.txt
+wait_out
+changed=$(cat $workdir/mnt/file.txt)
+gets_changed=$(grep -c "^GET /file.txt 200$" $workdir/server.log)
+
+unmount_fusedav
+
+[ $gets_unchanged -eq 1 ] && [ "$again" == "$first" ]
+check $? "expected the unchanged file to be read with 1 GET; got $gets_unchanged"
+
+[ $gets_changed -eq 2 ] && [ "$changed" == "second version" ]
+check $? "the changed file was not fetched again (GETs: $gets_changed, content: $changed)"
+
+finish
@@ -0,0 +1,111 @@
+#! /bin/bash
+
+set +e
+
+usage()
+{
+cat << EOF
+usage: $0 options
+
+This script tests the RAM tier. It runs range-put-server.py as a stand-in
+fileserver and mounts fusedav against it with ram_tier_size set. A small
+file read over and over is taken into memory, and the stats fusedav writes
+on exit must show reads served from there. A write through the mount, and
+later a new version on the server, must each show on the next read rather
+than what the tier held. A file over ram_tier_file_size must read back
+whole all the same.
+
+OPTIONS:
+   -h      Show this message
+   -b      Path to the fusedav binary (default: ../src/fusedav)
+   -p      Port for the stand-in server (default: 18080)
+   -v      Verbose
+EOF
+}
+
+verbose=0
+fusedav=$(dirname $0)/../src/fusedav
+port=18080
+
+while getopts "hb:p:v" OPTION
+do
+     case $OPTION in
+         h)
+             usage
+             exit 1
+             ;;
+         b)
+             fusedav=$OPTARG
+             ;;
+         p)
+             port=$OPTARG
+             ;;
+         v)
+             verbose=1
+             ;;
+         ?)
+             usage
+             exit
+             ;;
+     esac
+done
+
+. $(dirname $0)/range-put-lib.sh
+
+make_workdir ram-tier << EOF
+ram_tier_size=1
+ram_tier_file_size=4
+EOF
+
+echo "version one" > $workdir/root/hot.txt
+head -c 100000 /dev/urandom > $workdir/root/big.bin
+
+start_server server.log
+mount_fusedav
+
+# The second open takes it in; the rest come from memory
+for i in 1 2 3 4; do
+    first=$(cat $workdir/mnt/hot.txt)
+done
+
+echo "version two" > $workdir/mnt/hot.txt
+written=$(cat $workdir/mnt/hot.txt)
+written_again=$(cat $workdir/mnt/hot.txt)
+
+# Past the freshness window, the server's new version has to come through
+for i in 1 2 3; do
+    cat $workdir/mnt/hot.txt > /dev/null
+done
+echo "version three" > $workdir/root/hot.txt
+sleep 4
+changed=$(cat $workdir/mnt/hot.txt)
+
+for i in 1 2 3; do
+    cmp -s $workdir/root/big.bin $workdir/mnt/big.bin
+    big=$?
+    if [ $big -ne 0 ]; then
+        break
+    fi
+done
+
+unmount_fusedav
+hits=$(stat_value ram_hits)
+admitted=$(stat_value ram_admitted)
+
+[ "$first" == "version one" ]
+check $? "repeated reads gave '$first'"
+
+# Two of the first four reads at least, and more after
+[ ${hits:-0} -ge 2 ] && [ ${admitted:-0} -ge 1 ]
+check $? "no reads came from memory (ram_hits: ${hits:-none}, ram_admitted: ${admitted:-none})"
+
+[ "$written" == "version two" ] && [ "$written_again" == "version two" ]
+check $? "reads after a write gave '$written' and '$written_again'"
+
+[ "$changed" == "version three" ]
+check $? "the server's new version did not replace the held one; read '$changed'"
+
+[ $big -eq 0 ]
+check $? "a file over ram_tier_file_size read back wrong"
+
+finish
@@ -0,0 +1,119 @@
+# This file is part of fusedav.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+# Scaffolding for the tests which mount fusedav against range-put-server.py.
+# A test parses its options into fusedav, port and verbose, sources this,
+# and then has:
+#
+#   make_workdir NAME       $workdir, with root/ (what the server serves),
+#                           mnt/ and cache/ in it, and a fusedav.conf with
+#                           what every such mount needs, then whatever
+#                           comes on standard input
+#   start_server LOG [OPTIONS...]
+#                           run the server, logging to $workdir/LOG
+#   mount_fusedav           mount $workdir/mnt; on failure, stop the server
+#                           and exit 1
+#   unmount_fusedav         unmount, and wait for fusedav and the server
+#                           to exit
+#   stat_value NAME         a counter from the stats fusedav writes to the
+#                           cache as it exits, e.g. ram_hits
+#   check STATUS MESSAGE    count a pass if STATUS is 0; otherwise print
+#                           "FAIL: MESSAGE" and count a fail
+#   finish                  print the logs if verbose, then the tally;
+#                           clean up, and exit 1 on any failure
+
+testdir=$(dirname $0)
+pass=0
+fail=0
+
+make_workdir()
+{
+    workdir=$(mktemp -d /tmp/$1.XXXXXX)
+    mkdir $workdir/root $workdir/mnt $workdir/cache
+    {
+        echo "[fusedav]"
+        echo "progressive_propfind=false"
+        echo "refresh_dir_for_file_stat=false"
+        echo "cache_path=$workdir/cache"
+        cat
+    } > $workdir/fusedav.conf
+}
+
+start_server()
+{
+    local log=$1
+    shift
+    python3 $testdir/range-put-server.py --root $workdir/root --port $port --log $workdir/$log "$@" &
+    serverpid=$!
+    sleep 1
+}
+
+mount_fusedav()
+{
+    $fusedav http://127.0.0.1:$port/ $workdir/mnt -o conf=$workdir/fusedav.conf
+    if [ $? -ne 0 ]; then
+        echo "FAIL: could not mount fusedav"
+        kill $serverpid
+        exit 1
+    fi
+}
+
+unmount_fusedav()
+{
+    fusermount -u $workdir/mnt
+    for i in $(seq 10); do
+        if ! pgrep -f "conf=$workdir/fusedav.conf" > /dev/null; then
+            break
+        fi
+        sleep 1
+    done
+    kill $serverpid
+    wait $serverpid 2> /dev/null
+}
+
+stat_value()
+{
+    local file=$(ls $workdir/cache/stats/* 2> /dev/null | tail -1)
+
+    if [ -n "$file" ]; then
+        awk -v name="$1:" '$1 == name { print $2 }' $file
+    fi
+}
+
+check()
+{
+    if [ $1 -eq 0 ]; then
+        pass=$((pass + 1))
+    else
+        echo "FAIL: $2"
+        fail=$((fail + 1))
+    fi
+}
+
+finish()
+{
+    if [ $verbose -eq 1 ]; then
+        cat $workdir/*.log
+    fi
+
+    echo "$0: pass $pass fail $fail"
+    rm -rf $workdir
+
+    if [ $fail -ne 0 ]; then
+        exit 1
+    fi
+    exit 0
+}
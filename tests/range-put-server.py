@@ -0,0 +1,316 @@
+# This file is part of fusedav.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+# Stand-in fileserver for testing chunked, resumable uploads, and which
+# requests fusedav sends at all.
+#
+# Serves a directory over just enough WebDAV for fusedav to mount it
+# (OPTIONS, PROPFIND, GET, HEAD, PUT, DELETE, MOVE, MKCOL), and accepts
+# PUTs with Content-Range, advertising that with "X-Put-Ranges: bytes" on
+# OPTIONS (and Range GETs with "Accept-Ranges: bytes"). Whole-file PUTs may also come with chunked transfer-encoding, as
+# pipelined uploads send them. Every PUT is logged, one line each, as
+#   PUT <path> <first>-<last>/<total> <status>
+# (or "PUT <path> full <size> <status>") so a test can see which ranges were sent.
+# Other requests are logged as "<METHOD> <path> <status>".
+#
+# A range PUT with If-Match changes the existing file rather than continue an
+# upload: the range is written over a copy of it, the way an append upload
+# only sends the new tail. If-Match has to name the file's current ETag.
+#
+# GETs take "Range: bytes=<first>-<last>" as well, answering 206 with a
+# Content-Range, and If-Match, answering 412 once the file has changed. They
+# are logged as "GET <path> <first>-<last> <status>".
+#
+# PROPFIND reports each file's DAV:getetag, the same ETag a GET would send.
+#
+# --fail-after N drops the connection once, after N bytes of PUT bodies in
+# total have arrived, the way a node failing mid-upload would.
+# --no-ranges stops advertising range support, for the fallback path.
+# --reject-put-ranges still advertises it, but answers range PUTs with 400,
+# the way a server which doesn't know Content-Range on a PUT should.
+# --ignore-put-ranges advertises it too, but stores a range PUT's body as the
+# whole file, the way a careless server would.
+#
+# usage: python3 range-put-server.py --root DIR [--port 8080] [--log FILE]
+#            [--fail-after BYTES] [--no-ranges] [--reject-put-ranges]
+#            [--ignore-put-ranges]
+# Run progressive_propfind=false against it; there is no changes_since support.
+
+import argparse
+import email.utils
+import os
+import re
+import shutil
+import sys
+import threading
+import urllib.parse
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from xml.sax.saxutils import escape
+
+args = None
+log_lock = threading.Lock()
+fail_lock = threading.Lock()
+failed_once = False
+put_bytes = 0
+
+RANGE_RE = re.compile(r'bytes (\d+)-(\d+)/(\d+)')
+GET_RANGE_RE = re.compile(r'bytes=(\d+)-(\d+)$')
+
+
+def log(line):
+    with log_lock:
+        out = open(args.log, 'a') if args.log else sys.stderr
+        out.write(line + '\n')
+        out.flush()
+        if args.log:
+            out.close()
+
+
+def etag_of(fspath):
+    st = os.stat(fspath)
+    return '"%x-%x"' % (st.st_size, st.st_mtime_ns)
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, format, *a):
+        pass
+
+    def fspath(self):
+        path = urllib.parse.unquote(urllib.parse.urlsplit(self.path).path)
+        return os.path.join(args.root, os.path.normpath('/' + path).lstrip('/'))
+
+    def reply(self, status, body=b'', headers=None):
+        if self.command != 'PUT':
+            log('%s %s %d' % (self.command, self.path, status))
+        self.send_response(status)
+        for name, value in (headers or {}).items():
+            self.send_header(name, value)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        if body and self.command != 'HEAD':
+            self.wfile.write(body)
+
+    def read_body(self, out, length):
+        global failed_once, put_bytes
+        received = 0
+        while received < length:
+            chunk = self.rfile.read(min(65536, length - received))
+            if not chunk:
+                return False
+            with fail_lock:
+                put_bytes += len(chunk)
+                if args.fail_after is not None and not failed_once and put_bytes > args.fail_after:
+                    out.write(chunk[:len(chunk) - (put_bytes - args.fail_after)])
+                    failed_once = True
+                    log('FAIL %s after %d bytes' % (self.path, args.fail_after))
+                    self.close_connection = True
+                    self.connection.shutdown(2)
+                    return False
+            out.write(chunk)
+            received += len(chunk)
+        return True
+
+    def read_chunked_body(self, out):
+        # Transfer-Encoding: chunked, as sent by a pipelined PUT
+        while True:
+            line = self.rfile.readline()
+            if not line:
+                return False
+            size = int(line.split(b';')[0].strip(), 16)
+            if size == 0:
+                while self.rfile.readline() not in (b'\r\n', b'\n', b''):
+                    pass
+                return True
+            if not self.read_body(out, size):
+                return False
+            self.rfile.readline()
+
+    def do_OPTIONS(self):
+        headers = {'DAV': '1, 2', 'Allow': 'OPTIONS, PROPFIND, GET, HEAD, PUT, DELETE, MOVE, MKCOL'}
+        if not args.no_ranges:
+            headers['Accept-Ranges'] = 'bytes'
+            headers['X-Put-Ranges'] = 'bytes'
+        self.reply(200, headers=headers)
+
+    def do_PUT(self):
+        fspath = self.fspath()
+        length = int(self.headers.get('Content-Length', 0))
+        content_range = self.headers.get('Content-Range')
+        if_match = self.headers.get('If-Match')
+        os.makedirs(os.path.dirname(fspath), exist_ok=True)
+
+        if if_match is not None and (not os.path.isfile(fspath) or if_match != etag_of(fspath)):
+            self.rfile.read(length)
+            log('PUT %s if-match 412' % self.path)
+            self.reply(412)
+            return
+
+        if content_range is None or args.no_ranges or args.ignore_put_ranges:
+            tmp = fspath + '.put-tmp'
+            with open(tmp, 'wb') as out:
+                if self.headers.get('Transfer-Encoding', '').lower() == 'chunked':
+                    complete = self.read_chunked_body(out)
+                else:
+                    complete = self.read_body(out, length)
+            if not complete:
+                os.unlink(tmp)
+                return
+            os.rename(tmp, fspath)
+            log('PUT %s full %d 201' % (self.path, os.path.getsize(fspath)))
+            self.reply(201, headers={'ETag': etag_of(fspath)})
+            return
+
+        match = RANGE_RE.match(content_range)
+        if not match or args.reject_put_ranges:
+            self.rfile.read(length)
+            log('PUT %s %s 400' % (self.path, content_range.split(' ')[-1]))
+            self.reply(400)
+            return
+        first, last, total = (int(x) for x in match.groups())
+        # Ranges are assembled in a side file; a gap means we lost earlier ones
+        partial = fspath + '.partial'
+        if if_match is not None:
+            shutil.copyfile(fspath, partial)
+        have = os.path.getsize(partial) if os.path.exists(partial) else 0
+        if first > have or last - first + 1 != length:
+            log('PUT %s %d-%d/%d 416' % (self.path, first, last, total))
+            self.reply(416, headers={'Content-Range': 'bytes */%d' % have})
+            return
+        with open(partial, 'r+b' if have else 'wb') as out:
+            out.seek(first)
+            complete = self.read_body(out, length)
+            out.truncate()
+        if not complete:
+            return
+        if last + 1 == total:
+            os.rename(partial, fspath)
+            log('PUT %s %d-%d/%d 201' % (self.path, first, last, total))
+            self.reply(201, headers={'ETag': etag_of(fspath)})
+        else:
+            log('PUT %s %d-%d/%d 202' % (self.path, first, last, total))
+            self.reply(202)
+
+    def do_GET(self):
+        fspath = self.fspath()
+        if not os.path.isfile(fspath):
+            self.reply(404)
+            return
+        with open(fspath, 'rb') as f:
+            body = f.read()
+        etag = etag_of(fspath)
+        if self.headers.get('If-None-Match') == etag:
+            self.reply(304, headers={'ETag': etag})
+            return
+        match = GET_RANGE_RE.match(self.headers.get('Range', ''))
+        if match and not args.no_ranges:
+            first, last = int(match.group(1)), min(int(match.group(2)), len(body) - 1)
+            if_match = self.headers.get('If-Match')
+            if if_match is not None and if_match != etag:
+                log('GET %s %d-%d 412' % (self.path, first, last))
+                self.send_response(412)
+                self.send_header('Content-Length', '0')
+                self.end_headers()
+                return
+            log('GET %s %d-%d 206' % (self.path, first, last))
+            self.send_response(206)
+            self.send_header('ETag', etag)
+            self.send_header('Content-Range', 'bytes %d-%d/%d' % (first, last, len(body)))
+            self.send_header('Content-Length', str(last - first + 1))
+            self.end_headers()
+            if self.command != 'HEAD':
+                self.wfile.write(body[first:last + 1])
+            return
+        self.reply(200, body, {'ETag': etag})
+
+    do_HEAD = do_GET
+
+    def do_DELETE(self):
+        fspath = self.fspath()
+        if os.path.isdir(fspath):
+            shutil.rmtree(fspath)
+        elif os.path.exists(fspath):
+            os.unlink(fspath)
+        else:
+            self.reply(404)
+            return
+        self.reply(204)
+
+    def do_MKCOL(self):
+        os.makedirs(self.fspath(), exist_ok=True)
+        self.reply(201)
+
+    def do_MOVE(self):
+        source = self.fspath()
+        dest = urllib.parse.unquote(urllib.parse.urlsplit(self.headers.get('Destination', '')).path)
+        dest = os.path.join(args.root, os.path.normpath('/' + dest).lstrip('/'))
+        if not os.path.exists(source):
+            self.reply(404)
+            return
+        os.rename(source, dest)
+        self.reply(201)
+
+    def propfind_entry(self, href, fspath):
+        st = os.stat(fspath)
+        isdir = os.path.isdir(fspath)
+        return ('<D:response><D:href>%s</D:href><D:propstat><D:prop>'
+                '<D:resourcetype>%s</D:resourcetype>'
+                '<D:getcontentlength>%d</D:getcontentlength>'
+                '<D:getlastmodified>%s</D:getlastmodified>'
+                '<D:creationdate>%s</D:creationdate>'
+                '%s'
+                '</D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response>') % (
+                    escape(urllib.parse.quote(href)), '<D:collection/>' if isdir else '',
+                    0 if isdir else st.st_size, email.utils.formatdate(st.st_mtime, usegmt=True),
+                    email.utils.formatdate(st.st_ctime, usegmt=True),
+                    '' if isdir else '<D:getetag>%s</D:getetag>' % escape(etag_of(fspath)))
+
+    def do_PROPFIND(self):
+        self.rfile.read(int(self.headers.get('Content-Length', 0)))
+        fspath = self.fspath()
+        href = urllib.parse.unquote(urllib.parse.urlsplit(self.path).path)
+        if not os.path.exists(fspath):
+            self.reply(404)
+            return
+        entries = [self.propfind_entry(href, fspath)]
+        if os.path.isdir(fspath) and self.headers.get('Depth', '1') != '0':
+            for name in sorted(os.listdir(fspath)):
+                if name.endswith('.partial') or name.endswith('.put-tmp'):
+                    continue
+                entries.append(self.propfind_entry(href.rstrip('/') + '/' + name, os.path.join(fspath, name)))
+        body = ('<?xml version="1.0" encoding="utf-8"?><D:multistatus xmlns:D="DAV:">%s</D:multistatus>'
+                % ''.join(entries)).encode('utf-8')
+        self.reply(207, body, {'Content-Type': 'application/xml; charset="utf-8"'})
+
+
+def main():
+    global args
+    parser = argparse.ArgumentParser(description='stand-in fileserver for resumable upload tests')
+    parser.add_argument('--root', required=True)
+    parser.add_argument('--port', type=int, default=8080)
+    parser.add_argument('--log')
+    parser.add_argument('--fail-after', type=int)
+    parser.add_argument('--no-ranges', action='store_true')
+    parser.add_argument('--reject-put-ranges', action='store_true')
+    parser.add_argument('--ignore-put-ranges', action='store_true')
+    args = parser.parse_args()
+    os.makedirs(args.root, exist_ok=True)
+    ThreadingHTTPServer(('127.0.0.1', args.port), Handler).serve_forever()
+
+
+if __name__ == '__main__':
+    main()
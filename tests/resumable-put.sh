@@ -0,0 +1,111 @@
+#! /bin/bash
+
+set +e
+
+usage()
+{
+cat << EOF
+usage: $0 options
+
+This script tests chunked, resumable uploads. It runs range-put-server.py
+as a stand-in fileserver, mounts fusedav against it with 1 MB upload chunks,
+writes a large file in write-back mode, and has the server drop the
+connection part way through. The write-back retry should pick up at the
+failed chunk rather than start over, and the server copy should match what
+was written. It then runs the server refusing range PUTs it claims to take,
+and a large file should still land, sent whole.
+
+OPTIONS:
+   -h      Show this message
+   -b      Path to the fusedav binary (default: ../src/fusedav)
+   -p      Port for the stand-in server (default: 18080)
+   -s      Size of the test file in MB (default: 8)
+   -v      Verbose
+EOF
+}
+
+verbose=0
+fusedav=$(dirname $0)/../src/fusedav
+port=18080
+size=8
+
+while getopts "hb:p:s:v" OPTION
+do
+     case $OPTION in
+         h)
+             usage
+             exit 1
+             ;;
+         b)
+             fusedav=$OPTARG
+             ;;
+         p)
+             port=$OPTARG
+             ;;
+         s)
+             size=$OPTARG
+             ;;
+         v)
+             verbose=1
+             ;;
+         ?)
+             usage
+             exit
+             ;;
+     esac
+done
+
+. $(dirname $0)/range-put-lib.sh
+
+make_workdir resumable-put << EOF
+writeback=true
+upload_chunk_size=1
+EOF
+
+# Drop the connection half way into the third chunk
+start_server server.log --fail-after $((2 * 1024 * 1024 + 512 * 1024))
+mount_fusedav
+
+dd if=/dev/urandom of=$workdir/testfile bs=1M count=$size 2>/dev/null
+cp $workdir/testfile $workdir/mnt/testfile
+
+# The first upload fails; wait for the retry to land
+for wait in $(seq 1 30); do
+    if [ -f $workdir/root/testfile ]; then
+        break
+    fi
+    sleep 1
+done
+
+unmount_fusedav
+
+# A server which answers a range PUT with 400 gets the whole file instead
+start_server reject.log --reject-put-ranges
+mount_fusedav
+
+cp $workdir/testfile $workdir/mnt/rejected
+for wait in $(seq 1 30); do
+    if [ -f $workdir/root/rejected ]; then
+        break
+    fi
+    sleep 1
+done
+
+unmount_fusedav
+
+grep -q "^FAIL" $workdir/server.log
+check $? "server never dropped the connection"
+
+# Every chunk should have been accepted exactly once; a restart from zero
+# would show the leading chunks twice
+dups=$(grep "^PUT /testfile" $workdir/server.log | grep -v " 416$" | awk '{print $3}' | sort | uniq -d | wc -l)
+[ $dups -eq 0 ]
+check $? "$dups chunks were uploaded more than once"
+
+cmp -s $workdir/testfile $workdir/root/testfile
+check $? "server copy differs from what was written"
+
+grep -q "^PUT /rejected full" $workdir/reject.log && cmp -s $workdir/testfile $workdir/root/rejected
+check $? "refused range PUTs did not fall back to a whole-file PUT"
+
+finish
@@ -0,0 +1,88 @@
+#! /bin/bash
+
+set +e
+
+usage()
+{
+cat << EOF
+usage: $0 options
+
+This script tests stale-while-revalidate. It runs range-put-server.py as
+a stand-in fileserver and mounts fusedav against it with
+stale_while_revalidate covering *.txt, reads two files, changes both on
+the server and waits out the refresh interval. Reading the .txt file again
+must give the copy already cached, and a read a moment later the new one,
+fetched behind the first; the other file must come back new at once.
+
+OPTIONS:
+   -h      Show this message
+   -b      Path to the fusedav binary (default: ../src/fusedav)
+   -p      Port for the stand-in server (default: 18080)
+   -v      Verbose
+EOF
+}
+
+verbose=0
+fusedav=$(dirname $0)/../src/fusedav
+port=18080
+
+while getopts "hb:p:v" OPTION
+do
+     case $OPTION in
+         h)
+             usage
+             exit 1
+             ;;
+         b)
+             fusedav=$OPTARG
+             ;;
+         p)
+             port=$OPTARG
+             ;;
+         v)
+             verbose=1
+             ;;
+         ?)
+             usage
+             exit
+             ;;
+     esac
+done
+
+. $(dirname $0)/range-put-lib.sh
+
+make_workdir stale-revalidate << EOF
+stale_while_revalidate=*.txt:60
+EOF
+
+# Same length, so the size in the stat cache fits either version
+echo "version one" > $workdir/root/page.txt
+echo "version one" > $workdir/root/data.bin
+
+start_server server.log
+mount_fusedav
+
+ls -l $workdir/mnt > /dev/null
+cat $workdir/mnt/page.txt $workdir/mnt/data.bin > /dev/null
+
+echo "version two" > $workdir/root/page.txt
+echo "version two" > $workdir/root/data.bin
+# Longer than REFRESH_INTERVAL and the stat cache timeout
+sleep 5
+
+stale=$(cat $workdir/mnt/page.txt)
+blocking=$(cat $workdir/mnt/data.bin)
+# Give the revalidator time to finish
+sleep 1
+revalidated=$(cat $workdir/mnt/page.txt)
+gets=$(grep -c "^GET /page.txt 200$" $workdir/server.log)
+
+unmount_fusedav
+
+[ "$stale" == "version one" ] && [ "$revalidated" == "version two" ] && [ $gets -eq 2 ]
+check $? "expected the cached copy, then the new one; got '$stale', then '$revalidated' ($gets GETs)"
+
+[ "$blocking" == "version two" ]
+check $? "a file without a staleness bound was served stale: '$blocking'"
+
+finish
@@ -0,0 +1,128 @@
+#! /bin/bash
+
+set +e
+
+usage()
+{
+cat << EOF
+usage: $0 options
+
+This script tests warming the caches from a manifest. It runs
+range-put-server.py as a stand-in fileserver and mounts fusedav against it
+with warm_manifest set. The manifest names a glob, a subtree and a single
+file, under a max_bytes too small for one large file in the subtree: all
+but that file and the ones the glob doesn't match should be fetched
+without anything being opened, and the status file should say so. A new
+manifest moved into place should then be run as well.
+
+OPTIONS:
+   -h      Show this message
+   -b      Path to the fusedav binary (default: ../src/fusedav)
+   -p      Port for the stand-in server (default: 18080)
+   -v      Verbose
+EOF
+}
+
+verbose=0
+fusedav=$(dirname $0)/../src/fusedav
+port=18080
+
+while getopts "hb:p:v" OPTION
+do
+     case $OPTION in
+         h)
+             usage
+             exit 1
+             ;;
+         b)
+             fusedav=$OPTARG
+             ;;
+         p)
+             port=$OPTARG
+             ;;
+         v)
+             verbose=1
+             ;;
+         ?)
+             usage
+             exit
+             ;;
+     esac
+done
+
+# Wait up to 30 seconds for the status file to report a finished run
+wait_done()
+{
+    for i in $(seq 30); do
+        if grep -q "^state done$" $workdir/warm.manifest.status 2> /dev/null; then
+            return 0
+        fi
+        sleep 1
+    done
+    return 1
+}
+
+. $(dirname $0)/range-put-lib.sh
+
+make_workdir warm-manifest << EOF
+warm_threads=2
+warm_rate=20
+EOF
+echo "warm_manifest=$workdir/warm.manifest" >> $workdir/fusedav.conf
+
+mkdir -p $workdir/root/site/a $workdir/root/site/b $workdir/root/other
+echo "a { }" > $workdir/root/site/a/x.css
+echo "var y;" > $workdir/root/site/a/y.js
+echo "b { }" > $workdir/root/site/b/z.css
+echo "small" > $workdir/root/other/small.txt
+head -c 300000 /dev/zero > $workdir/root/other/big.bin
+echo "<?php" > $workdir/root/index.php
+
+cat > $workdir/warm.manifest << EOF
+# Too small for big.bin
+max_bytes 100K
+/site/*.css
+/other/
+/index.php
+EOF
+
+start_server server.log
+mount_fusedav
+
+wait_done
+first_done=$?
+first_status=$(cat $workdir/warm.manifest.status 2> /dev/null)
+warmed=0
+for file in /site/a/x.css /site/b/z.css /other/small.txt /index.php; do
+    warmed=$((warmed + $(grep -c "^GET $file 200$" $workdir/server.log)))
+done
+unmatched=$(grep -c "^GET /site/a/y.js" $workdir/server.log)
+over_budget=$(grep -c "^GET /other/big.bin" $workdir/server.log)
+
+# A new manifest, moved into place, is picked up by the running mount
+rm -f $workdir/warm.manifest.status
+echo "/site/a/y.js" > $workdir/warm.manifest.new
+mv $workdir/warm.manifest.new $workdir/warm.manifest
+wait_done
+second_done=$?
+rerun=$(grep -c "^GET /site/a/y.js 200$" $workdir/server.log)
+
+unmount_fusedav
+
+if [ $verbose -eq 1 ]; then
+    echo "$first_status"
+fi
+
+[ $first_done -eq 0 ] && [ $warmed -eq 4 ]
+check $? "expected the manifest's four files fetched and the run done; got $warmed GETs"
+
+[ $unmatched -eq 0 ]
+check $? "y.js was fetched though the glob doesn't match it"
+
+[ $over_budget -eq 0 ] && echo "$first_status" | grep -q "^skipped 1$"
+check $? "big.bin should have been skipped for max_bytes; status was: $first_status"
+
+[ $second_done -eq 0 ] && [ $rerun -eq 1 ]
+check $? "the new manifest was not run (GETs of y.js: $rerun)"
+
+finish